@@ -21,6 +21,9 @@ SIVAL(buf,pos,val) - put a 4 byte SMB value into a buffer
 SSVALS(buf,pos,val) - signed version of SSVAL()
 SIVALS(buf,pos,val) - signed version of SIVAL()
 
+BVAL(buf,pos) - extract an 8 byte SMB value
+SBVAL(buf,pos,val) - put an 8 byte SMB value into a buffer
+
 RSVAL(buf,pos) - like SVAL() but for NMB byte ordering
 RIVAL(buf,pos) - like IVAL() but for NMB byte ordering
 RSSVAL(buf,pos,val) - like SSVAL() but for NMB ordering
@@ -77,6 +80,13 @@ RSIVAL(buf,pos,val) - like SIVAL() but for NMB ordering
 
 #endif
 
+/* 8 byte values are made of two 4 byte values, low half first */
+#define BVAL(buf, pos)                                                         \
+	((uint64_t) IVAL(buf, pos) | (uint64_t) IVAL(buf, (pos) + 4) << 32)
+#define SBVAL(buf, pos, val)                                                   \
+	(SIVAL(buf, pos, (uint64_t) (val) & 0xFFFFFFFF),                       \
+	 SIVAL(buf, (pos) + 4, (uint64_t) (val) >> 32))
+
 /* now the reverse routines - these are used in nmb packets (mostly) */
 #define SREV(x) ((((x) & 0xFF) << 8) | (((x) >> 8) & 0xFF))
 #define IREV(x) ((SREV(x) << 16) | (SREV((x) >> 16)))
@@ -11,7 +11,10 @@
 
 #include "dir.h"
 
+#include <ctype.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -19,6 +22,7 @@
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "byteorder.h"
 #include "guards.h" /* IWYU pragma: keep */
@@ -37,7 +41,93 @@ static uint32_t dircounter = 0;
 
 #define NUMDIRPTRS 256
 
-static struct dptr_struct {
+/* Directory listings are kept for reuse when the same directory is listed
+   again. A listing is only reused if the directory has not changed, we have
+   not changed anything since, and it is not too old: changes made to files
+   by other processes do not change the directory's timestamps. */
+#define DIR_CACHE_SIZE    4
+#define DIR_CACHE_TIMEOUT 5
+
+/* Files can be created in a directory within the same second that we listed
+   it, so use the sub-second part of its change time where we have it */
+#if defined(__APPLE__)
+#define ST_CTIME_NSEC(st) ((st)->st_ctimespec.tv_nsec)
+#elif defined(linux) || defined(__FreeBSD__) || defined(__NetBSD__)
+#define ST_CTIME_NSEC(st) ((st)->st_ctim.tv_nsec)
+#else
+#define ST_CTIME_NSEC(st) 0L
+#endif
+
+/* While a Dir is open, its directory is only needed to look up entries
+   relative to it, not to read it */
+#ifdef O_PATH
+#define DIR_FD_FLAGS (O_PATH | O_DIRECTORY)
+#else
+#define DIR_FD_FLAGS (O_RDONLY | O_DIRECTORY)
+#endif
+
+/* Smallest number of hash buckets in a directory's name index */
+#define DIR_INDEX_MIN_BUCKETS 64
+
+/* Bumped whenever we change something that might be in a directory */
+static unsigned int dir_cache_generation = 0;
+
+/* Every listing in this process, cached or not; see dir_cache_file_changed() */
+static struct dir_listing *live_listings = NULL;
+
+/* The result of stat() and dos_mode() for one directory entry */
+struct dir_stat {
+	bool valid;
+	int err;
+	int mode;
+	struct stat st;
+};
+
+/* One entry in a directory's name index. Every directory entry is indexed
+   by the name we show to clients, and again by its 8.3 mangled form if that
+   is different. */
+struct dir_index_node {
+	unsigned int hash;
+	int entry;
+	bool is_83;
+	int next;
+};
+
+/* Hash index for looking up directory entries by name */
+struct dir_index {
+	int num_buckets;
+	int *buckets;
+	int num_nodes;
+	struct dir_index_node *nodes;
+};
+
+/* The contents of a directory. Shared between any number of Dirs, and the
+   dir cache, until the last reference is released. While any Dirs are open
+   on it, the directory is kept open so that its entries can be looked up
+   relative to it; a listing that is only cached holds no descriptor. */
+struct dir_listing {
+	int refcount;
+	int open_dirs;
+	int fd;
+	int cnum;
+	struct dir_stamp stamp;
+	time_t created;
+	int numentries;
+	int mallocsize;
+	char *data;
+	int *offsets;            /* start of each entry in data */
+	struct dir_stat *stats;  /* filled in on demand */
+	struct dir_index *index; /* built on demand by find_dir_name() */
+	struct dir_listing *prev, *next; /* in live_listings */
+};
+
+struct dir_struct {
+	struct dir_listing *listing;
+	int pos;
+	char *last; /* last name returned by read_dir_name() */
+};
+
+struct dptr_struct {
 	int pid;
 	int cnum;
 	uint32_t lastused;
@@ -50,25 +140,84 @@ static struct dptr_struct {
 	uint16_t attr; /* Field only used for lanman2 trans2_findfirst/next
 	                searches */
 	char *path;
-} dirptrs[NUMDIRPTRS];
+};
+
+/* Each client session has its own table of dptrs. */
+struct dptr_table {
+	struct dptr_struct dirptrs[NUMDIRPTRS];
+	int dptrs_open;
+	struct dir_listing *dir_cache[DIR_CACHE_SIZE];
+};
 
-static int dptrs_open = 0;
+static struct dptr_table *dptr_table;
+static struct dptr_struct *dirptrs;
 
-/* Initialise the dir array */
-void init_dptrs(void)
+/* Allocate and initialise a new dir array */
+struct dptr_table *dptr_table_new(void)
 {
-	static bool dptrs_init = false;
+	struct dptr_table *t = checked_calloc(1, sizeof(struct dptr_table));
 	int i;
 
-	if (dptrs_init)
+	for (i = 0; i < NUMDIRPTRS; i++) {
+		t->dirptrs[i].valid = false;
+		t->dirptrs[i].wcard = NULL;
+		t->dirptrs[i].ptr = NULL;
+		t->dirptrs[i].path = checked_strdup("");
+	}
+	t->dptrs_open = 0;
+
+	return t;
+}
+
+static void release_listing(struct dir_listing *l)
+{
+	if (l == NULL || --l->refcount > 0)
 		return;
+	if (l->prev != NULL) {
+		l->prev->next = l->next;
+	} else {
+		live_listings = l->next;
+	}
+	if (l->next != NULL) {
+		l->next->prev = l->prev;
+	}
+	if (l->fd >= 0) {
+		close(l->fd);
+	}
+	free(l->data);
+	free(l->offsets);
+	free(l->stats);
+	if (l->index != NULL) {
+		free(l->index->buckets);
+		free(l->index->nodes);
+		free(l->index);
+	}
+	free(l);
+}
+
+/* Free a dir array. All dptrs should already have been closed. */
+void dptr_table_free(struct dptr_table *t)
+{
+	int i;
+
 	for (i = 0; i < NUMDIRPTRS; i++) {
-		dirptrs[i].valid = false;
-		dirptrs[i].wcard = NULL;
-		dirptrs[i].ptr = NULL;
-		dirptrs[i].path = checked_strdup("");
+		free(t->dirptrs[i].path);
+	}
+	for (i = 0; i < DIR_CACHE_SIZE; i++) {
+		release_listing(t->dir_cache[i]);
 	}
-	dptrs_init = true;
+	if (dptr_table == t) {
+		dptr_table = NULL;
+		dirptrs = NULL;
+	}
+	free(t);
+}
+
+/* Set the dir array that all the other functions here operate on */
+void dptr_table_select(struct dptr_table *t)
+{
+	dptr_table = t;
+	dirptrs = t->dirptrs;
 }
 
 /* Idle a dptr - the directory is closed but the control info is kept */
@@ -76,7 +225,7 @@ static void dptr_idle(int key)
 {
 	if (dirptrs[key].valid && dirptrs[key].ptr) {
 		DEBUG("Idling dptr key %d\n", key);
-		dptrs_open--;
+		dptr_table->dptrs_open--;
 		close_dir(dirptrs[key].ptr);
 		dirptrs[key].ptr = NULL;
 	}
@@ -108,11 +257,11 @@ static Dir *dptr_get(int key, uint32_t lastused)
 		if (lastused)
 			dp->lastused = lastused;
 		if (!dp->ptr) {
-			if (dptrs_open >= MAXDIR)
+			if (dptr_table->dptrs_open >= MAXDIR)
 				dptr_idleoldest();
 			DEBUG("Reopening dptr key %d\n", key);
 			if ((dp->ptr = open_dir(dp->cnum, dp->path)))
-				dptrs_open++;
+				dptr_table->dptrs_open++;
 		}
 		return dp->ptr;
 	}
@@ -182,7 +331,7 @@ void dptr_close(int key)
 		DEBUG("closing dptr key %d\n", key);
 		if (dirptrs[key].ptr) {
 			close_dir(dirptrs[key].ptr);
-			dptrs_open--;
+			dptr_table->dptrs_open--;
 		}
 		/* Lanman 2 specific code */
 		free(dirptrs[key].wcard);
@@ -198,6 +347,15 @@ void dptr_closecnum(int cnum)
 	for (i = 0; i < NUMDIRPTRS; i++)
 		if (dirptrs[i].valid && dirptrs[i].cnum == cnum)
 			dptr_close(i);
+
+	/* the cnum may be reused for a different share */
+	for (i = 0; i < DIR_CACHE_SIZE; i++) {
+		struct dir_listing *l = dptr_table->dir_cache[i];
+		if (l != NULL && l->cnum == cnum) {
+			release_listing(l);
+			dptr_table->dir_cache[i] = NULL;
+		}
+	}
 }
 
 /* Idle all dptrs for a cnum */
@@ -233,7 +391,7 @@ static bool start_dir(int cnum, char *directory)
 
 	Connections[cnum].dirptr = open_dir(cnum, directory);
 	if (Connections[cnum].dirptr) {
-		dptrs_open++;
+		dptr_table->dptrs_open++;
 		string_set(&Connections[cnum].dirpath, directory);
 		return true;
 	}
@@ -251,7 +409,7 @@ int dptr_create(int cnum, char *path, bool expect_close, int pid)
 	if (!start_dir(cnum, path))
 		return -2; /* Code to say use a unix error return code. */
 
-	if (dptrs_open >= MAXDIR)
+	if (dptr_table->dptrs_open >= MAXDIR)
 		dptr_idleoldest();
 
 	for (i = 0; i < NUMDIRPTRS; i++)
@@ -376,25 +534,20 @@ bool dir_check_ftype(int cnum, int mode, struct stat *st, int dirtype)
 }
 
 bool get_dir_entry(int cnum, const char *mask, int dirtype, char *fname,
-                   int *size, int *mode, time_t *date)
+                   uint32_t *size, int *mode, time_t *date)
 {
 	char *dname;
 	bool found = false;
 	struct stat sbuf;
-	pstring path;
-	pstring pathreal;
 	bool isrootdir;
 	pstring filename;
-	bool needslash;
 
-	*path = *pathreal = *filename = 0;
+	*filename = 0;
 
 	isrootdir = (strequal(Connections[cnum].dirpath, "./") ||
 	             strequal(Connections[cnum].dirpath, ".") ||
 	             strequal(Connections[cnum].dirpath, "/"));
 
-	needslash = !string_has_suffix(Connections[cnum].dirpath, "/");
-
 	if (!Connections[cnum].dirptr)
 		return false;
 
@@ -423,30 +576,23 @@ bool get_dir_entry(int cnum, const char *mask, int dirtype, char *fname,
 		}
 
 		pstrcpy(fname, filename);
-		*path = 0;
-		pstrcpy(path, Connections[cnum].dirpath);
-		if (needslash)
-			pstrcat(path, "/");
-		pstrcpy(pathreal, path);
-		pstrcat(path, fname);
-		pstrcat(pathreal, dname);
-		if (stat(pathreal, &sbuf) != 0) {
-			DEBUG("Couldn't stat 1 [%s]\n", path);
+		if (!stat_dir_entry(Connections[cnum].dirptr, &sbuf, mode)) {
+			DEBUG("Couldn't stat 1 [%s/%s]\n",
+			      Connections[cnum].dirpath, dname);
 			continue;
 		}
 
-		*mode = dos_mode(cnum, pathreal, &sbuf);
-
 		if (!dir_check_ftype(cnum, *mode, &sbuf, dirtype)) {
 			DEBUG("[%s] attribs didn't match %x\n", filename,
 			      dirtype);
 			continue;
 		}
 
-		*size = sbuf.st_size;
+		*size = size32(sbuf.st_size);
 		*date = sbuf.st_mtime;
 
-		DEBUG("found %s fname=%s\n", pathreal, fname);
+		DEBUG("found %s/%s fname=%s\n", Connections[cnum].dirpath,
+		      dname, fname);
 
 		found = true;
 	}
@@ -454,51 +600,218 @@ bool get_dir_entry(int cnum, const char *mask, int dirtype, char *fname,
 	return found;
 }
 
-struct dir_struct {
-	int pos;
-	int numentries;
-	int mallocsize;
-	char *data;
-	char *current;
-};
+/* Discard all cached directory listings and anything else recorded with
+   dir_stamp_set(); called whenever we create, delete or rename a file, or
+   change its attributes. */
+void dir_cache_invalidate(void)
+{
+	dir_cache_generation++;
+}
 
-Dir *open_dir(int cnum, char *name)
+/* Called when the contents of a file have changed but nothing else has, so
+   that only what was recorded about that one file is thrown away. dev and
+   inode identify the file as they do in the open file table. */
+void dir_cache_file_changed(uint32_t dev, uint32_t inode)
 {
-	Dir *dirp;
+	struct dir_listing *l;
+	struct dir_stat *ds;
+	int i;
+
+	for (l = live_listings; l != NULL; l = l->next) {
+		/* nothing about the entries has been looked at yet */
+		if (l->stats == NULL || (uint32_t) l->stamp.dev != dev) {
+			continue;
+		}
+		for (i = 0; i < l->numentries; i++) {
+			ds = &l->stats[i];
+			if (ds->valid && ds->err == 0 &&
+			    (uint32_t) ds->st.st_ino == inode) {
+				ds->valid = false;
+			}
+		}
+	}
+}
+
+/* Record the state of the directory with the given stat */
+void dir_stamp_set(struct dir_stamp *stamp, struct stat *st)
+{
+	stamp->dev = st->st_dev;
+	stamp->ino = st->st_ino;
+	stamp->mtime = st->st_mtime;
+	stamp->ctime = st->st_ctime;
+	stamp->ctime_nsec = ST_CTIME_NSEC(st);
+	stamp->generation = dir_cache_generation;
+}
+
+/* Returns true if the directory with the given stat is the same one that
+   the stamp was taken of, and nothing in it has changed since */
+bool dir_stamp_matches(const struct dir_stamp *stamp, struct stat *st)
+{
+	return stamp->dev == st->st_dev && stamp->ino == st->st_ino &&
+	       stamp->mtime == st->st_mtime && stamp->ctime == st->st_ctime &&
+	       stamp->ctime_nsec == ST_CTIME_NSEC(st) &&
+	       stamp->generation == dir_cache_generation;
+}
+
+/* Look for a cached listing of the directory with the given stat */
+static struct dir_listing *find_cached_listing(int cnum, struct stat *st)
+{
+	struct dir_listing *l;
+	time_t now = time(NULL);
+	int i;
+
+	for (i = 0; i < DIR_CACHE_SIZE; i++) {
+		l = dptr_table->dir_cache[i];
+		if (l == NULL || l->cnum != cnum || l->stamp.dev != st->st_dev ||
+		    l->stamp.ino != st->st_ino) {
+			continue;
+		}
+		if (dir_stamp_matches(&l->stamp, st) &&
+		    now - l->created < DIR_CACHE_TIMEOUT) {
+			return l;
+		}
+		/* stale */
+		release_listing(l);
+		dptr_table->dir_cache[i] = NULL;
+	}
+
+	return NULL;
+}
+
+/* Put a new listing in the cache, replacing the oldest one if it is full */
+static void cache_listing(struct dir_listing *l)
+{
+	int i, oldest = 0;
+
+	for (i = 0; i < DIR_CACHE_SIZE; i++) {
+		if (dptr_table->dir_cache[i] == NULL) {
+			oldest = i;
+			break;
+		}
+		if (dptr_table->dir_cache[i]->created <
+		    dptr_table->dir_cache[oldest]->created) {
+			oldest = i;
+		}
+	}
+
+	release_listing(dptr_table->dir_cache[oldest]);
+	dptr_table->dir_cache[oldest] = l;
+	l->refcount++;
+}
+
+/* Read the directory dirfd, which is closed again once it has been read */
+static struct dir_listing *read_listing(int dirfd)
+{
+	struct dir_listing *l;
 	struct dirent *de;
-	DIR *d = opendir(name);
-	int used = 0;
+	DIR *d;
+	int used = 0, offsets_size = 0;
+	int fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY);
 
+	if (fd < 0) {
+		return NULL;
+	}
+	d = fdopendir(fd);
 	if (d == NULL) {
+		close(fd);
 		return NULL;
 	}
-	dirp = checked_malloc(sizeof(Dir));
-	dirp->pos = dirp->numentries = dirp->mallocsize = 0;
-	dirp->data = dirp->current = NULL;
+	l = checked_calloc(1, sizeof(struct dir_listing));
+	l->fd = -1;
+	l->next = live_listings;
+	if (live_listings != NULL) {
+		live_listings->prev = l;
+	}
+	live_listings = l;
 
 	while ((de = readdir(d)) != NULL) {
-		int l = strlen(de->d_name) + 1;
+		int len = strlen(de->d_name) + 1;
 
-		if (used + l > dirp->mallocsize) {
-			int s = MAX(used + l, used + 2000);
-			dirp->data = checked_realloc(dirp->data, s);
-			dirp->mallocsize = s;
-			dirp->current = dirp->data;
+		if (used + len > l->mallocsize) {
+			int s = MAX(used + len, used + 2000);
+			l->data = checked_realloc(l->data, s);
+			l->mallocsize = s;
+		}
+		/* one extra so there is always an offset for the end */
+		if (l->numentries + 1 >= offsets_size) {
+			offsets_size = MAX(offsets_size * 2, 64);
+			l->offsets = checked_realloc(
+			    l->offsets, offsets_size * sizeof(int));
 		}
-		pstrcpy(dirp->data + used, de->d_name);
-		used += l;
-		dirp->numentries++;
+		pstrcpy(l->data + used, de->d_name);
+		l->offsets[l->numentries] = used;
+		used += len;
+		l->numentries++;
 	}
-
+	if (l->offsets == NULL) {
+		l->offsets = checked_malloc(sizeof(int));
+	}
+	l->offsets[l->numentries] = used;
 	closedir(d);
+
+	return l;
+}
+
+Dir *open_dir(int cnum, char *name)
+{
+	Dir *dirp;
+	struct dir_listing *l;
+	struct stat st;
+	int fd = openat(CONN_ROOT(cnum), name, DIR_FD_FLAGS);
+
+	if (fd < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return NULL;
+	}
+
+	l = find_cached_listing(cnum, &st);
+	if (l != NULL) {
+		DEBUG("using cached listing of %s (%d entries)\n", name,
+		      l->numentries);
+	} else {
+		l = read_listing(fd);
+		if (l == NULL) {
+			close(fd);
+			return NULL;
+		}
+		l->cnum = cnum;
+		dir_stamp_set(&l->stamp, &st);
+		l->created = time(NULL);
+		cache_listing(l);
+	}
+
+	/* it is already open if another Dir is using the listing */
+	if (l->fd < 0) {
+		l->fd = fd;
+	} else {
+		close(fd);
+	}
+
+	dirp = checked_malloc(sizeof(Dir));
+	dirp->listing = l;
+	dirp->pos = 0;
+	dirp->last = NULL;
+	l->refcount++;
+	l->open_dirs++;
+
 	return dirp;
 }
 
 void close_dir(Dir *dirp)
 {
+	struct dir_listing *l;
+
 	if (!dirp)
 		return;
-	free(dirp->data);
+	l = dirp->listing;
+	if (--l->open_dirs == 0) {
+		close(l->fd);
+		l->fd = -1;
+	}
+	release_listing(l);
 	free(dirp);
 }
 
@@ -506,11 +819,11 @@ char *read_dir_name(Dir *dirp)
 {
 	char *ret;
 
-	if (!dirp || !dirp->current || dirp->pos >= dirp->numentries)
+	if (!dirp || dirp->pos >= dirp->listing->numentries)
 		return NULL;
 
-	ret = dirp->current;
-	dirp->current = skip_string(dirp->current);
+	ret = dirp->listing->data + dirp->listing->offsets[dirp->pos];
+	dirp->last = ret;
 	dirp->pos++;
 
 	return ret;
@@ -518,17 +831,19 @@ char *read_dir_name(Dir *dirp)
 
 bool seek_dir(Dir *dirp, int pos)
 {
+	struct dir_listing *l;
+
 	if (!dirp)
 		return false;
 
-	if (pos < dirp->pos) {
-		dirp->current = dirp->data;
-		dirp->pos = 0;
+	l = dirp->listing;
+	dirp->pos = MAX(0, MIN(pos, l->numentries));
+	if (dirp->pos > 0) {
+		dirp->last = l->data + l->offsets[dirp->pos - 1];
+	} else {
+		dirp->last = NULL;
 	}
 
-	while (dirp->pos < pos && read_dir_name(dirp))
-		;
-
 	return dirp->pos == pos;
 }
 
@@ -539,3 +854,152 @@ int tell_dir(Dir *dirp)
 
 	return dirp->pos;
 }
+
+/* Get the stat and DOS attributes for the entry last returned by
+   read_dir_name(). These are looked up the first time and remembered for as
+   long as the listing is kept. */
+bool stat_dir_entry(Dir *dirp, struct stat *st, int *mode)
+{
+	struct dir_listing *l = dirp->listing;
+	int fd = l->fd;
+	struct dir_stat *ds;
+
+	if (dirp->pos < 1) {
+		errno = EINVAL;
+		return false;
+	}
+
+	if (l->stats == NULL) {
+		l->stats = checked_calloc(l->numentries, sizeof(struct dir_stat));
+	}
+
+	ds = &l->stats[dirp->pos - 1];
+	if (!ds->valid) {
+		ds->err = fstatat(fd, dirp->last, &ds->st, 0) == 0 ? 0 : errno;
+		if (ds->err == 0) {
+			ds->mode =
+			    dos_mode_at(l->cnum, fd, dirp->last, &ds->st);
+		}
+		ds->valid = true;
+	}
+
+	if (ds->err != 0) {
+		errno = ds->err;
+		return false;
+	}
+
+	*st = ds->st;
+	*mode = ds->mode;
+	return true;
+}
+
+/* Case-insensitive hash of a name for the directory index */
+static unsigned int name_hash(const char *name)
+{
+	unsigned int h = 5381;
+
+	for (; *name; name++) {
+		h = h * 33 + toupper((unsigned char) *name);
+	}
+
+	return h;
+}
+
+/* Get the name a directory entry is indexed by: the name we show to clients
+   for it, or its 8.3 mangled form. Returns false if there is no 8.3 form
+   because the name is already 8.3. */
+static bool index_key(struct dir_listing *l, int entry, bool is_83, char *key)
+{
+	pstrcpy(key, l->data + l->offsets[entry]);
+	name_map_mangle(key, false, CONN_SHARE(l->cnum));
+
+	if (is_83) {
+		if (is_8_3(key, true))
+			return false;
+		mangle_name_83(key, sizeof(pstring) - 1);
+	}
+
+	return true;
+}
+
+static void build_index(struct dir_listing *l)
+{
+	struct dir_index *idx = checked_calloc(1, sizeof(struct dir_index));
+	struct dir_index_node *node;
+	pstring key;
+	int i, b;
+
+	idx->num_buckets = DIR_INDEX_MIN_BUCKETS;
+	while (idx->num_buckets < l->numentries) {
+		idx->num_buckets *= 2;
+	}
+	idx->buckets = checked_malloc(idx->num_buckets * sizeof(int));
+	for (i = 0; i < idx->num_buckets; i++) {
+		idx->buckets[i] = -1;
+	}
+	idx->nodes = checked_calloc(l->numentries * 2 + 1,
+	                            sizeof(struct dir_index_node));
+
+	for (i = 0; i < l->numentries * 2; i++) {
+		if (!index_key(l, i / 2, (i % 2) != 0, key))
+			continue;
+		node = &idx->nodes[idx->num_nodes];
+		node->hash = name_hash(key);
+		node->entry = i / 2;
+		node->is_83 = (i % 2) != 0;
+		b = node->hash % idx->num_buckets;
+		node->next = idx->buckets[b];
+		idx->buckets[b] = idx->num_nodes;
+		idx->num_nodes++;
+	}
+
+	DEBUG("indexed %d names for %d entries\n", idx->num_nodes,
+	      l->numentries);
+	l->index = idx;
+}
+
+/* Look up a directory entry by the name we show to clients for it, or also
+   by its 8.3 mangled form if match_83 is true. If more than one entry has
+   the name, the nearest at or before the current position is preferred.
+   Returns the entry's name, and leaves dirp positioned just after it as if it
+   had just been returned by read_dir_name(). */
+char *find_dir_name(Dir *dirp, const char *name, bool case_sensitive,
+                    bool match_83)
+{
+	struct dir_listing *l;
+	struct dir_index_node *node;
+	unsigned int hash = name_hash(name);
+	int before = -1, after = -1;
+	pstring key;
+	int n;
+
+	if (!dirp)
+		return NULL;
+
+	l = dirp->listing;
+	if (l->index == NULL) {
+		build_index(l);
+	}
+
+	for (n = l->index->buckets[hash % l->index->num_buckets]; n >= 0;
+	     n = node->next) {
+		node = &l->index->nodes[n];
+		if (node->hash != hash || (node->is_83 && !match_83))
+			continue;
+		index_key(l, node->entry, node->is_83, key);
+		if (case_sensitive ? !strcsequal(name, key)
+		                   : !strequal(name, key))
+			continue;
+		if (node->entry <= dirp->pos) {
+			before = MAX(before, node->entry);
+		} else if (after < 0 || node->entry < after) {
+			after = node->entry;
+		}
+	}
+
+	if (before < 0 && after < 0)
+		return NULL;
+
+	seek_dir(dirp, (before >= 0 ? before : after) + 1);
+	return dirp->last;
+}
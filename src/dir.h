@@ -11,14 +11,28 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/types.h>
 #include <time.h>
 
 typedef struct dir_struct Dir;
 
+/* A snapshot of a directory's identity and timestamps, used to tell if
+   anything cached about its contents is still good. */
+struct dir_stamp {
+	dev_t dev;
+	ino_t ino;
+	time_t mtime, ctime;
+	long ctime_nsec;
+	unsigned int generation;
+};
+
+struct dptr_table;
 struct share;
 struct stat;
 
-void init_dptrs(void);
+struct dptr_table *dptr_table_new(void);
+void dptr_table_free(struct dptr_table *t);
+void dptr_table_select(struct dptr_table *t);
 char *dptr_path(int key);
 char *dptr_wcard(int key);
 bool dptr_set_wcard(int key, char *wcard);
@@ -35,9 +49,16 @@ Dir *dptr_fetch(char *buf, int *num);
 Dir *dptr_fetch_lanman2(int dptr_num);
 bool dir_check_ftype(int cnum, int mode, struct stat *st, int dirtype);
 bool get_dir_entry(int cnum, const char *mask, int dirtype, char *fname,
-                   int *size, int *mode, time_t *date);
+                   uint32_t *size, int *mode, time_t *date);
 Dir *open_dir(int cnum, char *name);
 void close_dir(Dir *dirp);
 char *read_dir_name(Dir *dirp);
 bool seek_dir(Dir *dirp, int pos);
+char *find_dir_name(Dir *dirp, const char *name, bool case_sensitive,
+                    bool match_83);
 int tell_dir(Dir *dirp);
+bool stat_dir_entry(Dir *dirp, struct stat *st, int *mode);
+void dir_cache_invalidate(void);
+void dir_cache_file_changed(uint32_t dev, uint32_t inode);
+void dir_stamp_set(struct dir_stamp *stamp, struct stat *st);
+bool dir_stamp_matches(const struct dir_stamp *stamp, struct stat *st);
@@ -9,6 +9,9 @@
  * FITNESS FOR A PARTICULAR PURPOSE.
  */
 
+/* F_OFD_SETLK is only defined by glibc if this is defined */
+#define _GNU_SOURCE
+
 #include "locking.h"
 
 #include <errno.h>
@@ -23,49 +26,66 @@
 #include "smb.h"
 #include "util.h"
 
-static bool fcntl_lock(int fd, int op, uint32_t offset, uint32_t count,
+static bool use_ofd_locks = false;
+
+/* POSIX record locks belong to a process, so if one process is serving
+   several clients then their locks would never conflict with each other.
+   Open file description locks do not have that problem, so use them if we
+   can. Returns false if they are not available on this system. */
+bool locking_init(bool shared_process)
+{
+#ifdef F_OFD_SETLK
+	use_ofd_locks = shared_process;
+	return true;
+#else
+	return !shared_process;
+#endif
+}
+
+static bool fcntl_lock(int fd, int op, uint64_t offset, uint64_t count,
                        int type)
 {
 	struct flock lock;
 	int ret;
-	uint32_t mask = (uint32_t) 1 << 31;
-	int32_t s_count = (int32_t) count;   /* Signed count. */
-	int32_t s_offset = (int32_t) offset; /* Signed offset. */
+	uint64_t mask = (uint64_t) 1 << 63;
 
 	/* interpret negative counts as large numbers */
-	if (s_count < 0)
-		s_count &= ~mask;
+	count &= ~mask;
 
 	/* no negative offsets */
-	if (s_offset < 0)
-		s_offset &= ~mask;
+	offset &= ~mask;
 
 	/* count + offset must be in range */
-	while ((s_offset < 0 || s_offset + s_count < 0) && mask) {
-		s_offset &= ~mask;
+	while (offset + count > INT64_MAX && mask) {
+		offset &= ~mask;
 		mask = mask >> 1;
 	}
 
-	offset = (uint32_t) s_offset;
-	count = (uint32_t) s_count;
-
-	DEBUG("fd=%d op=%d offset=%d count=%d type=%d\n", fd, op, (int) offset,
-	      (int) count, type);
+	DEBUG("fd=%d op=%d offset=%llu count=%llu type=%d\n", fd, op,
+	      (unsigned long long) offset, (unsigned long long) count, type);
 
 	lock.l_type = type;
 	lock.l_whence = SEEK_SET;
-	lock.l_start = (int) offset;
-	lock.l_len = (int) count;
+	lock.l_start = (off_t) offset;
+	lock.l_len = (off_t) count;
 	lock.l_pid = 0;
 
 	errno = 0;
 
+#ifdef F_OFD_SETLK
+	if (use_ofd_locks && op == F_SETLK) {
+		op = F_OFD_SETLK;
+	}
+#endif
+
 	ret = fcntl(fd, op, &lock);
 
 	/* a lock set or unset */
 	if (ret == -1) {
-		DEBUG("lock failed at offset %d count %d op %d type %d (%s)\n",
-		      offset, count, op, type, strerror(errno));
+		DEBUG("lock failed at offset %llu count %llu op %d type %d "
+		      "(%s)\n",
+		      (unsigned long long) offset, (unsigned long long) count,
+		      op, type, strerror(errno));
 
 		/* perhaps it doesn't support this sort of locking?? */
 		if (errno == EINVAL) {
@@ -113,7 +133,7 @@ static int map_lock_type(struct open_file *fsp, int lock_type)
 }
 
 /* Utility function called by locking requests. */
-bool do_lock(int fnum, int cnum, uint32_t count, uint32_t offset, int lock_type,
+bool do_lock(int fnum, int cnum, uint64_t count, uint64_t offset, int lock_type,
              int *eclass, uint32_t *ecode)
 {
 	bool ok = false;
@@ -138,7 +158,7 @@ bool do_lock(int fnum, int cnum, uint32_t count, uint32_t offset, int lock_type,
 }
 
 /* Utility function called by unlocking requests. */
-bool do_unlock(int fnum, int cnum, uint32_t count, uint32_t offset, int *eclass,
+bool do_unlock(int fnum, int cnum, uint64_t count, uint64_t offset, int *eclass,
                uint32_t *ecode)
 {
 	bool ok = false;
@@ -12,8 +12,9 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-bool do_lock(int fnum, int cnum, uint32_t count, uint32_t offset, int lock_type,
+bool locking_init(bool shared_process);
+bool do_lock(int fnum, int cnum, uint64_t count, uint64_t offset, int lock_type,
              int *eclass, uint32_t *ecode);
-bool do_unlock(int fnum, int cnum, uint32_t count, uint32_t offset, int *eclass,
+bool do_unlock(int fnum, int cnum, uint64_t count, uint64_t offset, int *eclass,
                uint32_t *ecode);
 bool locking_end(void);
@@ -0,0 +1,20 @@
+/*
+ * Copyright (c) 2025-2026 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* Everything else is in server.c, so that tumba_replay can link against the
+   same code with its own main(). */
+
+#include "guards.h" /* IWYU pragma: keep */
+#include "server.h"
+
+int main(int argc, char *argv[])
+{
+	return server_main(argc, argv);
+}
@@ -230,11 +230,11 @@ static bool illegal_name(const char *name)
 
 		bzero(illegal, sizeof(illegal));
 		for (s = ill; *s; s++)
-			illegal[(unsigned int) *s] = true;
+			illegal[(unsigned char) *s] = true;
 	}
 
 	for (s = name; *s;) {
-		if (illegal[(unsigned int) *s])
+		if (illegal[(unsigned char) *s])
 			return true;
 		else
 			s++;
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2025-2026 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* Cache of the results of unix_convert() for names that do not exist as the
+   client gave them - usually because they are in the wrong case, or are
+   mangled 8.3 names. Working these out means reading and mangling every name
+   in each directory on the path, and clients look up the same names over
+   and over again. */
+
+#include "namecache.h"
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "dir.h"
+#include "guards.h" /* IWYU pragma: keep */
+#include "mangle.h"
+#include "strfunc.h"
+#include "util.h"
+
+/* Each name can only go in one place in the cache, replacing whatever was
+   there before. */
+#define NAME_CACHE_SIZE 1024
+
+struct name_cache_entry {
+	const struct share *share;
+	char *dosname;
+	char *unixname;
+	bool result, bad_path;
+
+	/* If the name was found, the entry is good for as long as unixname
+	   still exists. Otherwise, it is good until the last directory we
+	   looked in (dirpath) changes. */
+	bool found;
+	char *dirpath;
+	struct dir_stamp stamp;
+};
+
+static struct name_cache_entry name_cache[NAME_CACHE_SIZE];
+
+static struct name_cache_entry *cache_slot(const struct share *share,
+                                           const char *dosname)
+{
+	return &name_cache[(str_checksum(dosname) ^ (uintptr_t) share) %
+	                   NAME_CACHE_SIZE];
+}
+
+static const char *stat_path(const char *path)
+{
+	return *path ? path : ".";
+}
+
+/* Look up a name that has been converted before. If it is found and still
+   valid, the converted name is copied into name, and the result and
+   bad_path value that unix_convert() returned last time are returned too.
+   Names are relative to the share's top directory, root_fd. */
+bool name_cache_lookup(const struct share *share, int root_fd, char *name,
+                       bool *result, bool *bad_path)
+{
+	struct name_cache_entry *e = cache_slot(share, name);
+	struct stat st;
+
+	if (e->dosname == NULL || e->share != share ||
+	    strcmp(e->dosname, name) != 0) {
+		return false;
+	}
+
+	if (e->found) {
+		if (fstatat(root_fd, e->unixname, &st, 0) != 0) {
+			return false;
+		}
+	} else if (fstatat(root_fd, stat_path(e->dirpath), &st, 0) != 0 ||
+	           !dir_stamp_matches(&e->stamp, &st)) {
+		return false;
+	}
+
+	pstrcpy(name, e->unixname);
+	*result = e->result;
+	*bad_path = e->bad_path;
+	return true;
+}
+
+/* Remember the result of converting dosname to unixname */
+void name_cache_add(const struct share *share, int root_fd,
+                    const char *dosname, const char *unixname,
+                    const char *dirpath, bool found, bool result,
+                    bool bad_path)
+{
+	struct name_cache_entry *e = cache_slot(share, dosname);
+	struct stat st;
+
+	if (!found) {
+		if (fstatat(root_fd, stat_path(dirpath), &st, 0) != 0) {
+			return;
+		}
+		dir_stamp_set(&e->stamp, &st);
+	}
+
+	free(e->dosname);
+	free(e->unixname);
+	free(e->dirpath);
+
+	e->share = share;
+	e->dosname = checked_strdup(dosname);
+	e->unixname = checked_strdup(unixname);
+	e->dirpath = checked_strdup(dirpath);
+	e->found = found;
+	e->result = result;
+	e->bad_path = bad_path;
+}
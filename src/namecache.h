@@ -0,0 +1,20 @@
+/*
+ * Copyright (c) 2025-2026 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdbool.h>
+
+struct share;
+
+bool name_cache_lookup(const struct share *share, int root_fd, char *name,
+                       bool *result, bool *bad_path);
+void name_cache_add(const struct share *share, int root_fd,
+                    const char *dosname, const char *unixname,
+                    const char *dirpath, bool found, bool result,
+                    bool bad_path);
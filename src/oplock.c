@@ -0,0 +1,499 @@
+/*
+ * Copyright (c) 2025-2026 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* The bookkeeping needed to grant oplocks when clients are served by many
+   processes. A table in shared memory, created before any of them are
+   forked, has an entry for every file that any client has open, saying who
+   has it open and whether they hold an oplock on it. Before a file is opened
+   again, any oplock on it has to be broken; if the holder is served by
+   another process, that is asked to do it with a message sent to the
+   datagram socket that every serving process listens on. These are named
+   after the process IDs, in a directory that only the server's user can get
+   into, so nothing else on the machine can send us messages.
+
+   The table is protected by an fcntl() lock on the descriptor of the shared
+   memory segment. It is only ever held for long enough to look at or update
+   the table, never while waiting for a client. */
+
+#include "oplock.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "guards.h" /* IWYU pragma: keep */
+#include "smb.h"
+#include "util.h"
+
+#define OPLOCK_HASH_SIZE      1024
+#define OPLOCK_TABLE_SIZE     16384
+#define OPLOCK_UNTRACKED_PIDS 256
+
+struct oplock_entry {
+	int32_t next; /* hash chain, or free list */
+	pid_t pid;    /* zero if the entry is free */
+	uint16_t fnum;
+	uint32_t session;
+	uint32_t dev, inode;
+	int type;
+};
+
+/* How many untracked files one process has open */
+struct oplock_untracked {
+	pid_t pid; /* zero if the slot is free */
+	int count;
+};
+
+/* Entry zero is never used, so that it can mean "none" */
+struct oplock_table {
+	int32_t chains[OPLOCK_HASH_SIZE];
+	int32_t free_list;
+
+	/* Files that are open but could not be added because the table was
+	   full. No oplocks are granted while there are any, since we cannot
+	   tell which files they are. They are also counted for each process,
+	   so that those of a process that dies can be taken off again. */
+	int untracked;
+	struct oplock_untracked untracked_pids[OPLOCK_UNTRACKED_PIDS];
+
+	struct oplock_entry entries[OPLOCK_TABLE_SIZE];
+};
+
+static struct oplock_table *table;
+static int table_fd = -1;
+
+static int sock_fd = -1;
+static char sock_dir[] = "/tmp/tumba_oplocks.XXXXXX";
+
+/* Create the table; called before the server forks any processes. Without
+   it, no oplocks are granted. */
+void oplock_table_create(void)
+{
+	char name[32];
+	int i;
+
+	/* mkdtemp() makes it accessible only to us */
+	if (mkdtemp(sock_dir) == NULL) {
+		WARNING("failed to create oplock socket directory: %s\n",
+		        strerror(errno));
+		return;
+	}
+
+	/* Nothing else needs to find the segment, so it is unlinked straight
+	   away and is only reachable through the inherited descriptor. */
+	snprintf(name, sizeof(name), "/tumba_oplocks.%ld", (long) getpid());
+	table_fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (table_fd < 0) {
+		WARNING("failed to create oplock table: %s\n",
+		        strerror(errno));
+		rmdir(sock_dir);
+		return;
+	}
+	shm_unlink(name);
+
+	if (ftruncate(table_fd, sizeof(struct oplock_table)) != 0) {
+		WARNING("failed to size oplock table: %s\n", strerror(errno));
+		close(table_fd);
+		table_fd = -1;
+		rmdir(sock_dir);
+		return;
+	}
+
+	table = mmap(NULL, sizeof(struct oplock_table),
+	             PROT_READ | PROT_WRITE, MAP_SHARED, table_fd, 0);
+	if (table == MAP_FAILED) {
+		WARNING("failed to map oplock table: %s\n", strerror(errno));
+		table = NULL;
+		close(table_fd);
+		table_fd = -1;
+		rmdir(sock_dir);
+		return;
+	}
+
+	/* the segment starts out zeroed */
+	for (i = 1; i < OPLOCK_TABLE_SIZE - 1; i++) {
+		table->entries[i].next = i + 1;
+	}
+	table->free_list = 1;
+}
+
+/* Called by the main server process when it exits, to clean up the
+   sockets of any processes that did not exit before it. */
+void oplock_table_remove(void)
+{
+	struct dirent *d;
+	DIR *dir;
+
+	if (table == NULL) {
+		return;
+	}
+
+	dir = opendir(sock_dir);
+	if (dir != NULL) {
+		while ((d = readdir(dir)) != NULL) {
+			if (d->d_name[0] != '.') {
+				unlinkat(dirfd(dir), d->d_name, 0);
+			}
+		}
+		closedir(dir);
+	}
+	rmdir(sock_dir);
+}
+
+static void socket_path(struct sockaddr_un *addr, pid_t pid)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/%ld", sock_dir,
+	         (long) pid);
+}
+
+/* Open the socket that this process receives oplock break messages on.
+   Returns its descriptor, or -1 if oplocks cannot be used. */
+int oplock_open_socket(void)
+{
+	struct sockaddr_un addr;
+
+	if (table == NULL) {
+		return -1;
+	}
+
+	sock_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (sock_fd < 0) {
+		WARNING("failed to create oplock socket: %s\n",
+		        strerror(errno));
+		return -1;
+	}
+
+	/* One may be left over from an earlier process with the same ID */
+	socket_path(&addr, getpid());
+	unlink(addr.sun_path);
+
+	if (bind(sock_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		WARNING("failed to bind oplock socket %s: %s\n", addr.sun_path,
+		        strerror(errno));
+		close(sock_fd);
+		sock_fd = -1;
+		return -1;
+	}
+
+	DEBUG("listening for oplock breaks on %s\n", addr.sun_path);
+
+	return sock_fd;
+}
+
+static void table_lock(int type)
+{
+	struct flock lock;
+
+	memset(&lock, 0, sizeof(lock));
+	lock.l_type = type;
+	lock.l_whence = SEEK_SET;
+
+	while (fcntl(table_fd, F_SETLKW, &lock) != 0) {
+		if (errno != EINTR) {
+			FATAL("failed to lock oplock table: %s\n",
+			      strerror(errno));
+		}
+	}
+}
+
+/* Lock the table against changes by other processes. Locks are per process,
+   so this must not be called again before oplock_unlock(). */
+void oplock_lock(void)
+{
+	if (table != NULL) {
+		table_lock(F_WRLCK);
+	}
+}
+
+void oplock_unlock(void)
+{
+	if (table != NULL) {
+		table_lock(F_UNLCK);
+	}
+}
+
+static unsigned int table_hash(uint32_t dev, uint32_t inode)
+{
+	return (dev * 31 + inode) % OPLOCK_HASH_SIZE;
+}
+
+/* Find the untracked files count of the given process, claiming a free
+   slot for it if there is none and create is true. Returns NULL if there is
+   no slot. The table must be locked. */
+static struct oplock_untracked *find_untracked(pid_t pid, bool create)
+{
+	struct oplock_untracked *u, *free_slot = NULL;
+	int i;
+
+	for (i = 0; i < OPLOCK_UNTRACKED_PIDS; i++) {
+		u = &table->untracked_pids[i];
+		if (u->pid == pid) {
+			return u;
+		} else if (u->pid == 0 && free_slot == NULL) {
+			free_slot = u;
+		}
+	}
+
+	if (!create || free_slot == NULL) {
+		return NULL;
+	}
+	free_slot->pid = pid;
+	free_slot->count = 0;
+
+	return free_slot;
+}
+
+/* Take n untracked files of a process off the counts; the table must be
+   locked. */
+static void forget_untracked(struct oplock_untracked *u, int n)
+{
+	u->count -= n;
+	table->untracked -= n;
+	if (u->count == 0) {
+		u->pid = 0;
+	}
+}
+
+/* Record that the given session has opened a file, with no oplock for now.
+   Returns the entry to pass to the other functions, which is zero if
+   oplocks are not in use, or OPLOCK_UNTRACKED or OPLOCK_NO_ROOM if the
+   table is full. The table must be locked. */
+int oplock_add(uint32_t dev, uint32_t inode, uint32_t session, int fnum)
+{
+	struct oplock_entry *e;
+	unsigned int hash;
+	struct oplock_untracked *u;
+	int entry;
+
+	if (table == NULL) {
+		return 0;
+	}
+
+	entry = table->free_list;
+	if (entry == 0) {
+		u = find_untracked(getpid(), true);
+		if (u == NULL) {
+			WARNING("oplock table is full, and too many processes "
+			        "have untracked files open\n");
+			return OPLOCK_NO_ROOM;
+		}
+		DEBUG("oplock table is full\n");
+		++u->count;
+		++table->untracked;
+		return OPLOCK_UNTRACKED;
+	}
+
+	e = &table->entries[entry];
+	table->free_list = e->next;
+
+	hash = table_hash(dev, inode);
+	e->next = table->chains[hash];
+	e->pid = getpid();
+	e->fnum = fnum;
+	e->session = session;
+	e->dev = dev;
+	e->inode = inode;
+	e->type = NO_OPLOCK;
+	table->chains[hash] = entry;
+
+	return entry;
+}
+
+/* Find somebody holding an oplock on the given file, returning true if
+   there is anyone. Level II oplocks are ignored unless level_ii is true.
+   The table must be locked. */
+bool oplock_find_holder(uint32_t dev, uint32_t inode, bool level_ii,
+                        struct oplock_holder *h)
+{
+	struct oplock_entry *e;
+	int entry, type;
+
+	if (table == NULL) {
+		return false;
+	}
+
+	for (entry = table->chains[table_hash(dev, inode)]; entry != 0;
+	     entry = e->next) {
+		e = &table->entries[entry];
+		type = __atomic_load_n(&e->type, __ATOMIC_RELAXED);
+		if (e->dev == dev && e->inode == inode && type != NO_OPLOCK &&
+		    (level_ii || type != LEVEL_II_OPLOCK)) {
+			h->entry = entry;
+			h->pid = e->pid;
+			h->session = e->session;
+			h->fnum = e->fnum;
+			h->type = type;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Returns true if anyone other than the given entry has the file open, or
+   might have. The table must be locked. */
+bool oplock_file_shared(uint32_t dev, uint32_t inode, int entry)
+{
+	struct oplock_entry *e;
+	int i;
+
+	if (table == NULL || table->untracked > 0) {
+		return true;
+	}
+
+	for (i = table->chains[table_hash(dev, inode)]; i != 0; i = e->next) {
+		e = &table->entries[i];
+		if (i != entry && e->dev == dev && e->inode == inode) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Change the oplock held through an entry. Granting one must be done with
+   the table locked, after checking that nobody else has the file open, but
+   anyone can let one go at any time. */
+void oplock_set_type(int entry, int type)
+{
+	if (table != NULL && entry > 0) {
+		__atomic_store_n(&table->entries[entry].type, type,
+		                 __ATOMIC_RELAXED);
+	}
+}
+
+/* Unlink and free an entry; the table must be locked. */
+static void free_entry(int entry)
+{
+	struct oplock_entry *e = &table->entries[entry];
+	int32_t *p;
+
+	for (p = &table->chains[table_hash(e->dev, e->inode)]; *p != entry;
+	     p = &table->entries[*p].next)
+		;
+	*p = e->next;
+
+	memset(e, 0, sizeof(*e));
+	e->next = table->free_list;
+	table->free_list = entry;
+}
+
+/* Called when a file is closed to remove its entry. */
+void oplock_remove(int entry)
+{
+	struct oplock_untracked *u;
+
+	if (table == NULL || entry == 0 || entry == OPLOCK_NO_ROOM) {
+		return;
+	}
+
+	table_lock(F_WRLCK);
+	if (entry == OPLOCK_UNTRACKED) {
+		u = find_untracked(getpid(), false);
+		if (u != NULL) {
+			forget_untracked(u, 1);
+		}
+	} else {
+		free_entry(entry);
+	}
+	table_lock(F_UNLCK);
+}
+
+/* Called when a serving process has exited, to remove any entries that it
+   did not get the chance to remove itself, and its socket. */
+void oplock_process_exited(pid_t pid)
+{
+	struct oplock_untracked *u;
+	struct sockaddr_un addr;
+	int i;
+
+	if (table == NULL) {
+		return;
+	}
+
+	socket_path(&addr, pid);
+	unlink(addr.sun_path);
+
+	table_lock(F_WRLCK);
+	for (i = 1; i < OPLOCK_TABLE_SIZE; i++) {
+		if (table->entries[i].pid == pid) {
+			free_entry(i);
+		}
+	}
+	u = find_untracked(pid, false);
+	if (u != NULL) {
+		forget_untracked(u, u->count);
+	}
+	table_lock(F_UNLCK);
+}
+
+/* Send a message to the given process. This never blocks: if its queue is
+   full, the message is lost, as it could be with UDP. */
+bool oplock_send(pid_t pid, const struct oplock_message *msg)
+{
+	struct sockaddr_un addr;
+
+	socket_path(&addr, pid);
+
+	if (sendto(sock_fd, msg, sizeof(*msg), MSG_DONTWAIT,
+	           (struct sockaddr *) &addr, sizeof(addr)) != sizeof(*msg)) {
+		WARNING("failed to send oplock message to pid %ld: %s\n",
+		        (long) pid, strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+/* Receive a message if there is one waiting, saving the process it came
+   from so that a reply can be sent back. */
+bool oplock_receive(struct oplock_message *msg, pid_t *pid)
+{
+	struct sockaddr_un addr, expected;
+	socklen_t addrlen = sizeof(addr);
+	const char *name;
+	ssize_t len;
+	char *end;
+	long n;
+
+	memset(&addr, 0, sizeof(addr));
+	len = recvfrom(sock_fd, msg, sizeof(*msg), MSG_DONTWAIT,
+	               (struct sockaddr *) &addr, &addrlen);
+	if (len < 0) {
+		return false;
+	}
+
+	/* The sender's socket must be one of ours, named after its pid */
+	name = strrchr(addr.sun_path, '/');
+	n = name != NULL ? strtol(name + 1, &end, 10) : 0;
+	if (n > 0) {
+		socket_path(&expected, n);
+	}
+	if (len != sizeof(*msg) || addr.sun_family != AF_UNIX || n <= 0 ||
+	    *end != '\0' || strcmp(addr.sun_path, expected.sun_path) != 0) {
+		WARNING("ignoring bogus oplock message (%d bytes)\n", (int) len);
+		return false;
+	}
+
+	*pid = n;
+	return true;
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2025-2026 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* How long (in seconds) a client gets to respond to an oplock break before
+   we give up waiting for it */
+#define OPLOCK_BREAK_TIMEOUT 30
+
+/* Returned by oplock_add() when the table is full. A file that cannot even
+   be counted as untracked must not be opened, since nobody could be told
+   that it is. */
+#define OPLOCK_UNTRACKED (-1)
+#define OPLOCK_NO_ROOM   (-2)
+
+/* A client that holds an oplock on a file, found in the open file table */
+struct oplock_holder {
+	int entry;
+	pid_t pid;
+	uint32_t session;
+	int fnum;
+	int type;
+};
+
+enum oplock_message_type {
+	OPLOCK_BREAK_REQUEST,
+	OPLOCK_BREAK_REPLY,
+	OPLOCK_LEVEL_II_BREAK, /* needs no reply */
+};
+
+/* Sent to the process holding an oplock to ask for it to be broken, and then
+   sent back to the requester once it has been. */
+struct oplock_message {
+	enum oplock_message_type type;
+	uint32_t seq;
+	uint32_t session;
+	int fnum;
+	int entry;
+	int level;
+	bool broken; /* in a reply; false if the oplock is still held */
+};
+
+void oplock_table_create(void);
+void oplock_table_remove(void);
+int oplock_open_socket(void);
+void oplock_lock(void);
+void oplock_unlock(void);
+int oplock_add(uint32_t dev, uint32_t inode, uint32_t session, int fnum);
+bool oplock_find_holder(uint32_t dev, uint32_t inode, bool level_ii,
+                        struct oplock_holder *h);
+bool oplock_file_shared(uint32_t dev, uint32_t inode, int entry);
+void oplock_set_type(int entry, int type);
+void oplock_remove(int entry);
+void oplock_process_exited(pid_t pid);
+bool oplock_send(pid_t pid, const struct oplock_message *msg);
+bool oplock_receive(struct oplock_message *msg, pid_t *pid);
@@ -0,0 +1,304 @@
+/*
+ * Copyright (c) 2025-2026 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* A small wrapper for waiting on readiness of many file descriptors at once.
+   Linux gets epoll; everything else falls back to poll(), which is O(n) in
+   the number of descriptors but portable. There are also timers, kept in a
+   wheel with one slot per second, so that idle clients cost nothing until
+   one of their timeouts is actually due. */
+
+#include "reactor.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/time.h>
+#include <time.h>
+
+#ifdef linux
+#include <sys/epoll.h>
+#endif
+
+#include "guards.h" /* IWYU pragma: keep */
+#include "util.h"
+
+#define WHEEL_SLOTS 256
+
+static struct reactor_timer *wheel[WHEEL_SLOTS];
+static int num_timers;
+
+/* All timers due before this time have been run */
+static time_t wheel_time;
+
+/* Wait up to timeout milliseconds (-1 for forever) for a single descriptor to
+   become readable. Returns 1 if it is, zero on timeout, -1 on error. */
+int reactor_wait_fd(int fd, int timeout)
+{
+	struct pollfd pfd;
+	int result;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	do {
+		result = poll(&pfd, 1, timeout);
+	} while (result < 0 && errno == EINTR);
+
+	return result;
+}
+
+/* The same for two descriptors, either of which may be -1 to ignore it.
+   Returns zero on timeout, -1 on error, or otherwise a mask with bit 0 set if
+   fd1 is readable and bit 1 set if fd2 is. */
+int reactor_wait_fd2(int fd1, int fd2, int timeout)
+{
+	struct pollfd pfds[2];
+	int result;
+
+	pfds[0].fd = fd1;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = fd2;
+	pfds[1].events = POLLIN;
+
+	do {
+		result = poll(pfds, 2, timeout);
+	} while (result < 0 && errno == EINTR);
+
+	if (result <= 0) {
+		return result;
+	}
+
+	return (pfds[0].revents != 0 ? 1 : 0) | (pfds[1].revents != 0 ? 2 : 0);
+}
+
+/* Arrange for callback to be invoked once the time reaches when, replacing
+   any time that the timer was already set for. */
+void reactor_timer_set(struct reactor_timer *t, time_t when,
+                       void (*callback)(void *data), void *data)
+{
+	struct reactor_timer **slot;
+
+	reactor_timer_cancel(t);
+
+	t->when = when;
+	t->callback = callback;
+	t->data = data;
+	t->active = true;
+
+	/* anything already overdue goes in the slot run next */
+	t->slot = MAX(when, wheel_time) % WHEEL_SLOTS;
+	slot = &wheel[t->slot];
+	t->prev = NULL;
+	t->next = *slot;
+	if (*slot != NULL) {
+		(*slot)->prev = t;
+	}
+	*slot = t;
+	++num_timers;
+}
+
+void reactor_timer_cancel(struct reactor_timer *t)
+{
+	if (!t->active) {
+		return;
+	}
+
+	if (t->prev != NULL) {
+		t->prev->next = t->next;
+	} else {
+		wheel[t->slot] = t->next;
+	}
+	if (t->next != NULL) {
+		t->next->prev = t->prev;
+	}
+
+	t->active = false;
+	--num_timers;
+}
+
+/* Returns the number of milliseconds until the next timer is due, suitable
+   for passing to reactor_wait(), or -1 if there are no timers set. */
+int reactor_next_timeout(void)
+{
+	struct reactor_timer *t;
+	struct timeval now;
+	time_t when;
+	int i;
+
+	if (num_timers == 0) {
+		return -1;
+	}
+
+	gettimeofday(&now, NULL);
+
+	for (i = 0; i < WHEEL_SLOTS; i++) {
+		when = wheel_time + i;
+		for (t = wheel[when % WHEEL_SLOTS]; t != NULL; t = t->next) {
+			if (t->when <= when) {
+				return MAX(0, (when - now.tv_sec) * 1000 -
+				                  now.tv_usec / 1000);
+			}
+		}
+	}
+
+	/* Everything is more than a full turn of the wheel away */
+	return WHEEL_SLOTS * 1000;
+}
+
+/* Invoke the callbacks of any timers that are now due. */
+void reactor_run_timers(void)
+{
+	struct reactor_timer *t;
+	time_t now = time(NULL);
+
+	/* no point going round the wheel more than once */
+	if (now - wheel_time >= WHEEL_SLOTS) {
+		wheel_time = now - WHEEL_SLOTS + 1;
+	}
+
+	for (; wheel_time <= now; wheel_time++) {
+		t = wheel[wheel_time % WHEEL_SLOTS];
+		while (t != NULL) {
+			if (t->when > now) {
+				t = t->next;
+				continue;
+			}
+			/* the callback may add and remove other timers, so
+			   start again from the top of the slot afterwards */
+			reactor_timer_cancel(t);
+			t->callback(t->data);
+			t = wheel[wheel_time % WHEEL_SLOTS];
+		}
+	}
+}
+
+#ifdef linux
+
+#define MAX_EVENTS 64
+
+static int epoll_fd = -1;
+
+void reactor_init(void)
+{
+	wheel_time = time(NULL);
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	CHECK_OR_FATAL(epoll_fd >= 0, "epoll_create1 failed: %s\n",
+	               strerror(errno));
+}
+
+/* Start watching fd for incoming data; data is returned by reactor_wait() */
+void reactor_add(int fd, void *data)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = data;
+
+	CHECK_OR_FATAL(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0,
+	               "epoll_ctl(ADD, %d) failed: %s\n", fd, strerror(errno));
+}
+
+void reactor_remove(int fd)
+{
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL) != 0) {
+		DEBUG("epoll_ctl(DEL, %d) failed: %s\n", fd, strerror(errno));
+	}
+}
+
+/* Wait up to timeout milliseconds (-1 for forever) for any of the watched
+   descriptors to become readable, filling in the data pointers of those that
+   are. Returns the number ready, zero on timeout or signal, -1 on error. */
+int reactor_wait(void **ready, int max_ready, int timeout)
+{
+	struct epoll_event events[MAX_EVENTS];
+	int i, n;
+
+	n = epoll_wait(epoll_fd, events, MIN(max_ready, MAX_EVENTS), timeout);
+	if (n < 0) {
+		return errno == EINTR ? 0 : -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		ready[i] = events[i].data.ptr;
+	}
+
+	return n;
+}
+
+#else
+
+static struct pollfd *poll_fds;
+static void **poll_data;
+static int num_poll_fds, poll_fds_size;
+
+void reactor_init(void)
+{
+	wheel_time = time(NULL);
+	num_poll_fds = 0;
+}
+
+/* Start watching fd for incoming data; data is returned by reactor_wait() */
+void reactor_add(int fd, void *data)
+{
+	if (num_poll_fds >= poll_fds_size) {
+		poll_fds_size = MAX(16, poll_fds_size * 2);
+		poll_fds = checked_realloc(poll_fds,
+		                           poll_fds_size * sizeof(*poll_fds));
+		poll_data = checked_realloc(poll_data,
+		                            poll_fds_size * sizeof(*poll_data));
+	}
+
+	poll_fds[num_poll_fds].fd = fd;
+	poll_fds[num_poll_fds].events = POLLIN;
+	poll_fds[num_poll_fds].revents = 0;
+	poll_data[num_poll_fds] = data;
+	num_poll_fds++;
+}
+
+void reactor_remove(int fd)
+{
+	int i;
+
+	for (i = 0; i < num_poll_fds; i++) {
+		if (poll_fds[i].fd == fd) {
+			num_poll_fds--;
+			poll_fds[i] = poll_fds[num_poll_fds];
+			poll_data[i] = poll_data[num_poll_fds];
+			return;
+		}
+	}
+}
+
+/* Wait up to timeout milliseconds (-1 for forever) for any of the watched
+   descriptors to become readable, filling in the data pointers of those that
+   are. Returns the number ready, zero on timeout or signal, -1 on error. */
+int reactor_wait(void **ready, int max_ready, int timeout)
+{
+	int i, n, result = 0;
+
+	n = poll(poll_fds, num_poll_fds, timeout);
+	if (n < 0) {
+		return errno == EINTR ? 0 : -1;
+	}
+
+	for (i = 0; i < num_poll_fds && result < max_ready; i++) {
+		if ((poll_fds[i].revents &
+		     (POLLIN | POLLHUP | POLLERR | POLLNVAL)) != 0) {
+			ready[result] = poll_data[i];
+			result++;
+		}
+	}
+
+	return result;
+}
+
+#endif
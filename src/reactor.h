@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2025-2026 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdbool.h>
+#include <time.h>
+
+/* A one-shot timer; embed one of these in whatever it is a timer for. */
+struct reactor_timer {
+	struct reactor_timer *prev, *next;
+	bool active;
+	int slot;
+	time_t when;
+	void (*callback)(void *data);
+	void *data;
+};
+
+void reactor_init(void);
+void reactor_add(int fd, void *data);
+void reactor_remove(int fd);
+int reactor_wait(void **ready, int max_ready, int timeout);
+int reactor_wait_fd(int fd, int timeout);
+int reactor_wait_fd2(int fd1, int fd2, int timeout);
+void reactor_timer_set(struct reactor_timer *t, time_t when,
+                       void (*callback)(void *data), void *data);
+void reactor_timer_cancel(struct reactor_timer *t);
+int reactor_next_timeout(void);
+void reactor_run_timers(void);
@@ -47,8 +47,6 @@
 a packet to ensure chaining works correctly */
 #define GETFNUM(buf, where) (chain_fnum != -1 ? chain_fnum : SVAL(buf, where))
 
-#define LOCKING_ANDX_OPLOCK_RELEASE 0x2
-
 int reply_special(char *inbuf, char *outbuf)
 {
 	int outsize = 4;
@@ -290,13 +288,17 @@ int reply_sesssetup_and_X(char *inbuf, char *outbuf, size_t inbuf_len,
 	pstring smb_apasswd;
 	pstring smb_ntpasswd;
 	bool computer_id = false;
-	static bool done_sesssetup = false;
 
 	*smb_apasswd = 0;
 	*smb_ntpasswd = 0;
 
 	smb_bufsize = SVAL(inbuf, smb_vwv2);
 
+	/* NT LM 0.12 clients say what they can do */
+	if (Protocol >= PROTOCOL_NT1 && CVAL(inbuf, smb_wct) == 13) {
+		client_capabilities = IVAL(inbuf, smb_vwv11);
+	}
+
 	/* it's ok - setup a reply */
 	if (Protocol < PROTOCOL_NT1) {
 		set_message(outbuf, 3, 0, true);
@@ -347,7 +349,7 @@ int reply_chkpth(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 	mode = SVAL(inbuf, smb_vwv0);
 
 	if (check_name(name, cnum))
-		ok = directory_exist(name, NULL);
+		ok = directory_exist(CONN_ROOT(cnum), name, NULL);
 
 	if (!ok) {
 		/* We special case this - as when a Windows machine
@@ -398,9 +400,9 @@ int reply_getatr(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 		mtime = 0;
 		ok = true;
 	} else if (check_name(fname, cnum)) {
-		if (stat(fname, &sbuf) == 0) {
+		if (fstatat(CONN_ROOT(cnum), fname, &sbuf, 0) == 0) {
 			mode = dos_mode(cnum, fname, &sbuf);
-			size = sbuf.st_size;
+			size = size32(sbuf.st_size);
 			mtime = sbuf.st_mtime;
 			if (mode & aDIR)
 				size = 0;
@@ -455,7 +457,7 @@ int reply_setatr(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 	mode = SVAL(inbuf, smb_vwv0);
 	mtime = make_unix_date3(inbuf + smb_vwv1);
 
-	if (directory_exist(fname, NULL))
+	if (directory_exist(CONN_ROOT(cnum), fname, NULL))
 		mode |= aDIR;
 	if (check_name(fname, cnum))
 		ok = (dos_chmod(cnum, fname, mode, NULL) == 0);
@@ -503,7 +505,7 @@ int reply_dskattr(char *inbuf, char *outbuf, size_t inbuf_len,
 }
 
 static void make_dir_struct(char *buf, char *mask, const char *fname,
-                            unsigned int size, int mode, time_t date)
+                            uint32_t size, int mode, time_t date)
 {
 	char *p;
 	pstring mask2;
@@ -538,7 +540,8 @@ int reply_search(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 	pstring mask;
 	pstring directory;
 	pstring fname;
-	int size, mode;
+	uint32_t size;
+	int mode;
 	time_t date;
 	int dirtype;
 	int cnum;
@@ -798,12 +801,13 @@ int reply_open(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 	int outsize = 0;
 	int fmode = 0;
 	int share_mode;
-	int size = 0;
+	uint32_t size = 0;
 	time_t mtime = 0;
 	int rmode = 0;
 	struct stat sbuf;
 	bool bad_path = false;
 	struct open_file *fsp;
+	int oplock_request = CORE_OPLOCK_REQUEST(inbuf);
 
 	cnum = SVAL(inbuf, smb_tid);
 
@@ -821,11 +825,12 @@ int reply_open(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 			unix_ERR_class = ERRDOS;
 			unix_ERR_code = ERRbadpath;
 		}
-		Files[fnum].reserved = false;
+		release_file(fnum);
 		return UNIX_ERROR_CODE(ERRDOS, ERRnoaccess);
 	}
 
-	open_file_shared(fnum, cnum, fname, share_mode, 3, aARCH, &rmode, NULL);
+	open_file_shared(fnum, cnum, fname, share_mode, 3, aARCH,
+	                 oplock_request, &rmode, NULL);
 
 	fsp = &Files[fnum];
 
@@ -834,7 +839,7 @@ int reply_open(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 			unix_ERR_class = ERRDOS;
 			unix_ERR_code = ERRbadpath;
 		}
-		Files[fnum].reserved = false;
+		release_file(fnum);
 		return UNIX_ERROR_CODE(ERRDOS, ERRnoaccess);
 	}
 
@@ -843,7 +848,7 @@ int reply_open(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 		return ERROR_CODE(ERRDOS, ERRnoaccess);
 	}
 
-	size = sbuf.st_size;
+	size = size32(sbuf.st_size);
 	fmode = dos_mode(cnum, fname, &sbuf);
 	mtime = sbuf.st_mtime;
 
@@ -859,7 +864,9 @@ int reply_open(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 	put_dos_date3(outbuf, smb_vwv2, mtime);
 	SIVAL(outbuf, smb_vwv4, size);
 	SSVAL(outbuf, smb_vwv6, rmode);
-	/* Note we grant no oplocks. See comment in reply_open_and_X() */
+
+	if (fsp->oplock != NO_OPLOCK)
+		CVAL(outbuf, smb_flg) |= CORE_OPLOCK_GRANTED;
 
 	return outsize;
 }
@@ -874,7 +881,9 @@ int reply_open_and_X(char *inbuf, char *outbuf, size_t inbuf_len,
 	int smb_mode = SVAL(inbuf, smb_vwv3);
 	int smb_attr = SVAL(inbuf, smb_vwv5);
 	int smb_ofun = SVAL(inbuf, smb_vwv8);
-	int size = 0, fmode = 0, mtime = 0, rmode = 0;
+	int oplock_request = EXTENDED_OPLOCK_REQUEST(SVAL(inbuf, smb_vwv2));
+	int fmode = 0, mtime = 0, rmode = 0;
+	uint32_t size = 0;
 	struct stat sbuf;
 	int smb_action = 0;
 	bool bad_path = false;
@@ -903,12 +912,12 @@ int reply_open_and_X(char *inbuf, char *outbuf, size_t inbuf_len,
 			unix_ERR_class = ERRDOS;
 			unix_ERR_code = ERRbadpath;
 		}
-		Files[fnum].reserved = false;
+		release_file(fnum);
 		return UNIX_ERROR_CODE(ERRDOS, ERRnoaccess);
 	}
 
 	open_file_shared(fnum, cnum, fname, smb_mode, smb_ofun,
-	                 smb_attr | aARCH, &rmode, &smb_action);
+	                 smb_attr | aARCH, oplock_request, &rmode, &smb_action);
 
 	fsp = &Files[fnum];
 
@@ -917,7 +926,7 @@ int reply_open_and_X(char *inbuf, char *outbuf, size_t inbuf_len,
 			unix_ERR_class = ERRDOS;
 			unix_ERR_code = ERRbadpath;
 		}
-		Files[fnum].reserved = false;
+		release_file(fnum);
 		return UNIX_ERROR_CODE(ERRDOS, ERRnoaccess);
 	}
 
@@ -926,7 +935,7 @@ int reply_open_and_X(char *inbuf, char *outbuf, size_t inbuf_len,
 		return ERROR_CODE(ERRDOS, ERRnoaccess);
 	}
 
-	size = sbuf.st_size;
+	size = size32(sbuf.st_size);
 	fmode = dos_mode(cnum, fname, &sbuf);
 	mtime = sbuf.st_mtime;
 	if (fmode & aDIR) {
@@ -934,19 +943,10 @@ int reply_open_and_X(char *inbuf, char *outbuf, size_t inbuf_len,
 		return ERROR_CODE(ERRDOS, ERRnoaccess);
 	}
 
-	/* The Samba version of this function had code to handle oplock
-	   requests. We don't support oplocks and just grant no oplock requests,
-	   which is compliant according to the CIFS draft spec:
-
-	   > Versions of the CIFS file sharing protocol including and newer
-	   > than the "LANMAN1.0" dialect support oplocks. (Note, however, that
-	   > an implementation, even of these later dialects, can implement
-	   > oplocks trivially by always refusing to grant them.)
-
-	   TODO: We can improve performance by granting a fake lock if the
-	   underlying filesystem is read-only (like a CD-ROM), or if we're
-	   feeling a bit bolder, if the file is read-only.
-	 */
+	/* The client cannot tell from the reply whether it got a batch
+	   oplock or an exclusive one; it gets the one it asked for. */
+	if (fsp->oplock != NO_OPLOCK)
+		smb_action |= EXTENDED_OPLOCK_GRANTED;
 
 	set_message(outbuf, 15, 0, true);
 	SSVAL(outbuf, smb_vwv2, fnum);
@@ -983,6 +983,7 @@ int reply_mknew(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 	int ofun = 0;
 	bool bad_path = false;
 	struct open_file *fsp;
+	int oplock_request = CORE_OPLOCK_REQUEST(inbuf);
 
 	com = SVAL(inbuf, smb_com);
 	cnum = SVAL(inbuf, smb_tid);
@@ -1006,7 +1007,7 @@ int reply_mknew(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 			unix_ERR_class = ERRDOS;
 			unix_ERR_code = ERRbadpath;
 		}
-		Files[fnum].reserved = false;
+		release_file(fnum);
 		return UNIX_ERROR_CODE(ERRDOS, ERRnoaccess);
 	}
 
@@ -1021,7 +1022,7 @@ int reply_mknew(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 
 	/* Open file in dos compatibility share mode. */
 	open_file_shared(fnum, cnum, fname, (DENY_FCB << 4) | 0xF, ofun,
-	                 createmode, NULL, NULL);
+	                 createmode, oplock_request, NULL, NULL);
 
 	fsp = &Files[fnum];
 
@@ -1030,13 +1031,15 @@ int reply_mknew(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 			unix_ERR_class = ERRDOS;
 			unix_ERR_code = ERRbadpath;
 		}
-		Files[fnum].reserved = false;
+		release_file(fnum);
 		return UNIX_ERROR_CODE(ERRDOS, ERRnoaccess);
 	}
 
 	outsize = set_message(outbuf, 1, 0, true);
 	SSVAL(outbuf, smb_vwv0, fnum);
-	/* Note we grant no oplocks. See comment in reply_open_and_X() */
+
+	if (fsp->oplock != NO_OPLOCK)
+		CVAL(outbuf, smb_flg) |= CORE_OPLOCK_GRANTED;
 
 	DEBUG("new file %s\n", fname);
 	DEBUG("fname=%s fd=%d fnum=%d cnum=%d dmode=%d\n", fname,
@@ -1045,6 +1048,40 @@ int reply_mknew(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 	return outsize;
 }
 
+/* Fill in the XXXXXX at the end of fname to make the name of a file that
+   does not exist yet in the directory dirfd, like mktemp() */
+static bool make_temp_name(int dirfd, char *fname)
+{
+	static const char chars[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+	static unsigned int counter = 0;
+	size_t len = strlen(fname);
+	char *p = fname + len - 6;
+	struct stat st;
+	unsigned int v;
+	int i, j;
+
+	/* unix_convert() may have lowercased it */
+	if (len < 6 || strcasecmp(p, "XXXXXX") != 0) {
+		errno = EINVAL;
+		return false;
+	}
+
+	for (i = 0; i < 100; i++) {
+		v = (getpid() ^ (unsigned int) time(NULL)) + counter++;
+		for (j = 0; j < 6; j++) {
+			p[j] = chars[v % 36];
+			v /= 36;
+		}
+		if (fstatat(dirfd, fname, &st, AT_SYMLINK_NOFOLLOW) != 0 &&
+		    errno == ENOENT) {
+			return true;
+		}
+	}
+
+	errno = EEXIST;
+	return false;
+}
+
 /* Reply to an SMBctemp */
 int reply_ctemp(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 {
@@ -1056,6 +1093,7 @@ int reply_ctemp(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 	int createmode;
 	bool bad_path = false;
 	struct open_file *fsp;
+	int oplock_request = CORE_OPLOCK_REQUEST(inbuf);
 
 	cnum = SVAL(inbuf, smb_tid);
 	createmode = SVAL(inbuf, smb_vwv0);
@@ -1072,16 +1110,20 @@ int reply_ctemp(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 			unix_ERR_class = ERRDOS;
 			unix_ERR_code = ERRbadpath;
 		}
-		Files[fnum].reserved = false;
+		release_file(fnum);
 		return UNIX_ERROR_CODE(ERRDOS, ERRnoaccess);
 	}
 
-	pstrcpy(fname2, (char *) mktemp(fname));
+	if (!make_temp_name(CONN_ROOT(cnum), fname)) {
+		release_file(fnum);
+		return UNIX_ERROR_CODE(ERRDOS, ERRnoaccess);
+	}
+	pstrcpy(fname2, fname);
 
 	/* Open file in dos compatibility share mode. */
 	/* We should fail if file exists. */
 	open_file_shared(fnum, cnum, fname2, (DENY_FCB << 4) | 0xF, 0x10,
-	                 createmode, NULL, NULL);
+	                 createmode, oplock_request, NULL, NULL);
 
 	fsp = &Files[fnum];
 
@@ -1090,7 +1132,7 @@ int reply_ctemp(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 			unix_ERR_class = ERRDOS;
 			unix_ERR_code = ERRbadpath;
 		}
-		Files[fnum].reserved = false;
+		release_file(fnum);
 		return UNIX_ERROR_CODE(ERRDOS, ERRnoaccess);
 	}
 
@@ -1099,7 +1141,8 @@ int reply_ctemp(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 	CVAL(smb_buf(outbuf), 0) = 4;
 	pstrcpy(smb_buf(outbuf) + 1, fname2);
 
-	/* Note we grant no oplocks. See comment in reply_open_and_X() */
+	if (fsp->oplock != NO_OPLOCK)
+		CVAL(outbuf, smb_flg) |= CORE_OPLOCK_GRANTED;
 
 	DEBUG("created temp file %s\n", fname2);
 	DEBUG("fname=%s fd=%d fnum=%d cnum=%d dmode=%d\n", fname2,
@@ -1117,7 +1160,7 @@ static bool can_delete(const char *fname, int cnum, int dirtype)
 	if (!CAN_WRITE(cnum))
 		return false;
 
-	if (lstat(fname, &sbuf) != 0)
+	if (fstatat(CONN_ROOT(cnum), fname, &sbuf, AT_SYMLINK_NOFOLLOW) != 0)
 		return false;
 	fmode = dos_mode(cnum, fname, &sbuf);
 	if (fmode & aDIR)
@@ -1169,10 +1212,11 @@ int reply_unlink(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 	if (!has_wild) {
 		pstrcat(directory, "/");
 		pstrcat(directory, mask);
-		if (can_delete(directory, cnum, dirtype) && !unlink(directory))
+		if (can_delete(directory, cnum, dirtype) &&
+		    !unlinkat(CONN_ROOT(cnum), directory, 0))
 			count++;
 		if (!count)
-			exists = file_exist(directory, NULL);
+			exists = file_exist(CONN_ROOT(cnum), directory, NULL);
 	} else {
 		Dir *dirptr = NULL;
 		char *dname;
@@ -1204,7 +1248,7 @@ int reply_unlink(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 				         directory, dname);
 				if (!can_delete(fname, cnum, dirtype))
 					continue;
-				if (!unlink(fname))
+				if (!unlinkat(CONN_ROOT(cnum), fname, 0))
 					count++;
 				DEBUG("doing unlink on %s\n", fname);
 			}
@@ -1212,6 +1256,9 @@ int reply_unlink(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 		}
 	}
 
+	if (count != 0)
+		dir_cache_invalidate();
+
 	if (count == 0) {
 		if (exists)
 			return ERROR_CODE(ERRDOS, error);
@@ -1230,15 +1277,15 @@ int reply_unlink(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 }
 
 /* Transfer some data between two file descriptors */
-static int transfer_file(int infd, int outfd, int n, char *header, int headlen,
-                         int align)
+static off_t transfer_file(int infd, int outfd, off_t n, char *header,
+                           int headlen, int align)
 {
 	static char *buf = NULL;
 	static const int buf_size = 16 * 1024;
 	char *buf1, *abuf;
-	int total = 0;
+	off_t total = 0;
 
-	DEBUG("n=%d (head=%d)\n", n, headlen);
+	DEBUG("n=%lld (head=%d)\n", (long long) n, headlen);
 
 	if (buf == NULL) {
 		buf = checked_realloc(buf, buf_size + 8);
@@ -1275,7 +1322,7 @@ static int transfer_file(int infd, int outfd, int n, char *header, int headlen,
 		}
 
 		if (s > ret)
-			ret += read(infd, buf1 + ret, s - ret);
+			ret += read_buffered(infd, buf1 + ret, s - ret);
 
 		if (ret > 0) {
 			ret2 =
@@ -1294,15 +1341,34 @@ static int transfer_file(int infd, int outfd, int n, char *header, int headlen,
 	return total;
 }
 
+/* Work out how many bytes can be read from a file starting at pos, up to a
+   maximum of maxcount. */
+static int readable_bytes(int fnum, off_t pos, int maxcount)
+{
+	off_t size = Files[fnum].size;
+
+	if (size < pos + maxcount) {
+		struct stat st;
+		if (fstat(Files[fnum].fd_ptr->fd, &st) == 0)
+			size = st.st_size;
+		if (!Files[fnum].can_write)
+			Files[fnum].size = size;
+	}
+
+	if (size <= pos)
+		return 0;
+
+	return MIN(maxcount, size - pos);
+}
+
 /* Reply to an SMBreadbraw (core+ protocol) */
 int reply_readbraw(char *inbuf, char *outbuf, size_t inbuf_len,
                    size_t outbuf_len)
 {
 	int cnum, maxcount, mincount, fnum;
-	int nread = 0, size, sizeneeded;
-	uint32_t startpos;
+	int nread = 0;
+	off_t startpos;
 	char *header = outbuf;
-	int ret = 0;
 
 	cnum = SVAL(inbuf, smb_tid);
 	fnum = GETFNUM(inbuf, smb_vwv0);
@@ -1311,6 +1377,11 @@ int reply_readbraw(char *inbuf, char *outbuf, size_t inbuf_len,
 	maxcount = SVAL(inbuf, smb_vwv3);
 	mincount = SVAL(inbuf, smb_vwv4);
 
+	/* the NT LM 0.12 form has the high 32 bits of the offset too */
+	if (CVAL(inbuf, smb_wct) == 10) {
+		startpos |= (off_t) IVAL(inbuf, smb_vwv8) << 32;
+	}
+
 	/* ensure we don't overrun the packet size */
 	maxcount = MIN(65535, maxcount);
 	maxcount = MAX(mincount, maxcount);
@@ -1322,31 +1393,16 @@ int reply_readbraw(char *inbuf, char *outbuf, size_t inbuf_len,
 		return -1;
 	}
 
-	size = Files[fnum].size;
-	sizeneeded = startpos + maxcount;
-
-	if (size < sizeneeded) {
-		struct stat st;
-		if (fstat(Files[fnum].fd_ptr->fd, &st) == 0)
-			size = st.st_size;
-		if (!Files[fnum].can_write)
-			Files[fnum].size = size;
-	}
-
-	nread = MIN(maxcount, (int) (size - startpos));
+	nread = readable_bytes(fnum, startpos, maxcount);
 
 	if (nread < mincount)
 		nread = 0;
 
-	DEBUG("fnum=%d cnum=%d start=%d max=%d min=%d nread=%d\n", fnum, cnum,
-	      startpos, maxcount, mincount, nread);
-
-	ret = read_file(fnum, header + 4, startpos, nread);
-	if (ret < mincount)
-		ret = 0;
+	DEBUG("fnum=%d cnum=%d start=%lld max=%d min=%d nread=%d\n", fnum,
+	      cnum, (long long) startpos, maxcount, mincount, nread);
 
-	_smb_setlen(header, ret);
-	transfer_file(0, client_fd, 0, header, 4 + ret, 0);
+	_smb_setlen(header, nread);
+	send_file_data(fnum, header, 4, startpos, nread);
 
 	DEBUG("finished\n");
 	return -1;
@@ -1443,7 +1499,7 @@ int reply_read_and_X(char *inbuf, char *outbuf, size_t inbuf_len,
                      size_t outbuf_len)
 {
 	int fnum = GETFNUM(inbuf, smb_vwv2);
-	uint32_t smb_offs = IVAL(inbuf, smb_vwv3);
+	off_t smb_offs = IVAL(inbuf, smb_vwv3);
 	int smb_maxcnt = SVAL(inbuf, smb_vwv5);
 	int smb_mincnt = SVAL(inbuf, smb_vwv6);
 	int cnum;
@@ -1456,9 +1512,45 @@ int reply_read_and_X(char *inbuf, char *outbuf, size_t inbuf_len,
 	CHECK_READ(fnum);
 	CHECK_ERROR(fnum);
 
+	/* the NT LM 0.12 form has the high 32 bits of the offset too */
+	if (CVAL(inbuf, smb_wct) == 12) {
+		smb_offs |= (off_t) IVAL(inbuf, smb_vwv10) << 32;
+	}
+
+	/* With CAP_LARGE_READX the high word of the count is where the timeout
+	   used to be. Some clients still fill it in as a timeout, so ignore
+	   values that could not fit in a reply anyway. */
+	if ((client_capabilities & CAP_LARGE_READX) != 0 &&
+	    SVAL(inbuf, smb_vwv7) == 1) {
+		smb_maxcnt |= 0x10000;
+	}
+
 	set_message(outbuf, 12, 0, true);
 	data = smb_buf(outbuf);
 
+	/* If nothing is chained after this, send the file data directly from
+	   the file rather than copying it into outbuf first. */
+	if (chain_size == 0 && CVAL(inbuf, smb_vwv0) == 0xFF) {
+		smb_maxcnt = MIN(smb_maxcnt, LARGE_BUFFER_SIZE + 4 -
+		                                 PTR_DIFF(data, outbuf));
+		nread = readable_bytes(fnum, smb_offs, smb_maxcnt);
+
+		CVAL(outbuf, smb_vwv0) = 0xFF;
+		SSVAL(outbuf, smb_vwv5, nread);
+		SSVAL(outbuf, smb_vwv6, smb_offset(data, outbuf));
+		SSVAL(outbuf, smb_vwv7, nread >> 16);
+		set_message(outbuf, 12, nread, false);
+
+		DEBUG("fnum=%d cnum=%d min=%d max=%d nread=%d (direct)\n",
+		      fnum, cnum, smb_mincnt, smb_maxcnt, nread);
+
+		send_file_data(fnum, outbuf, data - outbuf, smb_offs, nread);
+		return -1;
+	}
+
+	/* otherwise it has to fit in what is left of outbuf */
+	smb_maxcnt = MIN(smb_maxcnt,
+	                 MAX(0, (int) outbuf_len - PTR_DIFF(data, outbuf)));
 	nread = read_file(fnum, data, smb_offs, smb_maxcnt);
 
 	if (nread < 0)
@@ -1515,11 +1607,8 @@ int reply_writebraw(char *inbuf, char *outbuf, size_t inbuf_len,
 	CVAL(inbuf, smb_com) = SMBwritec;
 	CVAL(outbuf, smb_com) = SMBwritec;
 
-	if (seek_file(fnum, startpos) != startpos)
-		ERROR("couldn't seek to %ld in writebraw\n", startpos);
-
 	if (numtowrite > 0)
-		nwritten = write_file(fnum, data, numtowrite);
+		nwritten = write_file(fnum, data, startpos, numtowrite);
 
 	DEBUG("fnum=%d cnum=%d start=%ld num=%d wrote=%d sync=%d\n", fnum, cnum,
 	      startpos, numtowrite, nwritten, write_through);
@@ -1551,8 +1640,7 @@ int reply_writebraw(char *inbuf, char *outbuf, size_t inbuf_len,
 		      nwritten, numtowrite);
 	}
 
-	nwritten = transfer_file(client_fd, Files[fnum].fd_ptr->fd, numtowrite,
-	                         NULL, 0, startpos + nwritten);
+	nwritten = receive_file_data(fnum, startpos + nwritten, numtowrite);
 	total_written += nwritten;
 
 	/* Set up outbuf to return the correct return */
@@ -1599,15 +1687,13 @@ int reply_writeunlock(char *inbuf, char *outbuf, size_t inbuf_len,
 	startpos = IVAL(inbuf, smb_vwv2);
 	data = smb_buf(inbuf) + 3;
 
-	seek_file(fnum, startpos);
-
 	/* The special X/Open SMB protocol handling of
 	   zero length writes is *NOT* done for
 	   this call */
 	if (numtowrite == 0)
 		nwritten = 0;
 	else
-		nwritten = write_file(fnum, data, numtowrite);
+		nwritten = write_file(fnum, data, startpos, numtowrite);
 
 	if ((nwritten == 0 && numtowrite != 0) || nwritten < 0)
 		return UNIX_ERROR_CODE(ERRDOS, ERRnoaccess);
@@ -1631,7 +1717,7 @@ int reply_write(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 	int cnum, numtowrite, fnum;
 	int nwritten = -1;
 	int outsize = 0;
-	int startpos;
+	uint32_t startpos;
 	char *data;
 
 	cnum = SVAL(inbuf, smb_tid);
@@ -1645,15 +1731,15 @@ int reply_write(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 	startpos = IVAL(inbuf, smb_vwv2);
 	data = smb_buf(inbuf) + 3;
 
-	seek_file(fnum, startpos);
-
 	/* X/Open SMB protocol says that if smb_vwv1 is
 	   zero then the file size should be extended or
 	   truncated to the size given in smb_vwv[2-3] */
 	if (numtowrite != 0) {
-		nwritten = write_file(fnum, data, numtowrite);
+		nwritten = write_file(fnum, data, startpos, numtowrite);
 	} else {
 		nwritten = ftruncate(Files[fnum].fd_ptr->fd, startpos);
+		dir_cache_file_changed(Files[fnum].fd_ptr->dev,
+		                       Files[fnum].fd_ptr->inode);
 	}
 
 	if ((nwritten == 0 && numtowrite != 0) || nwritten < 0)
@@ -1674,13 +1760,27 @@ int reply_write(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 	return outsize;
 }
 
+/* Returns the number of bytes of data in an SMBwriteX request. */
+int writex_data_size(const char *inbuf)
+{
+	int size = SVAL(inbuf, smb_vwv10);
+
+	/* With CAP_LARGE_WRITEX, the high word follows in the reserved field
+	   before it; only its lowest bit fits in a NetBIOS message. */
+	if ((client_capabilities & CAP_LARGE_WRITEX) != 0) {
+		size |= (SVAL(inbuf, smb_vwv9) & 1) << 16;
+	}
+
+	return size;
+}
+
 /* Reply to an SMBwriteX */
 int reply_write_and_X(char *inbuf, char *outbuf, size_t inbuf_len,
                       size_t outbuf_len)
 {
 	int fnum = GETFNUM(inbuf, smb_vwv2);
-	uint32_t smb_offs = IVAL(inbuf, smb_vwv3);
-	int smb_dsize = SVAL(inbuf, smb_vwv10);
+	off_t smb_offs = IVAL(inbuf, smb_vwv3);
+	int smb_dsize = writex_data_size(inbuf);
 	int smb_doff = SVAL(inbuf, smb_vwv11);
 	int cnum;
 	int nwritten = -1;
@@ -1692,18 +1792,31 @@ int reply_write_and_X(char *inbuf, char *outbuf, size_t inbuf_len,
 	CHECK_WRITE(fnum);
 	CHECK_ERROR(fnum);
 
-	data = smb_base(inbuf) + smb_doff;
+	/* the NT LM 0.12 form has the high 32 bits of the offset too */
+	if (CVAL(inbuf, smb_wct) == 14) {
+		smb_offs |= (off_t) IVAL(inbuf, smb_vwv12) << 32;
+	}
 
-	seek_file(fnum, smb_offs);
+	/* the data must all be inside the packet */
+	if (smb_doff + smb_dsize > smb_len(inbuf)) {
+		return ERROR_CODE(ERRSRV, ERRerror);
+	}
+
+	data = smb_base(inbuf) + smb_doff;
 
 	/* X/Open SMB protocol says that, unlike SMBwrite
 	   if the length is zero then NO truncation is
 	   done, just a write of zero. To truncate a file,
 	   use SMBwrite. */
-	if (smb_dsize == 0)
+	if (smb_dsize == 0) {
 		nwritten = 0;
-	else
-		nwritten = write_file(fnum, data, smb_dsize);
+	} else if (pending_write_data == smb_dsize) {
+		/* the data is still waiting to be read; see receive_smb() */
+		pending_write_data = 0;
+		nwritten = receive_file_data(fnum, smb_offs, smb_dsize);
+	} else {
+		nwritten = write_file(fnum, data, smb_offs, smb_dsize);
+	}
 
 	if ((nwritten == 0 && smb_dsize != 0) || nwritten < 0)
 		return UNIX_ERROR_CODE(ERRDOS, ERRnoaccess);
@@ -1711,6 +1824,7 @@ int reply_write_and_X(char *inbuf, char *outbuf, size_t inbuf_len,
 	set_message(outbuf, 6, 0, true);
 
 	SSVAL(outbuf, smb_vwv2, nwritten);
+	SSVAL(outbuf, smb_vwv4, nwritten >> 16);
 
 	if (nwritten < smb_dsize) {
 		CVAL(outbuf, smb_rcls) = ERRHRD;
@@ -1729,9 +1843,10 @@ int reply_write_and_X(char *inbuf, char *outbuf, size_t inbuf_len,
 int reply_lseek(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 {
 	int cnum, fnum;
+	struct stat st;
 	uint32_t startpos;
-	int32_t res = -1;
-	int mode, umode;
+	off_t res;
+	int mode;
 	int outsize = 0;
 
 	cnum = SVAL(inbuf, smb_tid);
@@ -1743,26 +1858,30 @@ int reply_lseek(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 	mode = SVAL(inbuf, smb_vwv1) & 3;
 	startpos = IVAL(inbuf, smb_vwv2);
 
+	/* All reads and writes give an explicit offset, so the position is
+	   only ever a value we remember for the client. Relative seeks take a
+	   signed offset. */
 	switch (mode & 3) {
-	case 0:
-		umode = SEEK_SET;
-		break;
 	case 1:
-		umode = SEEK_CUR;
+		res = Files[fnum].pos + (int32_t) startpos;
 		break;
 	case 2:
-		umode = SEEK_END;
+		if (fstat(Files[fnum].fd_ptr->fd, &st) != 0)
+			return UNIX_ERROR_CODE(ERRDOS, ERRnoaccess);
+		res = st.st_size + (int32_t) startpos;
 		break;
 	default:
-		umode = SEEK_SET;
+		res = startpos;
 		break;
 	}
 
-	res = lseek(Files[fnum].fd_ptr->fd, startpos, umode);
+	if (res < 0)
+		res = 0;
 	Files[fnum].pos = res;
 
+	/* there is only room for a 32-bit position in the reply */
 	outsize = set_message(outbuf, 2, 0, true);
-	SIVALS(outbuf, smb_vwv0, res);
+	SIVAL(outbuf, smb_vwv0, size32(res));
 
 	DEBUG("fnum=%d cnum=%d ofs=%d mode=%d\n", fnum, cnum, startpos, mode);
 
@@ -1841,7 +1960,7 @@ int reply_writeclose(char *inbuf, char *outbuf, size_t inbuf_len,
 	int cnum, numtowrite, fnum;
 	int nwritten = -1;
 	int outsize = 0;
-	int startpos;
+	uint32_t startpos;
 	char *data;
 	time_t mtime;
 
@@ -1857,9 +1976,7 @@ int reply_writeclose(char *inbuf, char *outbuf, size_t inbuf_len,
 	mtime = make_unix_date3(inbuf + smb_vwv4);
 	data = smb_buf(inbuf) + 1;
 
-	seek_file(fnum, startpos);
-
-	nwritten = write_file(fnum, data, numtowrite);
+	nwritten = write_file(fnum, data, startpos, numtowrite);
 
 	set_filetime(cnum, Files[fnum].name, mtime);
 
@@ -2005,7 +2122,10 @@ int reply_mkdir(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 	unix_convert(directory, cnum, 0, &bad_path);
 
 	if (check_name(directory, cnum))
-		ret = mkdir(directory, unix_mode(cnum, aDIR));
+		ret = mkdirat(CONN_ROOT(cnum), directory,
+		              unix_mode(cnum, aDIR));
+
+	dir_cache_invalidate();
 
 	if (ret < 0) {
 		if (errno == ENOENT && bad_path) {
@@ -2038,7 +2158,8 @@ int reply_rmdir(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 	if (check_name(directory, cnum)) {
 
 		dptr_closepath(directory, SVAL(inbuf, smb_pid));
-		ok = (rmdir(directory) == 0);
+		ok = (unlinkat(CONN_ROOT(cnum), directory, AT_REMOVEDIR) == 0);
+		dir_cache_invalidate();
 		if (!ok)
 			DEBUG("couldn't remove directory %s : %s\n", directory,
 			      strerror(errno));
@@ -2132,7 +2253,7 @@ static bool can_rename(const char *fname, int cnum)
 	if (!CAN_WRITE(cnum))
 		return false;
 
-	if (lstat(fname, &sbuf) != 0)
+	if (fstatat(CONN_ROOT(cnum), fname, &sbuf, AT_SYMLINK_NOFOLLOW) != 0)
 		return false;
 
 	return true;
@@ -2240,8 +2361,10 @@ int reply_mv(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 		}
 
 		if (resolve_wildcards(directory, newname) &&
-		    can_rename(directory, cnum) && !file_exist(newname, NULL) &&
-		    rename(directory, newname) == 0) {
+		    can_rename(directory, cnum) &&
+		    !file_exist(CONN_ROOT(cnum), newname, NULL) &&
+		    renameat(CONN_ROOT(cnum), directory, CONN_ROOT(cnum),
+		             newname) == 0) {
 			count++;
 		}
 
@@ -2250,8 +2373,9 @@ int reply_mv(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 		      newname);
 
 		if (!count)
-			exists = file_exist(directory, NULL);
-		if (!count && exists && file_exist(newname, NULL)) {
+			exists = file_exist(CONN_ROOT(cnum), directory, NULL);
+		if (!count && exists &&
+		    file_exist(CONN_ROOT(cnum), newname, NULL)) {
 			exists = true;
 			error = 183;
 		}
@@ -2293,12 +2417,14 @@ int reply_mv(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 					continue;
 				}
 
-				if (file_exist(destname, NULL)) {
+				if (file_exist(CONN_ROOT(cnum), destname,
+				               NULL)) {
 					DEBUG("file_exist %s\n", destname);
 					error = 183;
 					continue;
 				}
-				if (rename(fname, destname) == 0) {
+				if (renameat(CONN_ROOT(cnum), fname,
+				             CONN_ROOT(cnum), destname) == 0) {
 					count++;
 				}
 				DEBUG("doing rename on %s -> %s\n", fname,
@@ -2308,6 +2434,9 @@ int reply_mv(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 		}
 	}
 
+	if (count != 0)
+		dir_cache_invalidate();
+
 	if (count == 0) {
 		if (exists)
 			return ERROR_CODE(ERRDOS, error);
@@ -2331,7 +2460,7 @@ static bool copy_file(const char *src, const char *dest1, int cnum, int ofun,
 {
 	int access, action;
 	struct stat st;
-	int ret = 0;
+	off_t ret = 0;
 	int fnum1, fnum2;
 	pstring dest;
 
@@ -2346,17 +2475,17 @@ static bool copy_file(const char *src, const char *dest1, int cnum, int ofun,
 		pstrcat(dest, p);
 	}
 
-	if (!file_exist(src, &st))
+	if (!file_exist(CONN_ROOT(cnum), src, &st))
 		return false;
 
 	fnum1 = find_free_file();
 	if (fnum1 < 0)
 		return false;
-	open_file_shared(fnum1, cnum, src, DENY_NONE << 4, 1, 0, &access,
-	                 &action);
+	open_file_shared(fnum1, cnum, src, DENY_NONE << 4, 1, 0, NO_OPLOCK,
+	                 &access, &action);
 
 	if (!OPEN_FNUM(fnum1)) {
-		Files[fnum1].reserved = false;
+		release_file(fnum1);
 		return false;
 	}
 
@@ -2369,11 +2498,11 @@ static bool copy_file(const char *src, const char *dest1, int cnum, int ofun,
 		return false;
 	}
 	open_file_shared(fnum2, cnum, dest, (DENY_NONE << 4) | 1, ofun,
-	                 st.st_mode, &access, &action);
+	                 st.st_mode, NO_OPLOCK, &access, &action);
 
 	if (!OPEN_FNUM(fnum2)) {
 		close_file(fnum1, false);
-		Files[fnum2].reserved = false;
+		release_file(fnum2);
 		return false;
 	}
 
@@ -2430,7 +2559,7 @@ int reply_copy(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 	unix_convert(name, cnum, 0, &bad_path1);
 	unix_convert(newname, cnum, 0, &bad_path2);
 
-	target_is_directory = directory_exist(newname, NULL);
+	target_is_directory = directory_exist(CONN_ROOT(cnum), newname, NULL);
 
 	if ((flags & 1) && target_is_directory) {
 		return ERROR_CODE(ERRDOS, ERRbadfile);
@@ -2440,7 +2569,8 @@ int reply_copy(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 		return ERROR_CODE(ERRDOS, ERRbadpath);
 	}
 
-	if ((flags & (1 << 5)) && directory_exist(name, NULL)) {
+	if ((flags & (1 << 5)) &&
+	    directory_exist(CONN_ROOT(cnum), name, NULL)) {
 		/* wants a tree copy! XXXX */
 		DEBUG("Rejecting tree copy\n");
 		return ERROR_CODE(ERRSRV, ERRerror);
@@ -2466,7 +2596,7 @@ int reply_copy(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 		              target_is_directory))
 			count++;
 		if (!count)
-			exists = file_exist(directory, NULL);
+			exists = file_exist(CONN_ROOT(cnum), directory, NULL);
 	} else {
 		Dir *dirptr = NULL;
 		char *dname;
@@ -2504,6 +2634,9 @@ int reply_copy(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 		}
 	}
 
+	if (count != 0)
+		dir_cache_invalidate();
+
 	if (count == 0) {
 		if (exists)
 			return ERROR_CODE(ERRDOS, error);
@@ -2532,6 +2665,24 @@ int reply_setdir(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 	return ERROR_CODE(ERRDOS, ERRnoaccess);
 }
 
+/* Read the i'th byte range from a list of smb_lkrng structs, which are in
+   the larger format if large is true. */
+static void get_lock_range(const char *data, int i, bool large,
+                           uint64_t *count, uint64_t *offset)
+{
+	if (large) {
+		*count = IVAL(data, SMB_LARGE_LKLEN_OFFSET_HIGH(i));
+		*count <<= 32;
+		*count |= IVAL(data, SMB_LARGE_LKLEN_OFFSET_LOW(i));
+		*offset = IVAL(data, SMB_LARGE_LKOFF_OFFSET_HIGH(i));
+		*offset <<= 32;
+		*offset |= IVAL(data, SMB_LARGE_LKOFF_OFFSET_LOW(i));
+	} else {
+		*count = IVAL(data, SMB_LKLEN_OFFSET(i));
+		*offset = IVAL(data, SMB_LKOFF_OFFSET(i));
+	}
+}
+
 /* Reply to an SMBlockingX */
 int reply_lockingX(char *inbuf, char *outbuf, size_t inbuf_len,
                    size_t outbuf_len)
@@ -2540,7 +2691,8 @@ int reply_lockingX(char *inbuf, char *outbuf, size_t inbuf_len,
 	unsigned char locktype = CVAL(inbuf, smb_vwv3);
 	uint16_t num_ulocks = SVAL(inbuf, smb_vwv6);
 	uint16_t num_locks = SVAL(inbuf, smb_vwv7);
-	uint32_t count, offset;
+	bool large = (locktype & LOCKING_ANDX_LARGE_FILES) != 0;
+	uint64_t count, offset;
 
 	int cnum;
 	int i;
@@ -2555,32 +2707,31 @@ int reply_lockingX(char *inbuf, char *outbuf, size_t inbuf_len,
 
 	data = smb_buf(inbuf);
 
-	/* Check if this is an oplock break on a file
-	   we have granted an oplock on.
-	 */
+	/* Check if this is the client's response to an oplock break; it may
+	   also be doing some locking at the same time. */
 	if (locktype & LOCKING_ANDX_OPLOCK_RELEASE) {
-		DEBUG("oplock break reply from client for "
-		      "fnum = %d. no oplock granted as not supported.\n",
-		      fnum);
-		return ERROR_CODE(ERRDOS, ERRlock);
+		DEBUG("oplock break reply from client for fnum = %d\n", fnum);
+		release_oplock(fnum, CVAL(inbuf, smb_vwv3 + 1));
+
+		/* a pure oplock release gets no reply */
+		if (num_locks == 0 && num_ulocks == 0)
+			return -1;
 	}
 
 	/* Data now points at the beginning of the list
 	   of smb_unlkrng structs */
 	for (i = 0; i < (int) num_ulocks; i++) {
-		count = IVAL(data, SMB_LKLEN_OFFSET(i));
-		offset = IVAL(data, SMB_LKOFF_OFFSET(i));
+		get_lock_range(data, i, large, &count, &offset);
 		if (!do_unlock(fnum, cnum, count, offset, &eclass, &ecode))
 			return ERROR_CODE(eclass, ecode);
 	}
 
 	/* Now do any requested locks */
-	data += 10 * num_ulocks;
+	data += (large ? 20 : 10) * num_ulocks;
 	/* Data now points at the beginning of the list
 	   of smb_lkrng structs */
 	for (i = 0; i < (int) num_locks; i++) {
-		count = IVAL(data, SMB_LKLEN_OFFSET(i));
-		offset = IVAL(data, SMB_LKOFF_OFFSET(i));
+		get_lock_range(data, i, large, &count, &offset);
 		if (!do_lock(fnum, cnum, count, offset,
 		             (locktype & 1) ? F_RDLCK : F_WRLCK, &eclass,
 		             &ecode))
@@ -2591,8 +2742,7 @@ int reply_lockingX(char *inbuf, char *outbuf, size_t inbuf_len,
 	   all of the previous locks (X/Open spec). */
 	if (i != num_locks && num_locks != 0) {
 		for (; i >= 0; i--) {
-			count = IVAL(data, SMB_LKLEN_OFFSET(i));
-			offset = IVAL(data, SMB_LKOFF_OFFSET(i));
+			get_lock_range(data, i, large, &count, &offset);
 			do_unlock(fnum, cnum, count, offset, &dummy1, &dummy2);
 		}
 		return ERROR_CODE(eclass, ecode);
@@ -2645,8 +2795,7 @@ int reply_writebmpx(char *inbuf, char *outbuf, size_t inbuf_len,
 	   not an SMBwritebmpx - set this up now so we don't forget */
 	CVAL(outbuf, smb_com) = SMBwritec;
 
-	seek_file(fnum, startpos);
-	nwritten = write_file(fnum, data, numtowrite);
+	nwritten = write_file(fnum, data, startpos, numtowrite);
 
 	if (nwritten < numtowrite)
 		return UNIX_ERROR_CODE(ERRHRD, ERRdiskfull);
@@ -2702,7 +2851,7 @@ int reply_writebs(char *inbuf, char *outbuf, size_t inbuf_len,
 	int cnum, numtowrite, fnum;
 	int nwritten = -1;
 	int outsize = 0;
-	int32_t startpos;
+	uint32_t startpos;
 	int tcount, write_through, smb_doff;
 	char *data;
 	struct bmpx_data *wbms;
@@ -2737,8 +2886,7 @@ int reply_writebs(char *inbuf, char *outbuf, size_t inbuf_len,
 	if (wbms->wr_discard)
 		return -1; /* Just discard the packet */
 
-	seek_file(fnum, startpos);
-	nwritten = write_file(fnum, data, numtowrite);
+	nwritten = write_file(fnum, data, startpos, numtowrite);
 
 	if (nwritten < numtowrite) {
 		if (write_through) {
@@ -2810,7 +2958,8 @@ int reply_setattrE(char *inbuf, char *outbuf, size_t inbuf_len,
 	}
 
 	/* Set the date on this file */
-	if (sys_utime(Files[fnum].name, &unix_times) != 0)
+	dir_cache_invalidate();
+	if (sys_utime(CONN_ROOT(cnum), Files[fnum].name, &unix_times) != 0)
 		return ERROR_CODE(ERRDOS, ERRnoaccess);
 
 	DEBUG("fnum=%d cnum=%d actime=%ld modtime=%ld\n", fnum, cnum,
@@ -2852,8 +3001,8 @@ int reply_getattrE(char *inbuf, char *outbuf, size_t inbuf_len,
 		SIVAL(outbuf, smb_vwv6, 0);
 		SIVAL(outbuf, smb_vwv8, 0);
 	} else {
-		SIVAL(outbuf, smb_vwv6, sbuf.st_size);
-		SIVAL(outbuf, smb_vwv8, ROUNDUP(sbuf.st_size, 1024));
+		SIVAL(outbuf, smb_vwv6, size32(sbuf.st_size));
+		SIVAL(outbuf, smb_vwv8, size32(ROUNDUP(sbuf.st_size, 1024)));
 	}
 	SSVAL(outbuf, smb_vwv10, mode);
 
@@ -52,6 +52,7 @@ int reply_writebraw(char *inbuf, char *outbuf, size_t inbuf_len,
 int reply_writeunlock(char *inbuf, char *outbuf, size_t inbuf_len,
                       size_t outbuf_len);
 int reply_write(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len);
+int writex_data_size(const char *inbuf);
 int reply_write_and_X(char *inbuf, char *outbuf, size_t inbuf_len,
                       size_t outbuf_len);
 int reply_lseek(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len);
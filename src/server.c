@@ -9,6 +9,9 @@
  * FITNESS FOR A PARTICULAR PURPOSE.
  */
 
+/* splice() is only declared by glibc if this is defined */
+#define _GNU_SOURCE
+
 #include "server.h"
 
 #include <arpa/inet.h>
@@ -17,14 +20,15 @@
 #include <limits.h>
 #include <netinet/in.h>
 #include <pwd.h>
+#include <setjmp.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
-#include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -34,21 +38,27 @@
 #include <unistd.h>
 #include <utime.h>
 
-#ifdef PROFILING
-#include <sys/time.h>
+#ifdef linux
+#include <sys/sendfile.h>
 #endif
 
 #include "byteorder.h"
 #include "dir.h"
 #include "guards.h" /* IWYU pragma: keep */
 #include "ipc.h"
+#include "locking.h"
 #include "mangle.h"
+#include "namecache.h"
+#include "oplock.h"
+#include "reactor.h"
 #include "reply.h"
 #include "shares.h"
 #include "smb.h"
+#include "stats.h"
 #include "strfunc.h"
 #include "system.h"
 #include "timefunc.h"
+#include "trace.h"
 #include "trans2.h"
 #include "util.h"
 #include "version.h"
@@ -62,19 +72,39 @@ static const uint8_t smb1_protocol_id[4] = {0xff, 'S', 'M', 'B'};
 static const uint8_t smb2_protocol_id[4] = {0xfe, 'S', 'M', 'B'};
 
 static void process(void);
+static bool register_open(int fnum, int oplock_request);
+static void receive_oplock_message(void);
 
 /* the following control timings of various actions. Don't change
    them unless you know what you are doing. These are all in seconds */
 #define DEFAULT_SMBD_TIMEOUT (60 * 60 * 24 * 7)
 #define IDLE_CLOSED_TIMEOUT  (60)
 #define DPTR_IDLE_TIMEOUT    (120)
-#define SMBD_SELECT_LOOP     (10)
 
 #define RUN_AS_USER    "nobody"
 #define DOSATTRIB_NAME "user.DOSATTRIB"
 
 #define MAX_MUX 50
 
+/* preforked workers exit and are replaced after serving this many clients,
+   so that any leaked memory or descriptors do not build up forever; this
+   can be changed with -r */
+#define DEFAULT_PREFORK_MAX_SESSIONS 100
+
+/* SMBwriteX requests with at least this much data are received straight into
+   the file; see receive_smb() */
+#define DIRECT_WRITE_THRESHOLD (16 * 1024)
+
+/* Each connection keeps its share's top directory open. check_name() only
+   needs to look paths up relative to it, not to open them for real. */
+#ifdef O_PATH
+#define ROOT_DIR_FLAGS   (O_PATH | O_DIRECTORY)
+#define CHECK_NAME_FLAGS O_PATH
+#else
+#define ROOT_DIR_FLAGS   (O_RDONLY | O_DIRECTORY)
+#define CHECK_NAME_FLAGS (O_RDONLY | O_NONBLOCK | O_NOCTTY)
+#endif
+
 static char *original_argv0;
 static char **original_argv;
 static int original_argc;
@@ -97,17 +127,91 @@ static int last_message = -1;
 
 static time_t smb_last_time = (time_t) 0;
 
-struct service_connection Connections[MAX_CONNECTIONS];
-struct open_file Files[MAX_OPEN_FILES];
+/* These point into the current session; see session_switch() */
+struct service_connection *Connections;
+struct open_file *Files;
+int num_file_slots = 0;
+
+/* Size limit of the file table, which is one more than the number of files
+   a client may have open since file number 0 is never used; set with -m */
+static int max_open_files = DEFAULT_MAX_OPEN_FILES + 1;
+
+/* The file table grows in steps as files are opened, starting here */
+#define MIN_FILE_SLOTS 16
 
 /*
  * Indirection for file fd's. Needed as POSIX locking is based on file/process,
  * not fd/process. Context:
  * <https://www.samba.org/samba/news/articles/low_point/tale_two_stds_os2.html>
  * TODO: The 2024 POSIX spec now includes OFD locks, so this can be replaced
+ *
+ * The open fds are kept in a hash table keyed on device and inode, so that
+ * we can quickly find one to share when a file is opened again.
  */
-static struct open_fd FileFd[MAX_OPEN_FILES];
-static int max_file_fd_used = 0;
+#define OPEN_FD_HASH_SIZE 64
+static struct open_fd **FileFd;
+
+/* All of the state belonging to one client. In the traditional model, each
+   client gets its own forked process and there is only one of these; in
+   event mode, each worker process serves many clients. The request handlers
+   only ever look at the globals, so session_switch() swaps those over. */
+struct session {
+	struct session *next;
+	int fd;
+	char addr[32];
+	fstring machine_name;
+	int protocol;
+	int max_send;
+	bool done_sesssetup;
+	uint32_t client_capabilities;
+	int num_connections_open;
+	time_t last_activity;
+	struct reactor_timer timer;
+	struct recv_buffer *recv_buf;
+	struct dptr_table *dptrs;
+	struct service_connection connections[MAX_CONNECTIONS];
+	struct open_file *files;
+	int num_files;
+	int free_files_head, free_files_tail;
+	struct open_fd *file_fds[OPEN_FD_HASH_SIZE];
+	struct session_stats *stats;
+	uint32_t trace_id;
+	uint32_t id; /* identifies the session in the oplock table */
+};
+
+static struct session *sessions = NULL;
+static struct session *cur_session = NULL;
+
+/* Number of worker processes to run; if zero, we fork a new process for
+   every connection instead. In event mode, each worker serves many clients
+   at once; otherwise they are preforked and serve one client at a time. */
+static int num_workers = 0;
+static bool event_mode = false;
+
+/* How many clients a preforked worker serves before it is replaced; zero
+   means that it never is */
+static int prefork_max_sessions = DEFAULT_PREFORK_MAX_SESSIONS;
+
+/* The listening socket for each worker. For event workers these are
+   separate SO_REUSEPORT sockets bound to the same port where possible, so
+   that the kernel balances incoming connections between the workers.
+   Preforked workers all share one socket: the kernel picks a SO_REUSEPORT
+   socket by hashing the client address, so new clients would queue up
+   behind a worker that is busy serving someone else. */
+static int *worker_sockets;
+
+/* Used in event mode to back out of a request when the session has to be
+   closed, instead of exiting the whole process. */
+static sigjmp_buf session_abort;
+static bool session_abort_armed = false;
+static bool shutting_down = false;
+
+/* Set when tumba_replay is feeding us SMBs from a trace */
+static bool replaying = false;
+
+/* The socket that other processes send us oplock break requests on, or -1
+   if we cannot grant oplocks; see oplock.c */
+static int oplock_fd = -1;
 
 const char *workgroup = "WORKGROUP";
 static const char *bind_addr = "0.0.0.0";
@@ -119,9 +223,19 @@ static const char *bind_addr = "0.0.0.0";
  */
 int max_send = BUFFER_SIZE;
 
+/* max_send can only be lowered by the first SMBsesssetupX */
+bool done_sesssetup = false;
+
+/* CAP_* flags that an NT LM 0.12 client gave in its SMBsesssetupX */
+uint32_t client_capabilities = 0;
+
 /* a fnum to use when chaining */
 int chain_fnum = -1;
 
+/* bytes of data at the end of the current SMB that are still waiting to be
+   read from the socket; see receive_file_data() */
+int pending_write_data = 0;
+
 /* number of open connections */
 static int num_connections_open = 0;
 
@@ -138,6 +252,7 @@ static int find_free_connection(unsigned int hash);
 
 static void *dflt_sig(void)
 {
+	shutting_down = true;
 	exit_server("caught signal");
 	return 0; /* Keep -Wall happy :-) */
 }
@@ -177,12 +292,12 @@ mode_t unix_mode(int cnum, int dosmode)
 	return result;
 }
 
-static int read_dosattrib(const char *path)
+static int read_dosattrib(int dirfd, const char *path)
 {
 	char buf[5];
 	ssize_t nbytes;
 
-	nbytes = sys_getxattr(path, DOSATTRIB_NAME, buf, sizeof(buf));
+	nbytes = sys_getxattrat(dirfd, path, DOSATTRIB_NAME, buf, sizeof(buf));
 	if (nbytes < 3 || nbytes > 4) {
 		return 0;
 	}
@@ -196,14 +311,16 @@ static int read_dosattrib(const char *path)
 	return strtol(buf + 2, NULL, 16) & (aARCH | aSYSTEM | aHIDDEN);
 }
 
-static void write_dosattrib(const char *path, int attrib)
+static void write_dosattrib(int dirfd, const char *path, int attrib)
 {
 	struct stat st;
 	char buf[5];
 	int result, new_mode;
 
+	dir_cache_invalidate();
+
 	snprintf(buf, sizeof(buf), "0x%02x", attrib);
-	result = sys_setxattr(path, DOSATTRIB_NAME, buf, strlen(buf));
+	result = sys_setxattrat(dirfd, path, DOSATTRIB_NAME, buf, strlen(buf));
 	if (result != 0) {
 		DEBUG("setxattr on %s returned %d (errno=%d)\n", path, result,
 		      errno);
@@ -218,7 +335,7 @@ static void write_dosattrib(const char *path, int attrib)
 	/* We got permission denied trying to set the xattr. This may be
 	   because the file is write-protected. So set the permissions to
 	   allow writes and try again. */
-	if (stat(path, &st) != 0) {
+	if (fstatat(dirfd, path, &st, 0) != 0) {
 		DEBUG("failed to stat %s\n", path);
 		return;
 	}
@@ -228,24 +345,30 @@ static void write_dosattrib(const char *path, int attrib)
 		DEBUG("failed to stat %s\n", path);
 		return;
 	}
-	if (chmod(path, new_mode) != 0) {
+	if (fchmodat(dirfd, path, new_mode, 0) != 0) {
 		DEBUG("failed to chmod %s to %o\n", path, new_mode);
 		return;
 	}
-	result = sys_setxattr(path, DOSATTRIB_NAME, buf, strlen(buf));
+	result = sys_setxattrat(dirfd, path, DOSATTRIB_NAME, buf, strlen(buf));
 	if (result != 0) {
 		DEBUG("setxattr on %s failed (second attempt)\n", path);
 	} else {
 		DEBUG("mode switch workaround succeeded\n");
 	}
 	/* Change back to the old permissions */
-	if (chmod(path, st.st_mode) != 0) {
+	if (fchmodat(dirfd, path, st.st_mode, 0) != 0) {
 		DEBUG("failed to chmod %s back to %o\n", path, st.st_mode);
 	}
 }
 
 /* Change a unix mode to a dos mode */
 int dos_mode(int cnum, const char *path, struct stat *sbuf)
+{
+	return dos_mode_at(cnum, CONN_ROOT(cnum), path, sbuf);
+}
+
+/* As dos_mode(), but path is relative to the directory dirfd */
+int dos_mode_at(int cnum, int dirfd, const char *path, struct stat *sbuf)
 {
 	int result = 0;
 
@@ -261,7 +384,7 @@ int dos_mode(int cnum, const char *path, struct stat *sbuf)
 		result |= aRONLY;
 	}
 
-	result |= read_dosattrib(path);
+	result |= read_dosattrib(dirfd, path);
 
 	if (S_ISDIR(sbuf->st_mode))
 		result = aDIR | (result & aRONLY);
@@ -293,7 +416,7 @@ int dos_chmod(int cnum, const char *fname, int dosmode, struct stat *st)
 
 	if (!st) {
 		st = &st1;
-		if (stat(fname, st))
+		if (fstatat(CONN_ROOT(cnum), fname, st, 0))
 			return -1;
 	}
 
@@ -312,7 +435,7 @@ int dos_chmod(int cnum, const char *fname, int dosmode, struct stat *st)
 #ifdef S_ISVTX
 	mask |= S_ISVTX;
 #endif
-	write_dosattrib(fname, dosmode);
+	write_dosattrib(CONN_ROOT(cnum), fname, dosmode);
 
 	unixmode |= (st->st_mode & mask);
 
@@ -333,7 +456,7 @@ int dos_chmod(int cnum, const char *fname, int dosmode, struct stat *st)
 		           (st->st_mode & (S_IWUSR | S_IWGRP | S_IWOTH));
 	}
 
-	return chmod(fname, unixmode);
+	return fchmodat(CONN_ROOT(cnum), fname, unixmode, 0);
 }
 
 bool set_filetime(int cnum, const char *fname, time_t mtime)
@@ -345,27 +468,14 @@ bool set_filetime(int cnum, const char *fname, time_t mtime)
 
 	times.modtime = times.actime = mtime;
 
-	if (sys_utime(fname, &times) != 0) {
+	dir_cache_invalidate();
+	if (sys_utime(CONN_ROOT(cnum), fname, &times) != 0) {
 		DEBUG("fname=%s failed: %s\n", fname, strerror(errno));
 	}
 
 	return true;
 }
 
-/* Mangle the 2nd name and check if it is then equal to the first name */
-static bool mangled_equal(const char *name1, const char *name2)
-{
-	pstring tmpname;
-
-	if (is_8_3(name2, true))
-		return false;
-
-	pstrcpy(tmpname, name2);
-	mangle_name_83(tmpname, sizeof(pstring) - 1);
-
-	return strequal(name1, tmpname);
-}
-
 /*
 Scan a directory to find a filename, matching without case sensitivity
 
@@ -376,7 +486,6 @@ static bool scan_directory(char *path, char *name, int cnum)
 	Dir *cur_dir;
 	char *dname;
 	bool mangled;
-	pstring name2;
 
 	mangled = is_mangled(name);
 
@@ -386,10 +495,10 @@ static bool scan_directory(char *path, char *name, int cnum)
 
 	/*
 	 * The incoming name can be mangled, and if we de-mangle it
-	 * here it will not compare correctly against the filename (name2)
+	 * here it will not compare correctly against the filename
 	 * read from the directory and then mangled by the name_map_mangle()
 	 * call. We need to mangle both names or neither.
-	 * (JRA).
+	 * (JRA). The directory index keys entries by their mangled names.
 	 */
 
 	/* open the directory */
@@ -398,88 +507,29 @@ static bool scan_directory(char *path, char *name, int cnum)
 		return false;
 	}
 
-	/* now scan for matching names */
-	while ((dname = read_dir_name(cur_dir))) {
-		if (*dname == '.' &&
-		    (strequal(dname, ".") || strequal(dname, "..")))
-			continue;
-
-		pstrcpy(name2, dname);
-		name_map_mangle(name2, false, CONN_SHARE(cnum));
-
-		if ((mangled && mangled_equal(name, name2)) ||
-		    strequal(name, name2)) {
-			pstrcpy(name, dname);
-			close_dir(cur_dir);
-			return true;
-		}
+	/* look the name up in the directory's index */
+	dname = find_dir_name(cur_dir, name, false, mangled);
+	if (dname != NULL && !strequal(dname, ".") && !strequal(dname, "..")) {
+		pstrcpy(name, dname);
+		close_dir(cur_dir);
+		return true;
 	}
 
 	close_dir(cur_dir);
 	return false;
 }
 
-/*
-This routine is called to convert names from the dos namespace to unix
-namespace. It needs to handle any case conversions, mangling, format
-changes etc.
-
-We assume that we have already done a chdir() to the right "root" directory
-for this service.
-
-The function will return false if some part of the name except for the last
-part cannot be resolved
-
-If the saved_last_component != 0, then the unmodified last component
-of the pathname is returned there. This is used in an exceptional
-case in reply_mv (so far). If saved_last_component == 0 then nothing
-is returned there.
-
-The bad_path arg is set to true if the filename walk failed. This is
-used to pick the correct error code to return between ENOENT and ENOTDIR
-as Windows applications depend on ERRbadpath being returned if a component
-of a pathname does not exist.
-*/
-bool unix_convert(char *name, int cnum, pstring saved_last_component,
-                  bool *bad_path)
+/* Match each part of a path that does not exist as given against the real
+   directory structure; see unix_convert(). On return, dirpath is the part
+   of the path that was resolved, and *found is set if the whole thing was. */
+static bool walk_name(char *name, int cnum, pstring saved_last_component,
+                      bool *bad_path, char *dirpath, bool *found)
 {
 	struct stat st;
 	char *start, *end;
-	pstring dirpath;
 
 	*dirpath = 0;
-	*bad_path = false;
-
-	if (saved_last_component)
-		*saved_last_component = 0;
-
-	/* convert to basic unix format - removing \ chars and cleaning it up */
-	unix_format(name);
-	unix_clean_name(name);
-
-	/* names must be relative to the root of the service - trim any leading
-	 /. also trim trailing /'s */
-	trim_string(name, "/", "/");
-
-	/*
-	 * Ensure saved_last_component is valid even if file exists.
-	 */
-	if (saved_last_component) {
-		end = strrchr(name, '/');
-		if (end)
-			pstrcpy(saved_last_component, end + 1);
-		else
-			pstrcpy(saved_last_component, name);
-	}
-
-	if (is_8_3(name, false))
-		strnorm(name);
-
-	/* stat the name - if it exists then we are all done! */
-	if (stat(name, &st) == 0)
-		return true;
-
-	DEBUG("name=%s cnum=%d\n", name, cnum);
+	*found = false;
 
 	/* now we need to recursively match the name against the real
 	   directory structure */
@@ -502,7 +552,7 @@ bool unix_convert(char *name, int cnum, pstring saved_last_component,
 			pstrcpy(saved_last_component, end ? end + 1 : start);
 
 		/* check if the name exists up to this point */
-		if (stat(name, &st) == 0) {
+		if (fstatat(CONN_ROOT(cnum), name, &st, 0) == 0) {
 			/* it exists. it must either be a directory or this must
 			   be the last part of the path for it to be OK */
 			if (end && !(st.st_mode & S_IFDIR)) {
@@ -569,9 +619,91 @@ bool unix_convert(char *name, int cnum, pstring saved_last_component,
 
 	/* the name has been resolved */
 	DEBUG("conversion finished %s\n", name);
+	*found = true;
 	return true;
 }
 
+
+/*
+This routine is called to convert names from the dos namespace to unix
+namespace. It needs to handle any case conversions, mangling, format
+changes etc.
+
+The name is relative to the top directory of the service, which all file
+operations look names up from (see CONN_ROOT()).
+
+The function will return false if some part of the name except for the last
+part cannot be resolved
+
+If the saved_last_component != 0, then the unmodified last component
+of the pathname is returned there. This is used in an exceptional
+case in reply_mv (so far). If saved_last_component == 0 then nothing
+is returned there.
+
+The bad_path arg is set to true if the filename walk failed. This is
+used to pick the correct error code to return between ENOENT and ENOTDIR
+as Windows applications depend on ERRbadpath being returned if a component
+of a pathname does not exist.
+*/
+bool unix_convert(char *name, int cnum, pstring saved_last_component,
+                  bool *bad_path)
+{
+	struct stat st;
+	char *end;
+	pstring dirpath, dosname;
+	bool found, result;
+
+	*bad_path = false;
+
+	if (saved_last_component)
+		*saved_last_component = 0;
+
+	/* convert to basic unix format - removing \ chars and cleaning it up */
+	unix_format(name);
+	unix_clean_name(name);
+
+	/* names must be relative to the root of the service - trim any leading
+	 /. also trim trailing /'s */
+	trim_string(name, "/", "/");
+
+	/*
+	 * Ensure saved_last_component is valid even if file exists.
+	 */
+	if (saved_last_component) {
+		end = strrchr(name, '/');
+		if (end)
+			pstrcpy(saved_last_component, end + 1);
+		else
+			pstrcpy(saved_last_component, name);
+	}
+
+	if (is_8_3(name, false))
+		strnorm(name);
+
+	/* stat the name - if it exists then we are all done! */
+	if (fstatat(CONN_ROOT(cnum), name, &st, 0) == 0)
+		return true;
+
+	DEBUG("name=%s cnum=%d\n", name, cnum);
+
+	/* reply_mv needs the last component from the walk, so it can't use
+	   the cache */
+	if (saved_last_component == NULL &&
+	    name_cache_lookup(CONN_SHARE(cnum), CONN_ROOT(cnum), name, &result,
+	                      bad_path)) {
+		DEBUG("cached conversion %s\n", name);
+		return result;
+	}
+
+	pstrcpy(dosname, name);
+	result = walk_name(name, cnum, saved_last_component, bad_path, dirpath,
+	                   &found);
+	name_cache_add(CONN_SHARE(cnum), CONN_ROOT(cnum), dosname, name,
+	               dirpath, found, result, *bad_path);
+
+	return result;
+}
+
 /* Return number of 1K blocks available on a path and total number */
 static int disk_free(const char *path, int *bsize, int *dfree, int *dsize)
 {
@@ -597,13 +729,20 @@ static bool path_within(const char *path, const char *top)
 }
 
 /* Returns true only if the path specified by `name` is contained entirely
- * within the path given in `top`. */
+ * within the path given in `top`, which must already be canonical. */
 static bool check_path_contained(const char *name, const char *top)
 {
+	size_t top_len = strlen(top);
 	pstring path;
 	char *p;
 
-	pstrcpy(path, name);
+	if (name[0] == '/') {
+		pstrcpy(path, name);
+	} else {
+		pstrcpy(path, top);
+		pstrcat(path, "/");
+		pstrcat(path, name);
+	}
 
 	/* To check for a valid path, we check the realpath()-expanded
 	   filename (with all symlinks removed) is a subpath of the top-level
@@ -637,9 +776,10 @@ static bool check_path_contained(const char *name, const char *top)
 			return false;
 		}
 
-		/* Walk up to the parent directory; we will check that too. */
+		/* Walk up to the parent directory; we will check that too,
+		   unless it is the top directory itself. */
 		p = strrchr(path, '/');
-		if (p == NULL) {
+		if (p == NULL || p - path <= (ptrdiff_t) top_len) {
 			return true;
 		}
 
@@ -647,6 +787,33 @@ static bool check_path_contained(const char *name, const char *top)
 	}
 }
 
+/* Returns true if the path specified by `name` can be looked up without
+ * leaving the share's top directory. If the OS can do this for us then it
+ * takes a single open() with no path walking of our own; *supported is set
+ * to false if it can't. */
+static bool check_path_beneath(const char *name, int root_fd,
+                               bool *supported)
+{
+	int fd;
+
+	/* As above, it's okay if the file doesn't exist: the kernel will
+	   already have checked the part of the path that does. */
+	fd = sys_open_beneath(root_fd, *name != '\0' ? name : ".",
+	                      CHECK_NAME_FLAGS);
+	if (fd >= 0) {
+		close(fd);
+		return true;
+	} else if (errno == ENOENT) {
+		return true;
+	} else if (errno == ENOSYS) {
+		*supported = false;
+	} else if (errno == EXDEV) {
+		errno = EACCES;
+	}
+
+	return false;
+}
+
 /*
 Check a filename - possibly caling reducename
 
@@ -656,8 +823,8 @@ a valid one for the user to access.
 */
 bool check_name(const char *name, int cnum)
 {
+	static bool have_open_beneath = true;
 	const char *top = Connections[cnum].connectpath;
-	char old_wd[PATH_MAX];
 	bool success = false;
 
 	if (CONN_SHARE(cnum) == ipc_service) {
@@ -668,27 +835,24 @@ bool check_name(const char *name, int cnum)
 	if (!strcmp(top, "/")) {
 		return true;
 	}
-	if (getcwd(old_wd, sizeof(old_wd)) == NULL) {
-		DEBUG("denied: getcwd() errno=%d\n", errno);
-		return false;
+
+	if (have_open_beneath) {
+		success = check_path_beneath(name, Connections[cnum].root_fd,
+		                             &have_open_beneath);
+		if (!have_open_beneath) {
+			INFO("no kernel support for confined lookups; "
+			     "using realpath() instead\n");
+		}
 	}
-	if (chdir(top) != 0) {
-		DEBUG("denied: chdir(%s) errno=%d\n", top, errno);
-		return false;
+	if (!have_open_beneath) {
+		success = check_path_contained(name, top);
 	}
 
-	/* TODO: There should maybe be an option to allow symlinks to certain
-	   allow-listed directories. */
-	success = check_path_contained(name, top);
 	if (!success) {
 		INFO("check_name: denied: %s not within %s subtree\n", name,
 		     top);
 	}
 
-	if (chdir(old_wd) != 0) {
-		DEBUG("ending chdir(%s) errno=%d\n", old_wd, errno);
-	}
-
 	return success;
 }
 
@@ -706,14 +870,29 @@ static void check_for_pipe(const char *fname)
 	}
 }
 
-static int fd_attempt_open(char *fname, int flags, int mode)
+/* Get the maximum filename length in the directory dir */
+static long name_max_at(int dirfd, const char *dir)
+{
+	long result;
+	int fd = openat(dirfd, dir, O_RDONLY | O_DIRECTORY);
+
+	if (fd < 0) {
+		return -1;
+	}
+	result = fpathconf(fd, _PC_NAME_MAX);
+	close(fd);
+
+	return result;
+}
+
+static int fd_attempt_open(int dirfd, char *fname, int flags, int mode)
 {
-	int fd = open(fname, flags, mode);
+	int fd = openat(dirfd, fname, flags, mode);
 
 	/* Fix for files ending in '.' */
 	if (fd == -1 && errno == ENOENT && strchr(fname, '.') == NULL) {
 		pstrcat(fname, ".");
-		fd = open(fname, flags, mode);
+		fd = openat(dirfd, fname, flags, mode);
 	}
 
 	if (fd == -1 && errno == ENAMETOOLONG) {
@@ -726,87 +905,95 @@ static int fd_attempt_open(char *fname, int flags, int mode)
 			p++;
 		} else if (p == NULL || p == fname) {
 			p = fname;
-			max_len = pathconf(".", _PC_NAME_MAX);
+			max_len = name_max_at(dirfd, ".");
 		} else {
 			*p = '\0';
-			max_len = pathconf(fname, _PC_NAME_MAX);
+			max_len = name_max_at(dirfd, fname);
 			*p = '/';
 			p++;
 		}
-		if (strlen(p) > max_len) {
+		if (max_len > 0 && strlen(p) > max_len) {
 			char tmp = p[max_len];
 
 			p[max_len] = '\0';
-			if ((fd = open(fname, flags, mode)) == -1)
+			if ((fd = openat(dirfd, fname, flags, mode)) == -1)
 				p[max_len] = tmp;
 		}
 	}
 	return fd;
 }
 
+static unsigned int fd_hash(uint32_t dev, uint32_t inode)
+{
+	return (dev * 31 + inode) % OPEN_FD_HASH_SIZE;
+}
+
 /* Attempt to find an already open file by dev and inode - incrementing the
  * ref_count of the returned struct open_fd *. */
 static struct open_fd *fd_get_already_open(struct stat *sbuf)
 {
-	int i;
+	uint32_t dev, inode;
 	struct open_fd *fd_ptr;
 
 	if (sbuf == 0)
 		return 0;
 
-	for (i = 0; i <= max_file_fd_used; i++) {
-		fd_ptr = &FileFd[i];
-		if (fd_ptr->ref_count > 0 &&
-		    (uint32_t) sbuf->st_dev == fd_ptr->dev &&
-		    (uint32_t) sbuf->st_ino == fd_ptr->inode) {
+	dev = (uint32_t) sbuf->st_dev;
+	inode = (uint32_t) sbuf->st_ino;
+
+	for (fd_ptr = FileFd[fd_hash(dev, inode)]; fd_ptr != NULL;
+	     fd_ptr = fd_ptr->next) {
+		if (dev == fd_ptr->dev && inode == fd_ptr->inode) {
 			fd_ptr->ref_count++;
-			DEBUG("Re-used struct open_fd %d, dev = %x, inode "
-			      "= %x, ref_count = %d\n",
-			      i, fd_ptr->dev, fd_ptr->inode, fd_ptr->ref_count);
+			DEBUG("Re-used struct open_fd, dev = %x, inode = %x, "
+			      "ref_count = %d\n",
+			      fd_ptr->dev, fd_ptr->inode, fd_ptr->ref_count);
 			return fd_ptr;
 		}
 	}
 	return 0;
 }
 
-/* Attempt to find a empty slot in the FileFd array. Increments the ref_count
- * of the returned entry. */
+/* Allocate a new struct open_fd with a ref_count of one. It is not added to
+ * the hash table until fd_set_file() is called. */
 static struct open_fd *fd_get_new(void)
 {
-	int i;
-	struct open_fd *fd_ptr;
+	struct open_fd *fd_ptr = checked_calloc(1, sizeof(struct open_fd));
 
-	for (i = 0; i < MAX_OPEN_FILES; i++) {
-		fd_ptr = &FileFd[i];
-		if (fd_ptr->ref_count == 0) {
-			fd_ptr->dev = (uint32_t) -1;
-			fd_ptr->inode = (uint32_t) -1;
-			fd_ptr->fd = -1;
-			fd_ptr->fd_readonly = -1;
-			fd_ptr->fd_writeonly = -1;
-			fd_ptr->real_open_flags = -1;
-			fd_ptr->ref_count++;
-			/* Increment max used counter if neccessary, cuts down
-			   on search time when re-using */
-			if (i > max_file_fd_used)
-				max_file_fd_used = i;
-			DEBUG("Allocated new struct open_fd %d, dev = %x, "
-			      "inode = %x\n",
-			      i, fd_ptr->dev, fd_ptr->inode);
-			return fd_ptr;
-		}
-	}
-	WARNING("Out of file_fd structures - perhaps increase "
-	        "MAX_OPEN_FILES?\n");
-	return 0;
+	fd_ptr->dev = (uint32_t) -1;
+	fd_ptr->inode = (uint32_t) -1;
+	fd_ptr->fd = -1;
+	fd_ptr->fd_readonly = -1;
+	fd_ptr->fd_writeonly = -1;
+	fd_ptr->real_open_flags = -1;
+	fd_ptr->ref_count = 1;
+
+	return fd_ptr;
+}
+
+/* Record which file a new struct open_fd refers to, so that later opens of
+ * the same file can find it. */
+static void fd_set_file(struct open_fd *fd_ptr, struct stat *sbuf)
+{
+	struct open_fd **bucket;
+
+	fd_ptr->dev = (uint32_t) sbuf->st_dev;
+	fd_ptr->inode = (uint32_t) sbuf->st_ino;
+
+	bucket = &FileFd[fd_hash(fd_ptr->dev, fd_ptr->inode)];
+	fd_ptr->next = *bucket;
+	*bucket = fd_ptr;
+
+	DEBUG("Allocated new struct open_fd, dev = %x, inode = %x\n",
+	      fd_ptr->dev, fd_ptr->inode);
 }
 
 /* Attempt to re-open an already open fd as O_RDWR. Save the already open fd
  * (we cannot close due to POSIX file locking brain damage) */
-static void fd_attempt_reopen(const char *fname, int mode,
+static void fd_attempt_reopen(int dirfd, const char *fname, int mode,
                               struct open_fd *fd_ptr)
 {
-	int fd = open(fname, O_RDWR, mode);
+	int fd = openat(dirfd, fname, O_RDWR, mode);
 
 	if (fd == -1)
 		return;
@@ -821,31 +1008,37 @@ static void fd_attempt_reopen(const char *fname, int mode,
 }
 
 /* Attempt to close the file referenced by this fd. Decrements the ref_count
- * and returns it. */
+ * and returns it; once it reaches zero, the struct open_fd is freed. */
 static int fd_attempt_close(struct open_fd *fd_ptr)
 {
-	DEBUG("open_fd %d, fd = %d, dev = %x, "
-	      "inode = %x, open_flags = %d, ref_count = %d.\n",
-	      (int) (fd_ptr - &FileFd[0]), fd_ptr->fd, fd_ptr->dev,
-	      fd_ptr->inode, fd_ptr->real_open_flags, fd_ptr->ref_count);
-	if (fd_ptr->ref_count > 0) {
-		fd_ptr->ref_count--;
-		if (fd_ptr->ref_count == 0) {
-			if (fd_ptr->fd != -1)
-				close(fd_ptr->fd);
-			if (fd_ptr->fd_readonly != -1)
-				close(fd_ptr->fd_readonly);
-			if (fd_ptr->fd_writeonly != -1)
-				close(fd_ptr->fd_writeonly);
-			fd_ptr->fd = -1;
-			fd_ptr->fd_readonly = -1;
-			fd_ptr->fd_writeonly = -1;
-			fd_ptr->real_open_flags = -1;
-			fd_ptr->dev = (uint32_t) -1;
-			fd_ptr->inode = (uint32_t) -1;
-		}
-	}
-	return fd_ptr->ref_count;
+	struct open_fd **p;
+
+	DEBUG("fd = %d, dev = %x, inode = %x, open_flags = %d, "
+	      "ref_count = %d.\n",
+	      fd_ptr->fd, fd_ptr->dev, fd_ptr->inode, fd_ptr->real_open_flags,
+	      fd_ptr->ref_count);
+	if (fd_ptr->ref_count > 1) {
+		return --fd_ptr->ref_count;
+	}
+
+	if (fd_ptr->fd != -1)
+		close(fd_ptr->fd);
+	if (fd_ptr->fd_readonly != -1)
+		close(fd_ptr->fd_readonly);
+	if (fd_ptr->fd_writeonly != -1)
+		close(fd_ptr->fd_writeonly);
+
+	/* It is not in the hash table if we failed to open the file */
+	for (p = &FileFd[fd_hash(fd_ptr->dev, fd_ptr->inode)]; *p != NULL;
+	     p = &(*p)->next) {
+		if (*p == fd_ptr) {
+			*p = fd_ptr->next;
+			break;
+		}
+	}
+
+	free(fd_ptr);
+	return 0;
 }
 
 static void open_file(int fnum, int cnum, const char *fname1, int flags,
@@ -856,6 +1049,7 @@ static void open_file(int fnum, int cnum, const char *fname1, int flags,
 	struct open_fd *fd_ptr;
 	struct open_file *fsp = &Files[fnum];
 	int accmode = (flags & (O_RDONLY | O_WRONLY | O_RDWR));
+	bool new_fd = false;
 
 	fsp->open = false;
 	fsp->fd_ptr = 0;
@@ -900,7 +1094,7 @@ static void open_file(int fnum, int cnum, const char *fname1, int flags,
 	 * open fd table.
 	 */
 	if (sbuf == 0) {
-		if (stat(fname, &statbuf) < 0) {
+		if (fstatat(CONN_ROOT(cnum), fname, &statbuf, 0) < 0) {
 			if (errno != ENOENT) {
 				DEBUG("Error doing stat on file %s (%s)\n",
 				      fname, strerror(errno));
@@ -939,7 +1133,8 @@ static void open_file(int fnum, int cnum, const char *fname1, int flags,
 		 * between the last open and now.
 		 */
 		if (fd_ptr->real_open_flags != O_RDWR)
-			fd_attempt_reopen(fname, mode, fd_ptr);
+			fd_attempt_reopen(CONN_ROOT(cnum), fname, mode,
+			                  fd_ptr);
 
 		/*
 		 * Ensure that if we wanted write access
@@ -962,10 +1157,10 @@ static void open_file(int fnum, int cnum, const char *fname1, int flags,
 
 	} else {
 		int open_flags;
-		/* We need to allocate a new struct open_fd (this increments the
+		/* We need to allocate a new struct open_fd (this sets the
 		   ref_count). */
-		if ((fd_ptr = fd_get_new()) == 0)
-			return;
+		fd_ptr = fd_get_new();
+		new_fd = true;
 		/*
 		 * Whatever the requested flags, attempt read/write access,
 		 * as we don't know what flags future file opens may require.
@@ -979,13 +1174,15 @@ static void open_file(int fnum, int cnum, const char *fname1, int flags,
 		fd_ptr->real_open_flags = O_RDWR;
 		/* Set the flags as needed without the read/write modes. */
 		open_flags = flags & ~(O_RDWR | O_WRONLY | O_RDONLY);
-		fd_ptr->fd = fd_attempt_open(fname, open_flags | O_RDWR, mode);
+		fd_ptr->fd = fd_attempt_open(CONN_ROOT(cnum), fname,
+		                             open_flags | O_RDWR, mode);
 		/* On some systems opening a file for R/W access on a read only
 		 * filesystems sets errno to EROFS. */
 		if (fd_ptr->fd == -1 && (errno == EACCES || errno == EROFS)) {
 			if (accmode != O_RDWR) {
 				fd_ptr->fd = fd_attempt_open(
-				    fname, open_flags | accmode, mode);
+				    CONN_ROOT(cnum), fname,
+				    open_flags | accmode, mode);
 				fd_ptr->real_open_flags = accmode;
 			}
 		}
@@ -1016,20 +1213,27 @@ static void open_file(int fnum, int cnum, const char *fname1, int flags,
 		}
 
 		/* Set the correct entries in fd_ptr. */
-		fd_ptr->dev = (uint32_t) sbuf->st_dev;
-		fd_ptr->inode = (uint32_t) sbuf->st_ino;
+		if (new_fd)
+			fd_set_file(fd_ptr, sbuf);
 
 		fsp->fd_ptr = fd_ptr;
 		Connections[cnum].num_files_open++;
+		stats_open_files(1);
 		fsp->mode = sbuf->st_mode;
 		fsp->size = 0;
-		fsp->pos = -1;
+		fsp->pos = 0;
 		fsp->open = true;
 		fsp->can_lock = true;
 		fsp->can_read = (flags & O_WRONLY) == 0;
 		fsp->can_write = (flags & (O_WRONLY | O_RDWR)) != 0;
 		fsp->share_mode = 0;
 		fsp->modified = false;
+		fsp->oplock = NO_OPLOCK;
+		fsp->oplock_entry = 0;
+		fsp->oplock_break_level = OPLOCKLEVEL_NONE;
+		fsp->next_read = 0;
+		fsp->sequential_reads = 0;
+		fsp->readahead_end = 0;
 		fsp->cnum = cnum;
 		string_set(&fsp->name, fname);
 		fsp->wbmpx_ptr = NULL;
@@ -1054,14 +1258,14 @@ void close_file(int fnum, bool normal_close)
 	struct open_file *fs_p = &Files[fnum];
 	int cnum = fs_p->cnum;
 
-	Files[fnum].reserved = false;
-
 	fs_p->open = false;
 	Connections[cnum].num_files_open--;
+	stats_open_files(-1);
 	free(fs_p->wbmpx_ptr);
 	fs_p->wbmpx_ptr = NULL;
 
 	fd_attempt_close(fs_p->fd_ptr);
+	oplock_remove(fs_p->oplock_entry);
 
 	DEBUG("closed file %s (numopen=%d)\n", fs_p->name,
 	      Connections[cnum].num_files_open);
@@ -1070,10 +1274,12 @@ void close_file(int fnum, bool normal_close)
 
 	/* we will catch bugs faster by zeroing this structure */
 	memset(fs_p, 0, sizeof(*fs_p));
+	release_file(fnum);
 }
 
 void open_file_shared(int fnum, int cnum, const char *fname, int share_mode,
-                      int ofun, int dosmode, int *access, int *action)
+                      int ofun, int dosmode, int oplock_request, int *access,
+                      int *action)
 {
 	struct open_file *fs_p = &Files[fnum];
 	int flags = 0;
@@ -1081,7 +1287,7 @@ void open_file_shared(int fnum, int cnum, const char *fname, int share_mode,
 	int deny_mode = (share_mode >> 4) & 7;
 	int unixmode;
 	struct stat sbuf;
-	bool file_existed = file_exist(fname, &sbuf);
+	bool file_existed = file_exist(CONN_ROOT(cnum), fname, &sbuf);
 	bool fcbopen = false;
 
 	fs_p->open = false;
@@ -1155,6 +1361,19 @@ void open_file_shared(int fnum, int cnum, const char *fname, int share_mode,
 		          file_existed ? &sbuf : 0);
 	}
 
+	/* Any oplock that another client holds has to be broken before it
+	   is too late for it to write back what it has cached, which is
+	   before we truncate the file. */
+	if (fs_p->open && !register_open(fnum, oplock_request)) {
+		close_file(fnum, false);
+		unix_ERR_class = ERRDOS;
+		unix_ERR_code = ERRbadshare;
+		return;
+	}
+
+	/* the file table may have grown while the oplock was broken */
+	fs_p = &Files[fnum];
+
 	if (fs_p->open) {
 		int open_mode = 0;
 		switch (flags) {
@@ -1171,7 +1390,7 @@ void open_file_shared(int fnum, int cnum, const char *fname, int share_mode,
 
 		/* When creating a new file, we save the DOS attributes */
 		if (!file_existed || (flags & (O_CREAT | O_TRUNC)) != 0) {
-			write_dosattrib(fname, dosmode);
+			write_dosattrib(CONN_ROOT(cnum), fname, dosmode);
 		}
 
 		fs_p->share_mode = (deny_mode << 4) | open_mode;
@@ -1199,79 +1418,329 @@ void open_file_shared(int fnum, int cnum, const char *fname, int share_mode,
 	}
 }
 
-int seek_file(int fnum, uint32_t pos)
+/* Older clients read through files a few KB at a time, waiting for each
+   read to finish before sending the next, so on a cold cache every request
+   stalls on the disk. Once a file has been read sequentially a few times,
+   we ask the kernel to read ahead of the client. */
+#define READAHEAD_MIN_RUN 3
+#define READAHEAD_WINDOW  (256 * 1024)
+
+static void track_read(int fnum, off_t pos, int n)
 {
-	uint32_t offset = 0;
+	struct open_file *fsp = &Files[fnum];
+#ifdef POSIX_FADV_WILLNEED
+	int fd = fsp->fd_ptr->fd;
+	off_t window, start;
+#endif
+
+	if (pos != fsp->next_read) {
+#ifdef POSIX_FADV_NORMAL
+		if (fsp->sequential_reads >= READAHEAD_MIN_RUN) {
+			posix_fadvise(fsp->fd_ptr->fd, 0, 0, POSIX_FADV_NORMAL);
+		}
+#endif
+		fsp->next_read = pos + n;
+		fsp->sequential_reads = 0;
+		fsp->readahead_end = 0;
+		return;
+	}
+
+	fsp->next_read = pos + n;
+	if (++fsp->sequential_reads < READAHEAD_MIN_RUN) {
+		return;
+	}
+
+#ifdef POSIX_FADV_WILLNEED
+	if (fsp->sequential_reads == READAHEAD_MIN_RUN) {
+		DEBUG("sequential reads of %s (fnum=%d); reading ahead\n",
+		      fsp->name, fnum);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
 
-	Files[fnum].pos =
-	    (int) (lseek(Files[fnum].fd_ptr->fd, pos + offset, SEEK_SET) -
-	           offset);
-	return Files[fnum].pos;
+	/* Keep at least half a window ahead, topping it up in big chunks
+	   rather than on every read */
+	window = MAX(READAHEAD_WINDOW, (off_t) n * 4);
+	if (fsp->readahead_end - fsp->next_read < window / 2) {
+		start = MAX(fsp->readahead_end, fsp->next_read);
+		posix_fadvise(fd, start, fsp->next_read + window - start,
+		              POSIX_FADV_WILLNEED);
+		fsp->readahead_end = fsp->next_read + window;
+	}
+#endif
 }
 
-int read_file(int fnum, char *data, uint32_t pos, int n)
+/* Files are always read and written at an explicit offset, so several open
+   files can share one fd without fighting over its seek pointer. The pos
+   field only records where the client last read or wrote, for SMBlseek and
+   the trans2 file position query. */
+int read_file(int fnum, char *data, off_t pos, int n)
 {
 	int ret = 0, readret;
 
 	if (n <= 0)
 		return ret;
 
-	if (seek_file(fnum, pos) != pos) {
-		DEBUG("Failed to seek to %d\n", pos);
-		return ret;
-	}
+	track_read(fnum, pos, n);
 
-	if (n > 0) {
-		readret = read(Files[fnum].fd_ptr->fd, data, n);
-		if (readret > 0)
-			ret += readret;
+	readret = pread(Files[fnum].fd_ptr->fd, data, n, pos);
+	if (readret > 0) {
+		ret += readret;
+		Files[fnum].pos = pos + ret;
 	}
 
 	return ret;
 }
 
-int write_file(int fnum, char *data, int n)
+/* Send the header in buf to the client, followed by n bytes of the file
+   starting from pos. Where possible the data goes straight from the file to
+   the socket without being copied through our buffers. If the file turns out
+   to be shorter than expected, the rest is padded with zeroes, since the
+   header has already told the client how much data to expect. If reading it
+   fails, the connection is dropped. */
+void send_file_data(int fnum, char *header, int headlen, off_t pos, int n)
 {
-	if (!Files[fnum].can_write) {
-		errno = EPERM;
-		return 0;
+	static char buf[16 * 1024];
+	int fd = Files[fnum].fd_ptr->fd;
+	off_t offset = pos;
+	ssize_t ret;
+
+	Files[fnum].pos = pos + n;
+	stats_count_sent(headlen + n);
+	if (n > 0) {
+		track_read(fnum, pos, n);
 	}
 
-	if (!Files[fnum].modified) {
-		struct stat st;
-		Files[fnum].modified = true;
-		if (fstat(Files[fnum].fd_ptr->fd, &st) == 0) {
-			int dosmode =
-			    dos_mode(Files[fnum].cnum, Files[fnum].name, &st);
-			if (!IS_DOS_ARCHIVE(dosmode)) {
-				dos_chmod(Files[fnum].cnum, Files[fnum].name,
-				          dosmode | aARCH, &st);
-			}
+#ifdef linux
+	/* MSG_MORE lets the header go out in the same packet as the data */
+	while (headlen > 0) {
+		ret = send(client_fd, header, headlen, n > 0 ? MSG_MORE : 0);
+		if (ret <= 0 && errno != EINTR) {
+			FATAL("Error writing %d bytes to client: %s\n",
+			      headlen, strerror(errno));
 		}
+		header += MAX(ret, 0);
+		headlen -= MAX(ret, 0);
 	}
 
-	return write_data(Files[fnum].fd_ptr->fd, data, n);
-}
-
-/* Load parameters specific to a connection/service */
-static bool become_service(int cnum)
-{
-	if (!OPEN_CNUM(cnum)) {
-		return false;
+	while (n > 0) {
+		ret = sendfile(client_fd, fd, &offset, n);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		} else if (ret < 0 && (errno == EINVAL || errno == ENOSYS)) {
+			/* not supported for this file; fall back to copying */
+			break;
+		} else if (ret < 0) {
+			FATAL("sendfile of %d bytes to client failed: %s\n", n,
+			      strerror(errno));
+		} else if (ret == 0) {
+			break;
+		}
+		n -= ret;
 	}
-
-	Connections[cnum].lastused = smb_last_time;
-
-	if (CONN_SHARE(cnum) != ipc_service &&
-	    chdir(Connections[cnum].connectpath) != 0) {
-		ERROR("chdir (%s) failed cnum=%d\n",
-		      Connections[cnum].connectpath, cnum);
-		return false;
+#else
+	if (write_data(client_fd, header, headlen) != headlen) {
+		FATAL("Error writing %d bytes to client: %s\n", headlen,
+		      strerror(errno));
 	}
+#endif
+
+	while (n > 0) {
+		ret = pread(fd, buf, MIN(n, (int) sizeof(buf)), offset);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		} else if (ret < 0) {
+			/* We cannot take back the header, and sending zeroes
+			   in place of the data would corrupt the client's
+			   copy of the file. */
+			FATAL("read of %d bytes from %s failed: %s\n", n,
+			      Files[fnum].name, strerror(errno));
+		} else if (ret == 0) {
+			break;
+		}
+		if (write_data(client_fd, buf, ret) != ret) {
+			FATAL("Error writing %d bytes to client: %s\n",
+			      (int) ret, strerror(errno));
+		}
+		offset += ret;
+		n -= ret;
+	}
+
+	/* The file was truncated after the header was built */
+	if (n > 0) {
+		DEBUG("file %s is short by %d bytes; padding\n",
+		      Files[fnum].name, n);
+		memset(buf, 0, sizeof(buf));
+	}
+
+	while (n > 0) {
+		ret = MIN(n, (int) sizeof(buf));
+		if (write_data(client_fd, buf, ret) != ret) {
+			FATAL("Error writing %d bytes to client: %s\n",
+			      (int) ret, strerror(errno));
+		}
+		n -= ret;
+	}
+}
+
+/* Called on every write to a file. Sets the archive bit on the first one */
+static void file_modified(int fnum)
+{
+	struct stat st;
+
+	/* the size and times shown in directory listings will change */
+	dir_cache_file_changed(Files[fnum].fd_ptr->dev,
+	                       Files[fnum].fd_ptr->inode);
+
+	if (Files[fnum].modified) {
+		return;
+	}
+
+	Files[fnum].modified = true;
+	if (fstat(Files[fnum].fd_ptr->fd, &st) == 0) {
+		int dosmode = dos_mode(Files[fnum].cnum, Files[fnum].name, &st);
+		if (!IS_DOS_ARCHIVE(dosmode)) {
+			dos_chmod(Files[fnum].cnum, Files[fnum].name,
+			          dosmode | aARCH, &st);
+		}
+	}
+}
+
+int write_file(int fnum, char *data, off_t pos, int n)
+{
+	int ret;
+
+	if (!Files[fnum].can_write) {
+		errno = EPERM;
+		return 0;
+	}
+
+	file_modified(fnum);
+
+	ret = pwrite_data(Files[fnum].fd_ptr->fd, data, n, pos);
+	if (ret > 0)
+		Files[fnum].pos = pos + ret;
+
+	return ret;
+}
+
+/* Read n bytes of data from the client into buf, exiting if we can't */
+static void receive_data_or_fatal(char *buf, int n)
+{
+	if (read_data(client_fd, buf, n) != n) {
+		FATAL("failed to read %d bytes of data from client\n", n);
+	}
+}
+
+/* Receive n bytes of data from the client and write them to the file at pos,
+   without the data going through inbuf. On Linux it is spliced from the
+   socket through a pipe into the file. All n bytes are always read from the
+   socket, even if writing them fails, so that we stay in step with the
+   client. Returns the number of bytes written to the file. */
+int receive_file_data(int fnum, off_t pos, int n)
+{
+	static char buf[16 * 1024];
+	int fd = Files[fnum].fd_ptr->fd;
+	bool write_ok = Files[fnum].can_write;
+	off_t offset = pos;
+	int written = 0;
+	ssize_t ret;
+
+	if (write_ok) {
+		file_modified(fnum);
+	}
+
+#ifdef linux
+	static int pipe_fds[2] = {-1, -1};
+	ssize_t in_pipe;
+
+	if (pipe_fds[0] == -1 && pipe(pipe_fds) != 0) {
+		ERROR("failed to create pipe: %s\n", strerror(errno));
+		pipe_fds[0] = -1;
+	}
+
+	/* Anything in the receive buffer can't be spliced */
+	while (n > 0 && recv_buffer_has_data(client_fd)) {
+		ret = read_buffered(client_fd, buf, MIN(n, (int) sizeof(buf)));
+		if (write_ok && pwrite_data(fd, buf, ret, offset) != ret) {
+			write_ok = false;
+		}
+		written += write_ok ? ret : 0;
+		offset += ret;
+		n -= ret;
+	}
+
+	while (n > 0 && pipe_fds[0] != -1) {
+		in_pipe = splice(client_fd, NULL, pipe_fds[1], NULL, n,
+		                 SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (in_pipe < 0 && errno == EINTR) {
+			continue;
+		} else if (in_pipe <= 0) {
+			FATAL("failed to read %d bytes of data from client: "
+			      "%s\n",
+			      n, in_pipe == 0 ? "EOF" : strerror(errno));
+		}
+		n -= in_pipe;
+
+		/* Whatever happens, the pipe must be emptied again */
+		while (in_pipe > 0 && write_ok) {
+			ret = splice(pipe_fds[0], NULL, fd, &offset, in_pipe,
+			             SPLICE_F_MOVE);
+			if (ret < 0 && errno == EINTR) {
+				continue;
+			} else if (ret <= 0) {
+				/* EINVAL means the filesystem doesn't
+				   support splice, so copy instead */
+				write_ok = ret < 0 && errno == EINVAL;
+				break;
+			}
+			written += ret;
+			in_pipe -= ret;
+		}
+		while (in_pipe > 0) {
+			ret = read(pipe_fds[0], buf, MIN(in_pipe, sizeof(buf)));
+			if (ret <= 0) {
+				FATAL("failed to empty pipe: %s\n",
+				      strerror(errno));
+			}
+			if (write_ok &&
+			    pwrite_data(fd, buf, ret, offset) != ret) {
+				write_ok = false;
+			}
+			written += write_ok ? ret : 0;
+			offset += ret;
+			in_pipe -= ret;
+		}
+	}
+#endif
+
+	while (n > 0) {
+		ret = MIN(n, (int) sizeof(buf));
+		receive_data_or_fatal(buf, ret);
+		if (write_ok && pwrite_data(fd, buf, ret, offset) != ret) {
+			write_ok = false;
+		}
+		written += write_ok ? ret : 0;
+		offset += ret;
+		n -= ret;
+	}
+
+	Files[fnum].pos = pos + written;
+
+	return written;
+}
+
+/* Load parameters specific to a connection/service */
+static bool become_service(int cnum)
+{
+	if (!OPEN_CNUM(cnum)) {
+		return false;
+	}
+
+	Connections[cnum].lastused = smb_last_time;
+
+	return true;
+}
 
-	return true;
-}
-
 /* Create an error packet from a cached error. */
 int cached_error_packet(char *inbuf, char *outbuf, int fnum, int line)
 {
@@ -1347,23 +1816,28 @@ int error_packet(char *inbuf, char *outbuf, int error_class,
 	return outsize;
 }
 
-static int sigchld_handler(void)
+/* Serving processes reaped by sigchld_handler(). Cleaning up after them
+   takes locks, so it is left for the main loop, which is woken up by a byte
+   written to the pipe; see cleanup_exited(). */
+#define MAX_EXITED 256
+static volatile pid_t exited_pids[MAX_EXITED];
+static volatile sig_atomic_t num_exited = 0;
+static int exited_pipe[2] = {-1, -1};
+
+/* Reap serving processes that have exited, for cleanup_exited() to clean up
+   after. Any that do not fit are left to be reaped once it has. */
+static void reap_exited(void)
 {
-	static int depth = 0;
 	int status;
 	pid_t pid;
 
-	if (depth != 0) {
-		ERROR("recursion in sigchld_handler?\n");
-		depth = 0;
-		return 0;
-	}
-	depth++;
-
-	block_signals(true, SIGCHLD);
-	DEBUG("got SIGCHLD\n");
+	while (num_exited < MAX_EXITED &&
+	       (pid = waitpid((pid_t) -1, &status, WNOHANG)) > 0) {
+		exited_pids[num_exited++] = pid;
+		if (exited_pipe[1] >= 0 && write(exited_pipe[1], "", 1) < 0) {
+			/* the pipe is full, so a wakeup is already due */
+		}
 
-	while ((pid = waitpid((pid_t) -1, &status, WNOHANG)) > 0) {
 		/* If a serving subprocess crashes, we want to log it */
 		if (status != 0) {
 			WARNING("serving subprocess (pid %ld) terminated "
@@ -1375,6 +1849,23 @@ static int sigchld_handler(void)
 			      (long) pid);
 		}
 	}
+}
+
+static int sigchld_handler(void)
+{
+	static int depth = 0;
+
+	if (depth != 0) {
+		ERROR("recursion in sigchld_handler?\n");
+		depth = 0;
+		return 0;
+	}
+	depth++;
+
+	block_signals(true, SIGCHLD);
+	DEBUG("got SIGCHLD\n");
+
+	reap_exited();
 
 	/* Stop zombies */
 	/* Stevens, Adv. Unix Prog. says that on system V you must call
@@ -1409,6 +1900,23 @@ static void set_keepalive_option(int fd)
 	}
 }
 
+/* Make reads from the socket fail if nothing arrives for the given number of
+   milliseconds, and writes fail if the client stops taking data for as long */
+static void set_socket_timeouts(int fd, int timeout)
+{
+	struct timeval tv;
+
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0) {
+		ERROR("Failed to set receive timeout: %s\n", strerror(errno));
+	}
+	if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) != 0) {
+		ERROR("Failed to set send timeout: %s\n", strerror(errno));
+	}
+}
+
 /* Detect if we are running as root and if so, drop privileges and run as an
    unprivileged user instead. We shouldn't ever need to run as root (if
    someone is trying, they're doing it wrong), but it can make sense to start
@@ -1441,7 +1949,7 @@ static void drop_privileges(void)
 
 /* is_private_peer checks if the connecting client comes either from a
  * localhost address or from one of the RFC 1918 private ranges. */
-static bool is_private_peer(void)
+static bool is_private_peer(int fd)
 {
 	struct sockaddr_in sockin;
 	socklen_t length = sizeof(sockin);
@@ -1456,7 +1964,7 @@ static bool is_private_peer(void)
 	    {inet_addr("127.0.0.1"), 8},
 	};
 
-	if (getpeername(client_fd, (struct sockaddr *) &sockin, &length) < 0) {
+	if (getpeername(fd, (struct sockaddr *) &sockin, &length) < 0) {
 		ERROR("getpeername failed: %s\n", strerror(errno));
 		return false;
 	}
@@ -1491,19 +1999,29 @@ static void set_descriptive_argv(void)
 {
 #if defined(linux)       /* and other systems? */
 #define ARGV_BUF_LEN 128 /* is this defined somewhere? */
-	char *p = original_argv[original_argc - 1];
 	bool appended_services = false;
+	char *p;
 	int i;
 
-	if (original_argc < 2) {
+	/* Event workers serve many clients, so there is nothing to describe */
+	if (original_argc < 2 || event_mode) {
 		return;
 	}
+	p = original_argv[original_argc - 1];
 	/* Clear all old args and replace with our own descriptive data about
 	   the client that this subprocess is serving. Note that we assume
 	   there was at least one command line argument, which because of our
 	   command syntax, is always the case. */
 	p += strlen(p);
 	memset(original_argv[1], 0, p - original_argv[1]);
+
+	/* a preforked worker waiting for its next client */
+	if (cur_session == NULL) {
+		snprintf(original_argv[0], ARGV_BUF_LEN, "%s (idle)",
+		         original_argv0);
+		return;
+	}
+
 	snprintf(original_argv[0], ARGV_BUF_LEN, "%s [%s]", original_argv0,
 	         client_addr);
 
@@ -1528,89 +2046,346 @@ static void set_descriptive_argv(void)
 #endif
 }
 
-static void open_sockets(int port)
+static int open_socket(int port, bool reuse_port)
 {
 	struct sockaddr_in sock;
 	struct in_addr addr;
 	int one = 1;
-
-	/* Stop zombies */
-	signal(SIGCHLD, SIGNAL_CAST sigchld_handler);
-
-	atexit(killkids);
+	int fd;
 
 	/* open an incoming socket */
 	if (inet_aton(bind_addr, &addr) == 0) {
 		STARTUP_ERROR("failed to parse bind address %s\n", bind_addr);
 	}
 
-	server_socket = socket(AF_INET, SOCK_STREAM, 0);
-	if (server_socket == -1) {
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1) {
 		STARTUP_ERROR("socket failed: %s\n", strerror(errno));
 	}
 
-	setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, (char *) &one,
-	           sizeof(one));
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char *) &one, sizeof(one));
+
+#ifdef SO_REUSEPORT
+	if (reuse_port &&
+	    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char *) &one,
+	               sizeof(one)) != 0) {
+		STARTUP_ERROR("failed to set SO_REUSEPORT: %s\n",
+		              strerror(errno));
+	}
+#endif
 
 	sock.sin_family = AF_INET;
 	sock.sin_port = htons(port);
 	sock.sin_addr = addr;
 
 	/* now we've got a socket - we need to bind it */
-	if (bind(server_socket, (struct sockaddr *) &sock, sizeof(sock)) < 0) {
+	if (bind(fd, (struct sockaddr *) &sock, sizeof(sock)) < 0) {
 		STARTUP_ERROR("bind failed on port %d socket_addr=%s (%s)\n",
 		              port, inet_ntoa(sock.sin_addr), strerror(errno));
 	}
+
+	return fd;
+}
+
+static void open_sockets(int port)
+{
+	int i;
+
+	/* Stop zombies */
+	signal(SIGCHLD, SIGNAL_CAST sigchld_handler);
+
+	atexit(killkids);
+
+#ifdef SO_REUSEPORT
+	if (event_mode && num_workers > 1) {
+		/* These all have to be opened now, since we are about to
+		   drop privileges and may not be able to bind again later */
+		worker_sockets = checked_calloc(num_workers, sizeof(int));
+		for (i = 0; i < num_workers; i++) {
+			worker_sockets[i] = open_socket(port, true);
+		}
+		server_socket = worker_sockets[0];
+		NOTICE("bind succeeded on port %d (%d sockets)\n", port,
+		       num_workers);
+		return;
+	}
+#endif
+
+	server_socket = open_socket(port, false);
+
+	/* Otherwise, the workers all share one socket */
+	if (num_workers > 0) {
+		worker_sockets = checked_calloc(num_workers, sizeof(int));
+		for (i = 0; i < num_workers; i++) {
+			worker_sockets[i] = server_socket;
+		}
+	}
+
 	NOTICE("bind succeeded on port %d\n", port);
 }
 
-/* accept_connection() is called by await_connection() when a new client
- * connects to the server, and calls process() in a child process. */
-static void accept_connection(void)
+/* Allocate and initialise the state for a new client session. */
+static struct session *session_new(int fd, const char *addr)
+{
+	static uint32_t next_session_id = 0;
+	struct session *s = checked_calloc(1, sizeof(struct session));
+	int i;
+
+	s->fd = fd;
+	strlcpy(s->addr, addr, sizeof(s->addr));
+	s->protocol = PROTOCOL_COREPLUS;
+	s->max_send = BUFFER_SIZE;
+	s->last_activity = time(NULL);
+
+	for (i = 0; i < MAX_CONNECTIONS; i++) {
+		s->connections[i].dirpath = checked_strdup("");
+		s->connections[i].connectpath = checked_strdup("");
+	}
+
+	/* the file table is allocated by find_free_file() when needed */
+	s->free_files_head = s->free_files_tail = -1;
+
+	s->recv_buf = recv_buffer_new(fd);
+	s->dptrs = dptr_table_new();
+	s->stats = stats_session_new(addr);
+	s->trace_id = trace_new_session();
+	s->id = ++next_session_id;
+
+	s->next = sessions;
+	sessions = s;
+
+	return s;
+}
+
+/* Make the given session the current one, first saving the per-client
+   globals back into the previous current session. */
+static void session_switch(struct session *s)
+{
+	struct session *old = cur_session;
+
+	if (old == s) {
+		return;
+	}
+
+	if (old != NULL) {
+		old->protocol = Protocol;
+		old->max_send = max_send;
+		old->done_sesssetup = done_sesssetup;
+		old->client_capabilities = client_capabilities;
+		old->num_connections_open = num_connections_open;
+		fstrcpy(old->machine_name, local_machine);
+	}
+
+	cur_session = s;
+	pending_write_data = 0;
+
+	if (s == NULL) {
+		Connections = NULL;
+		Files = NULL;
+		num_file_slots = 0;
+		FileFd = NULL;
+		client_fd = -1;
+		client_addr[0] = '\0';
+		stats_session_select(NULL);
+		return;
+	}
+
+	Connections = s->connections;
+	Files = s->files;
+	num_file_slots = s->num_files;
+	FileFd = s->file_fds;
+	recv_buffer_select(s->recv_buf);
+	dptr_table_select(s->dptrs);
+	stats_session_select(s->stats);
+
+	Protocol = s->protocol;
+	max_send = s->max_send;
+	done_sesssetup = s->done_sesssetup;
+	client_capabilities = s->client_capabilities;
+	num_connections_open = s->num_connections_open;
+	fstrcpy(local_machine, s->machine_name);
+	client_fd = s->fd;
+	strlcpy(client_addr, s->addr, sizeof(client_addr));
+}
+
+/* Close a session, along with all its connections and its socket. */
+static void end_session(struct session *s)
+{
+	struct session **p;
+	int i;
+
+	session_switch(s);
+
+	for (i = 0; i < MAX_CONNECTIONS; i++) {
+		if (OPEN_CNUM(i))
+			close_cnum(i);
+		free(Connections[i].dirpath);
+		free(Connections[i].connectpath);
+	}
+
+	for (i = 0; i < num_file_slots; i++) {
+		free(Files[i].name);
+	}
+
+	if (s->fd != -1) {
+		if (event_mode)
+			reactor_remove(s->fd);
+		close(s->fd);
+	}
+
+	session_switch(NULL);
+	dptr_table_free(s->dptrs);
+	recv_buffer_free(s->recv_buf);
+	stats_session_free(s->stats);
+	trace_end_session(s->trace_id);
+	reactor_timer_cancel(&s->timer);
+	free(s->files);
+
+	for (p = &sessions; *p != s; p = &(*p)->next)
+		;
+	*p = s->next;
+
+	free(s);
+}
+
+/* Check for connection timeouts in the current session at time t. Directories
+   that have not been used for a while are closed; returns true if the whole
+   session should be closed. */
+static bool session_timed_out(time_t t)
+{
+	bool allidle = true;
+	int i;
+
+	/* automatic timeout if all connections are closed */
+	if (num_connections_open == 0 &&
+	    t - cur_session->last_activity >= IDLE_CLOSED_TIMEOUT) {
+		DEBUG("Closing idle connection\n");
+		return true;
+	}
+
+	/* check for connection timeouts */
+	for (i = 0; i < MAX_CONNECTIONS; i++)
+		if (OPEN_CNUM(i)) {
+			/* close dirptrs on connections that are idle */
+			if (t - Connections[i].lastused > DPTR_IDLE_TIMEOUT)
+				dptr_idlecnum(i);
+
+			if (Connections[i].num_files_open > 0 ||
+			    t - Connections[i].lastused < DEFAULT_SMBD_TIMEOUT)
+				allidle = false;
+		}
+
+	if (allidle && num_connections_open > 0) {
+		DEBUG("Closing idle connection 2\n");
+		return true;
+	}
+
+	return false;
+}
+
+static void earliest_time(time_t *result, time_t t, time_t when)
+{
+	if (when > t && (*result == 0 || when < *result)) {
+		*result = when;
+	}
+}
+
+/* Returns the next time after t when session_timed_out() might have something
+   to do for the current session, or zero if there is nothing that will ever
+   time out, in which case we can just wait for the client. */
+static time_t session_next_timeout(time_t t)
+{
+	time_t result = 0, last_used = 0;
+	bool files_open = false;
+	int i;
+
+	if (num_connections_open == 0) {
+		earliest_time(&result, t,
+		              cur_session->last_activity + IDLE_CLOSED_TIMEOUT);
+		return result;
+	}
+
+	for (i = 0; i < MAX_CONNECTIONS; i++) {
+		if (!OPEN_CNUM(i)) {
+			continue;
+		}
+		earliest_time(&result, t,
+		              Connections[i].lastused + DPTR_IDLE_TIMEOUT + 1);
+		last_used = MAX(last_used, Connections[i].lastused);
+		files_open = files_open || Connections[i].num_files_open > 0;
+	}
+
+	if (!files_open) {
+		earliest_time(&result, t, last_used + DEFAULT_SMBD_TIMEOUT);
+	}
+
+	return result;
+}
+
+/* Accept a new connection on the listening socket. Returns the new socket,
+   or -1 if there was nothing to accept or the client was rejected. */
+static int accept_client(const char **peer_addr)
 {
 	struct sockaddr addr;
-	const char *peer_addr;
 	socklen_t in_addrlen = sizeof(addr);
+	int fd;
 
-	client_fd = accept(server_socket, &addr, &in_addrlen);
+	fd = accept(server_socket, &addr, &in_addrlen);
 
-	if (client_fd == -1) {
-		if (errno != EINTR) {
+	if (fd == -1) {
+		/* EAGAIN just means another event worker got there first */
+		if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
 			ERROR("error accepting connection: %s\n",
 			      strerror(errno));
 		}
-		return;
+		return -1;
 	}
 
-	peer_addr = get_peer_addr(client_fd);
+	*peer_addr = get_peer_addr(fd);
 
 	/* The BSD sockets API does not provide any way to reject TCP
 	   connections, the best we can do is to accept the connection and then
 	   immediately close it. By default we only allow connections from
 	   local peers on the same private IP range. */
-	if (!is_private_peer()) {
+	if (!is_private_peer(fd)) {
 		if (!allow_public_connections) {
 			ERROR("rejecting connection from public IP"
 			      "address %s\n",
-			      peer_addr);
-			close(client_fd);
-			client_fd = -1;
-			return;
+			      *peer_addr);
+			close(fd);
+			return -1;
 		}
 		/* even if allowed, log a warning */
-		WARNING("connection from public IP address %s\n", peer_addr);
+		WARNING("connection from public IP address %s\n", *peer_addr);
+	}
+
+	set_keepalive_option(fd);
+
+	return fd;
+}
+
+/* accept_connection() is called by await_connection() when a new client
+ * connects to the server, and calls process() in a child process. */
+static void accept_connection(void)
+{
+	const char *peer_addr;
+	int fd;
+
+	fd = accept_client(&peer_addr);
+	if (fd == -1) {
+		return;
 	}
 
 	if (fork() != 0) {
-		close(client_fd); /* The parent doesn't need this socket */
+		close(fd); /* The parent doesn't need this socket */
 		return;
 	}
 
 	/* At this point onwards, we are in the child process */
 
-	/* save a copy of the client's address to include log
-	 * messages */
-	strlcpy(client_addr, peer_addr, sizeof(client_addr));
+	/* set up the client's state; this also saves a copy of the
+	 * client's address to include log messages */
+	session_switch(session_new(fd, peer_addr));
 
 	set_descriptive_argv();
 
@@ -1620,12 +2395,15 @@ static void accept_connection(void)
 
 	/* close the listening socket */
 	close(server_socket);
+	close(exited_pipe[0]);
+	close(exited_pipe[1]);
+	exited_pipe[0] = exited_pipe[1] = -1;
 
 	/* close our standard file descriptors */
 	close_low_fds();
 	am_parent = false;
 
-	set_keepalive_option(client_fd);
+	oplock_fd = oplock_open_socket();
 
 	/* Handle the connection. */
 	process();
@@ -1634,38 +2412,119 @@ static void accept_connection(void)
 	exit_server("normal exit");
 }
 
-/* await_connection loops forever, accepting new connections and calling
-   process() in a child process. It does not return. */
-static void await_connection(void)
+/* Remove what the serving processes reaped by sigchld_handler() left
+   behind in the shared tables */
+static void cleanup_exited(void)
 {
-	fd_set listen_set;
-	int num;
+	char buf[64];
+	int i;
 
-	/* ready to listen */
-	if (listen(server_socket, 5) == -1) {
-		STARTUP_ERROR("listen failed: %s\n", strerror(errno));
+	while (read(exited_pipe[0], buf, sizeof(buf)) > 0)
+		;
+
+	block_signals(true, SIGCHLD);
+	for (i = 0; i < num_exited; i++) {
+		stats_process_exited(exited_pids[i]);
+		oplock_process_exited(exited_pids[i]);
 	}
+	num_exited = 0;
 
-	DEBUG("waiting for a connection\n");
-	while (1) {
-		FD_ZERO(&listen_set);
-		FD_SET(server_socket, &listen_set);
+	/* There may be more that did not fit last time */
+	reap_exited();
+	block_signals(false, SIGCHLD);
+}
 
-		num = select(server_socket + 1, &listen_set, NULL, NULL, NULL);
+/* await_connection loops forever, accepting new connections and calling
+   process() in a child process. It does not return. */
+static void await_connection(void)
+{
+	int ready;
 
-		if (num < 0 && errno == EINTR) {
-			continue;
-		}
+	/* ready to listen */
+	if (listen(server_socket, 5) == -1) {
+		STARTUP_ERROR("listen failed: %s\n", strerror(errno));
+	}
+
+	if (pipe(exited_pipe) != 0) {
+		STARTUP_ERROR("failed to create pipe: %s\n", strerror(errno));
+	}
+	fcntl(exited_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(exited_pipe[1], F_SETFL, O_NONBLOCK);
 
-		if (FD_ISSET(server_socket, &listen_set)) {
+	DEBUG("waiting for a connection\n");
+	while (1) {
+		ready = reactor_wait_fd2(server_socket, exited_pipe[0], -1);
+		if (ready > 0 && (ready & 1) != 0) {
 			accept_connection();
 		}
+		cleanup_exited();
+	}
+}
+
+/* Skip past any data from the last SMB that nobody read. */
+static void discard_pending_write_data(void)
+{
+	char buf[1024];
+	int n;
+
+	while (pending_write_data > 0) {
+		n = MIN(pending_write_data, (int) sizeof(buf));
+		receive_data_or_fatal(buf, n);
+		pending_write_data -= n;
+	}
+}
+
+/* Read the body of an SMB of length len into buffer. This is normally the
+   whole thing, but for large SMBwriteX requests only the header is read and
+   the data is left in the socket for the handler to receive straight into the
+   file, setting pending_write_data. Returns the number of bytes read. */
+static int read_smb_body(int fd, char *buffer, int len)
+{
+	int hdrlen = smb_wct + 1 - 4;
+	int wct, doff, dsize;
+
+	/* a trace has to have the whole thing */
+	if (len < DIRECT_WRITE_THRESHOLD || trace_enabled()) {
+		return read_data(fd, buffer + 4, len);
+	}
+
+	/* read up to and including the word count */
+	if (read_data(fd, buffer + 4, hdrlen) != hdrlen) {
+		return -1;
+	}
+
+	wct = CVAL(buffer, smb_wct);
+	if (CVAL(buffer, smb_com) != SMBwriteX || (wct != 12 && wct != 14)) {
+		return hdrlen + read_data(fd, buffer + 4 + hdrlen, len - hdrlen);
+	}
+
+	/* the parameter words and the byte count */
+	if (read_data(fd, buffer + 4 + hdrlen, wct * 2 + 2) != wct * 2 + 2) {
+		return -1;
+	}
+	hdrlen += wct * 2 + 2;
+
+	dsize = writex_data_size(buffer);
+	doff = SVAL(buffer, smb_vwv11);
+
+	/* Only if the data is the very end of the packet and nothing else is
+	   chained after it */
+	if (CVAL(buffer, smb_vwv0) != 0xFF || dsize < DIRECT_WRITE_THRESHOLD ||
+	    doff < hdrlen || doff + dsize != len) {
+		return hdrlen + read_data(fd, buffer + 4 + hdrlen, len - hdrlen);
+	}
+
+	if (read_data(fd, buffer + 4 + hdrlen, doff - hdrlen) != doff - hdrlen) {
+		return -1;
 	}
+
+	pending_write_data = dsize;
+	return len;
 }
 
 /*
   Read an smb from a fd. Note that the buffer *MUST* be of size
-  BUFFER_SIZE+SAFETY_MARGIN.
+  LARGE_BUFFER_SIZE+SAFETY_MARGIN.
   The timeout is in milli seconds.
 
   This function will return on a
@@ -1677,7 +2536,7 @@ static bool receive_smb(int fd, char *buffer, size_t buflen, int timeout)
 
 	smb_read_error = 0;
 
-	bzero(buffer, smb_size + 100);
+	discard_pending_write_data();
 
 	len = read_smb_length_return_keepalive(fd, buffer, timeout);
 	if (len < 0)
@@ -1687,8 +2546,14 @@ static bool receive_smb(int fd, char *buffer, size_t buflen, int timeout)
 		FATAL("Invalid packet length! (%d bytes).\n", len);
 	}
 
+	/* Short packets get zeroes rather than whatever was left over from the
+	   previous packet for any header fields they are missing */
+	if (len + 4 < smb_size + 100) {
+		bzero(buffer + 4 + len, smb_size + 100 - (len + 4));
+	}
+
 	if (len > 0) {
-		ret = read_data(fd, buffer + 4, len);
+		ret = read_smb_body(fd, buffer, len);
 		if (ret != len) {
 			smb_read_error = READ_ERROR;
 			return false;
@@ -1698,46 +2563,31 @@ static bool receive_smb(int fd, char *buffer, size_t buflen, int timeout)
 }
 
 /*
-  Do a select on an two fd's - with timeout.
-
-  If a local udp message has been pushed onto the
-  queue (this can only happen during oplock break
-  processing) return this first.
+  Wait for an smb to arrive - with timeout.
 
-  If a pending smb message has been pushed onto the
-  queue (this can only happen during oplock break
-  processing) return this next.
-
-  If the first smbfd is ready then read an smb from it.
-  if the second (loopback UDP) fd is ready then read a message
-  from it and setup the buffer header to identify the length
-  and from address.
+  If smbfd becomes ready then read an smb from it, setting *got_smb. If
+  another process sends us an oplock break request first, that is handled
+  instead.
   Returns false on timeout or error.
   Else returns true.
 
-The timeout is in milli seconds
+The timeout is in milli seconds; zero means wait forever.
 */
 static bool receive_message_or_smb(int smbfd, char *buffer, int buffer_len,
                                    int timeout, bool *got_smb)
 {
-	fd_set fds;
 	int selrtn;
-	struct timeval to;
 
 	smb_read_error = 0;
 
 	*got_smb = false;
 
-	do {
-		FD_ZERO(&fds);
-		FD_SET(smbfd, &fds);
-
-		to.tv_sec = timeout / 1000;
-		to.tv_usec = (timeout % 1000) * 1000;
-
-		selrtn = select(smbfd + 1, &fds, NULL, NULL,
-		                timeout > 0 ? &to : NULL);
-	} while (selrtn < 0 && errno == EINTR);
+	if (recv_buffer_has_data(smbfd)) {
+		selrtn = 1;
+	} else {
+		selrtn = reactor_wait_fd2(smbfd, oplock_fd,
+		                          timeout > 0 ? timeout : -1);
+	}
 
 	/* Check if error */
 	if (selrtn == -1) {
@@ -1752,12 +2602,15 @@ static bool receive_message_or_smb(int smbfd, char *buffer, int buffer_len,
 		return false;
 	}
 
-	if (FD_ISSET(smbfd, &fds)) {
-		*got_smb = true;
-		return receive_smb(smbfd, buffer, buffer_len, 0);
-	} else {
-		return false;
+	/* Another process wants us to break an oplock; any SMB that is
+	   waiting will still be there next time */
+	if ((selrtn & 2) != 0) {
+		receive_oplock_message();
+		return true;
 	}
+
+	*got_smb = true;
+	return receive_smb(smbfd, buffer, buffer_len, 0);
 }
 
 /* Get the next SMB packet, doing the local message processing automatically. */
@@ -1790,6 +2643,13 @@ static int sig_hup(void)
 	return 0;
 }
 
+static int sig_usr1(void)
+{
+	stats_request_dump();
+	signal(SIGUSR1, SIGNAL_CAST sig_usr1);
+	return 0;
+}
+
 static bool dir_world_writeable(const char *path)
 {
 	struct stat st;
@@ -1845,7 +2705,10 @@ int make_connection(char *service, char *dev)
 		return -1;
 	}
 
+	/* the slot may have been used before */
 	pcon = &Connections[cnum];
+	free(pcon->dirpath);
+	free(pcon->connectpath);
 	bzero(pcon, sizeof(*pcon));
 
 	pcon->read_only =
@@ -1856,6 +2719,7 @@ int make_connection(char *service, char *dev)
 	pcon->used = true;
 	pcon->dirptr = NULL;
 	pcon->connectpath = NULL;
+	pcon->root_fd = -1;
 	string_set(&pcon->dirpath, "");
 
 	if (share != ipc_service) {
@@ -1874,17 +2738,18 @@ int make_connection(char *service, char *dev)
 		string_set(&pcon->connectpath, canon_path);
 		DEBUG("Connect path is %s\n", canon_path);
 		free(canon_path);
+
+		pcon->root_fd = open(pcon->connectpath, ROOT_DIR_FLAGS);
+		if (pcon->root_fd < 0) {
+			INFO("open(%s) failed, errno=%d\n", pcon->connectpath,
+			     errno);
+			pcon->open = false;
+			return -1;
+		}
 	}
 
 	pcon->open = true;
 
-	if (share != ipc_service && chdir(pcon->connectpath) != 0) {
-		ERROR("Can't change directory to %s (%s)\n", pcon->connectpath,
-		      strerror(errno));
-		pcon->open = false;
-		return -5;
-	}
-
 	num_connections_open++;
 
 	NOTICE("connect to service %s (pid %d)\n", CONN_SHARE(cnum)->name,
@@ -1894,45 +2759,90 @@ int make_connection(char *service, char *dev)
 	return cnum;
 }
 
-/* Find first available file slot */
-int find_free_file(void)
+/* Add a file slot to the end of the free list */
+static void queue_free_file(int fnum)
 {
-	int i;
-	static unsigned int first_file;
+	Files[fnum].on_free_list = true;
+	Files[fnum].next_free = -1;
+
+	if (cur_session->free_files_tail == -1)
+		cur_session->free_files_head = fnum;
+	else
+		Files[cur_session->free_files_tail].next_free = fnum;
+	cur_session->free_files_tail = fnum;
+}
+
+/* Make the file table bigger, if we have not yet reached the limit */
+static void grow_file_table(void)
+{
+	struct session *s = cur_session;
+	int old_size = s->num_files, new_size, first, i;
+
+	if (old_size >= max_open_files)
+		return;
 
 	/* we want to give out file handles differently on each new
 	   connection because of a common bug in MS clients where they try to
 	   reuse a file descriptor from an earlier smb connection. This code
 	   increases the chance that the errant client will get an error rather
-	   than causing corruption */
-	if (first_file == 0) {
-		first_file = (getpid() ^ (int) time(NULL)) % MAX_OPEN_FILES;
-		if (first_file == 0)
-			first_file = 1;
-	}
+	   than causing corruption. Handles are reused in the order they are
+	   closed, for the same reason. The first handle can be anywhere up to
+	   the limit, so the table starts out just big enough to include it.
+
+	   returning a file handle of 0 is a bad idea - so we start at 1.
+
+	   A trace can only be replayed if the handles are given out the same
+	   way both times, so they always start at 1 then. */
+	first = MAX(old_size, 1);
+	if (old_size == 0 && !trace_enabled() && !replaying)
+		first += (getpid() ^ (int) time(NULL)) % (max_open_files - 1);
+
+	new_size = MAX(old_size * 2, first + MIN_FILE_SLOTS - 1);
+	new_size = MIN(new_size, max_open_files);
+	s->files =
+	    checked_realloc(s->files, new_size * sizeof(struct open_file));
+	memset(&s->files[old_size], 0,
+	       (new_size - old_size) * sizeof(struct open_file));
+	Files = s->files;
+	num_file_slots = s->num_files = new_size;
+
+	for (i = first; i < new_size; i++)
+		queue_free_file(i);
+	for (i = MAX(old_size, 1); i < first; i++)
+		queue_free_file(i);
+}
 
-	if (first_file >= MAX_OPEN_FILES)
-		first_file = 1;
+/* Find an available file slot and reserve it. The slot must be given back
+   with release_file() if the file is not opened. */
+int find_free_file(void)
+{
+	int i;
 
-	for (i = first_file; i < MAX_OPEN_FILES; i++)
-		if (!OPEN_FNUM(i) && !Files[i].reserved) {
-			memset(&Files[i], 0, sizeof(Files[i]));
-			first_file = i + 1;
-			Files[i].reserved = true;
-			return i;
-		}
+	if (cur_session->free_files_head == -1)
+		grow_file_table();
 
-	/* returning a file handle of 0 is a bad idea - so we start at 1 */
-	for (i = 1; i < first_file; i++)
-		if (!OPEN_FNUM(i) && !Files[i].reserved) {
-			memset(&Files[i], 0, sizeof(Files[i]));
-			first_file = i + 1;
-			Files[i].reserved = true;
-			return i;
-		}
+	i = cur_session->free_files_head;
+	if (i == -1) {
+		WARNING("Out of file structures - perhaps increase the "
+		        "limit with -m?\n");
+		return -1;
+	}
 
-	WARNING("Out of file structures - perhaps increase MAX_OPEN_FILES?\n");
-	return -1;
+	cur_session->free_files_head = Files[i].next_free;
+	if (cur_session->free_files_head == -1)
+		cur_session->free_files_tail = -1;
+
+	memset(&Files[i], 0, sizeof(Files[i]));
+	Files[i].reserved = true;
+	return i;
+}
+
+/* Give back a file slot which is no longer in use */
+void release_file(int fnum)
+{
+	Files[fnum].reserved = false;
+	if (!Files[fnum].on_free_list)
+		queue_free_file(fnum);
 }
 
 /* Find first available connection slot, starting from a random position.  The
@@ -2045,11 +2955,13 @@ static int reply_lanman2(char *outbuf)
 static int reply_nt1(char *outbuf)
 {
 	/* dual names + lock_and_read + nt SMBs + remote API calls */
-	int capabilities = CAP_NT_FIND | CAP_LOCK_AND_READ | CAP_RAW_MODE;
+	int capabilities = CAP_NT_FIND | CAP_LOCK_AND_READ | CAP_RAW_MODE |
+	                   CAP_LARGE_READX | CAP_LARGE_WRITEX |
+	                   CAP_LARGE_FILES | CAP_LEVEL_II_OPLOCKS;
 	/*
 	  other valid capabilities which we may support at some time...
-	                     CAP_LARGE_FILES|CAP_NT_SMBS|CAP_RPC_REMOTE_APIS;
-	                     CAP_LARGE_READX|CAP_STATUS32|CAP_LEVEL_II_OPLOCKS;
+	                     CAP_NT_SMBS|CAP_RPC_REMOTE_APIS;
+	                     CAP_STATUS32;
 	 */
 
 	int secword = 0;
@@ -2205,7 +3117,7 @@ static int reply_negprot(char *inbuf, char *outbuf, size_t inbuf_len,
 static void close_open_files(int cnum)
 {
 	int i;
-	for (i = 0; i < MAX_OPEN_FILES; i++)
+	for (i = 0; i < num_file_slots; i++)
 		if (Files[i].cnum == cnum && OPEN_FNUM(i)) {
 			close_file(i, false);
 		}
@@ -2226,6 +3138,11 @@ void close_cnum(int cnum)
 	Connections[cnum].open = false;
 	num_connections_open--;
 
+	if (Connections[cnum].root_fd >= 0) {
+		close(Connections[cnum].root_fd);
+		Connections[cnum].root_fd = -1;
+	}
+
 	string_set(&Connections[cnum].dirpath, "");
 	string_set(&Connections[cnum].connectpath, "");
 	set_descriptive_argv();
@@ -2234,21 +3151,28 @@ void close_cnum(int cnum)
 void exit_server(const char *reason)
 {
 	static bool firsttime = true;
-	int i;
+
+	/* When serving several clients from one process, only the current
+	   session ends; serve_session() picks up from here. */
+	if (session_abort_armed && !shutting_down) {
+		NOTICE("Session exit (%s)\n", reason);
+		siglongjmp(session_abort, 1);
+	}
 
 	if (!firsttime)
 		exit(0);
 	firsttime = false;
 
 	DEBUG("Closing connections\n");
-	for (i = 0; i < MAX_CONNECTIONS; i++)
-		if (OPEN_CNUM(i))
-			close_cnum(i);
-	if (client_fd != -1) {
-		close(client_fd);
-		client_fd = -1;
+	while (sessions != NULL) {
+		end_session(sessions);
 	}
 
+	stats_dump();
+	if (am_parent) {
+		stats_segment_remove();
+		oplock_table_remove();
+	}
 	NOTICE("Server exit (%s)\n", reason);
 	exit(0);
 }
@@ -2263,101 +3187,99 @@ void exit_server(const char *reason)
 /* Only messages with this set can be used on the IPC$ share */
 #define ALLOWED_IN_IPC (1 << 2)
 
+/* Indexed by command code; unused codes have no name or handler. */
 static const struct smb_message_struct {
-	int code;
 	char *name;
 	int (*fn)(char *, char *, size_t, size_t);
 	int flags;
-} smb_messages[] = {
+} smb_messages[256] = {
 
     /* CORE PROTOCOL */
 
-    {SMBnegprot, "SMBnegprot", reply_negprot, DONT_CHECK_CNUM},
-    {SMBtcon, "SMBtcon", reply_tcon, DONT_CHECK_CNUM},
-    {SMBtdis, "SMBtdis", reply_tdis, ALLOWED_IN_IPC},
-    {SMBexit, "SMBexit", reply_exit, DONT_CHECK_CNUM},
-    {SMBioctl, "SMBioctl", reply_ioctl, 0},
-    {SMBecho, "SMBecho", reply_echo, DONT_CHECK_CNUM},
-    {SMBsesssetupX, "SMBsesssetupX", reply_sesssetup_and_X, DONT_CHECK_CNUM},
-    {SMBtconX, "SMBtconX", reply_tcon_and_X, DONT_CHECK_CNUM},
-    {SMBulogoffX, "SMBulogoffX", reply_ulogoffX, DONT_CHECK_CNUM},
-    {SMBgetatr, "SMBgetatr", reply_getatr, 0},
-    {SMBsetatr, "SMBsetatr", reply_setatr, NEED_WRITE},
-    {SMBchkpth, "SMBchkpth", reply_chkpth, 0},
-    {SMBsearch, "SMBsearch", reply_search, 0},
-    {SMBopen, "SMBopen", reply_open, 0},
+    [SMBnegprot] = {"SMBnegprot", reply_negprot, DONT_CHECK_CNUM},
+    [SMBtcon] = {"SMBtcon", reply_tcon, DONT_CHECK_CNUM},
+    [SMBtdis] = {"SMBtdis", reply_tdis, ALLOWED_IN_IPC},
+    [SMBexit] = {"SMBexit", reply_exit, DONT_CHECK_CNUM},
+    [SMBioctl] = {"SMBioctl", reply_ioctl, 0},
+    [SMBecho] = {"SMBecho", reply_echo, DONT_CHECK_CNUM},
+    [SMBsesssetupX] = {"SMBsesssetupX", reply_sesssetup_and_X, DONT_CHECK_CNUM},
+    [SMBtconX] = {"SMBtconX", reply_tcon_and_X, DONT_CHECK_CNUM},
+    [SMBulogoffX] = {"SMBulogoffX", reply_ulogoffX, DONT_CHECK_CNUM},
+    [SMBgetatr] = {"SMBgetatr", reply_getatr, 0},
+    [SMBsetatr] = {"SMBsetatr", reply_setatr, NEED_WRITE},
+    [SMBchkpth] = {"SMBchkpth", reply_chkpth, 0},
+    [SMBsearch] = {"SMBsearch", reply_search, 0},
+    [SMBopen] = {"SMBopen", reply_open, 0},
 
     /* note that SMBmknew and SMBcreate are deliberately overloaded */
-    {SMBcreate, "SMBcreate", reply_mknew, 0},
-    {SMBmknew, "SMBmknew", reply_mknew, 0},
-
-    {SMBunlink, "SMBunlink", reply_unlink, NEED_WRITE},
-    {SMBread, "SMBread", reply_read, 0},
-    {SMBwrite, "SMBwrite", reply_write, 0},
-    {SMBclose, "SMBclose", reply_close, ALLOWED_IN_IPC},
-    {SMBmkdir, "SMBmkdir", reply_mkdir, NEED_WRITE},
-    {SMBrmdir, "SMBrmdir", reply_rmdir, NEED_WRITE},
-    {SMBdskattr, "SMBdskattr", reply_dskattr, 0},
-    {SMBmv, "SMBmv", reply_mv, NEED_WRITE},
+    [SMBcreate] = {"SMBcreate", reply_mknew, 0},
+    [SMBmknew] = {"SMBmknew", reply_mknew, 0},
+
+    [SMBunlink] = {"SMBunlink", reply_unlink, NEED_WRITE},
+    [SMBread] = {"SMBread", reply_read, 0},
+    [SMBwrite] = {"SMBwrite", reply_write, 0},
+    [SMBclose] = {"SMBclose", reply_close, ALLOWED_IN_IPC},
+    [SMBmkdir] = {"SMBmkdir", reply_mkdir, NEED_WRITE},
+    [SMBrmdir] = {"SMBrmdir", reply_rmdir, NEED_WRITE},
+    [SMBdskattr] = {"SMBdskattr", reply_dskattr, 0},
+    [SMBmv] = {"SMBmv", reply_mv, NEED_WRITE},
 
     /* this is a Pathworks specific call, allowing the
        changing of the root path */
-    {pSETDIR, "pSETDIR", reply_setdir, 0},
-
-    {SMBlseek, "SMBlseek", reply_lseek, 0},
-    {SMBflush, "SMBflush", reply_flush, 0},
-    {SMBctemp, "SMBctemp", reply_ctemp, 0},
-    {SMBsplopen, "SMBsplopen", reply_printfn, 0},
-    {SMBsplclose, "SMBsplclose", reply_printfn, 0},
-    {SMBsplretq, "SMBsplretq", reply_printfn, 0},
-    {SMBsplwr, "SMBsplwr", reply_printfn, 0},
-    {SMBlock, "SMBlock", reply_lock, 0},
-    {SMBunlock, "SMBunlock", reply_unlock, 0},
+    [(unsigned char) pSETDIR] = {"pSETDIR", reply_setdir, 0},
+
+    [SMBlseek] = {"SMBlseek", reply_lseek, 0},
+    [SMBflush] = {"SMBflush", reply_flush, 0},
+    [SMBctemp] = {"SMBctemp", reply_ctemp, 0},
+    [SMBsplopen] = {"SMBsplopen", reply_printfn, 0},
+    [SMBsplclose] = {"SMBsplclose", reply_printfn, 0},
+    [SMBsplretq] = {"SMBsplretq", reply_printfn, 0},
+    [SMBsplwr] = {"SMBsplwr", reply_printfn, 0},
+    [SMBlock] = {"SMBlock", reply_lock, 0},
+    [SMBunlock] = {"SMBunlock", reply_unlock, 0},
 
     /* CORE+ PROTOCOL FOLLOWS */
 
-    {SMBreadbraw, "SMBreadbraw", reply_readbraw, 0},
-    {SMBwritebraw, "SMBwritebraw", reply_writebraw, 0},
-    {SMBwriteclose, "SMBwriteclose", reply_writeclose, 0},
-    {SMBlockread, "SMBlockread", reply_lockread, 0},
-    {SMBwriteunlock, "SMBwriteunlock", reply_writeunlock, 0},
+    [SMBreadbraw] = {"SMBreadbraw", reply_readbraw, 0},
+    [SMBwritebraw] = {"SMBwritebraw", reply_writebraw, 0},
+    [SMBwriteclose] = {"SMBwriteclose", reply_writeclose, 0},
+    [SMBlockread] = {"SMBlockread", reply_lockread, 0},
+    [SMBwriteunlock] = {"SMBwriteunlock", reply_writeunlock, 0},
 
     /* LANMAN1.0 PROTOCOL FOLLOWS */
 
-    {SMBreadBmpx, "SMBreadBmpx", reply_readbmpx, 0},
-    {SMBwriteBmpx, "SMBwriteBmpx", reply_writebmpx, 0},
-    {SMBwriteBs, "SMBwriteBs", reply_writebs, 0},
-    {SMBsetattrE, "SMBsetattrE", reply_setattrE, NEED_WRITE},
-    {SMBgetattrE, "SMBgetattrE", reply_getattrE, 0},
-    {SMBtrans, "SMBtrans", reply_trans, ALLOWED_IN_IPC},
-    {SMBcopy, "SMBcopy", reply_copy, NEED_WRITE},
+    [SMBreadBmpx] = {"SMBreadBmpx", reply_readbmpx, 0},
+    [SMBwriteBmpx] = {"SMBwriteBmpx", reply_writebmpx, 0},
+    [SMBwriteBs] = {"SMBwriteBs", reply_writebs, 0},
+    [SMBsetattrE] = {"SMBsetattrE", reply_setattrE, NEED_WRITE},
+    [SMBgetattrE] = {"SMBgetattrE", reply_getattrE, 0},
+    [SMBtrans] = {"SMBtrans", reply_trans, ALLOWED_IN_IPC},
+    [SMBcopy] = {"SMBcopy", reply_copy, NEED_WRITE},
 
-    {SMBopenX, "SMBopenX", reply_open_and_X, ALLOWED_IN_IPC},
-    {SMBreadX, "SMBreadX", reply_read_and_X, 0},
-    {SMBwriteX, "SMBwriteX", reply_write_and_X, 0},
-    {SMBlockingX, "SMBlockingX", reply_lockingX, 0},
+    [SMBopenX] = {"SMBopenX", reply_open_and_X, ALLOWED_IN_IPC},
+    [SMBreadX] = {"SMBreadX", reply_read_and_X, 0},
+    [SMBwriteX] = {"SMBwriteX", reply_write_and_X, 0},
+    [SMBlockingX] = {"SMBlockingX", reply_lockingX, 0},
 
-    {SMBffirst, "SMBffirst", reply_search, 0},
-    {SMBfunique, "SMBfunique", reply_search, 0},
-    {SMBfclose, "SMBfclose", reply_fclose, 0},
+    [SMBffirst] = {"SMBffirst", reply_search, 0},
+    [SMBfunique] = {"SMBfunique", reply_search, 0},
+    [SMBfclose] = {"SMBfclose", reply_fclose, 0},
 
     /* LANMAN2.0 PROTOCOL FOLLOWS */
-    {SMBfindnclose, "SMBfindnclose", reply_findnclose, 0},
-    {SMBfindclose, "SMBfindclose", reply_findclose, 0},
-    {SMBtrans2, "SMBtrans2", reply_trans2, 0},
-    {SMBtranss2, "SMBtranss2", reply_transs2, 0},
+    [SMBfindnclose] = {"SMBfindnclose", reply_findnclose, 0},
+    [SMBfindclose] = {"SMBfindclose", reply_findclose, 0},
+    [SMBtrans2] = {"SMBtrans2", reply_trans2, 0},
+    [SMBtranss2] = {"SMBtranss2", reply_transs2, 0},
 };
 
 /* Returns a string containing the function name of a SMB command */
 char *smb_fn_name(int type)
 {
-	int match;
+	if (type < 0 || type >= arrlen(smb_messages) ||
+	    smb_messages[type].name == NULL)
+		return "SMBunknown";
 
-	for (match = 0; match < arrlen(smb_messages); match++)
-		if (smb_messages[match].code == type)
-			return smb_messages[match].name;
-
-	return "SMBunknown";
+	return smb_messages[type].name;
 }
 
 /* Do a switch on the message type, and return the response size */
@@ -2366,8 +3288,8 @@ static int switch_message(int type, char *inbuf, char *outbuf, size_t inbuf_len,
 {
 	const char *hdr;
 	static int pid = -1;
-	static int num_smb_messages = arrlen(smb_messages);
-	int cnum, flags, match;
+	const struct smb_message_struct *msg;
+	int cnum, flags;
 
 	if (pid == -1)
 		pid = getpid();
@@ -2387,19 +3309,17 @@ static int switch_message(int type, char *inbuf, char *outbuf, size_t inbuf_len,
 		      smb_len(inbuf), hdr[0], hdr[1], hdr[2], hdr[3]);
 	}
 
-	for (match = 0; match < num_smb_messages; match++)
-		if (smb_messages[match].code == type)
-			break;
-
-	if (match == num_smb_messages) {
+	msg = type >= 0 && type < arrlen(smb_messages) ? &smb_messages[type]
+	                                               : NULL;
+	if (msg == NULL || msg->fn == NULL) {
 		ERROR("Unknown message type %d!\n", type);
 		return reply_unknown(inbuf, outbuf);
 	}
 
-	DEBUG("switch message %s (pid %d)\n", smb_messages[match].name, pid);
+	DEBUG("switch message %s (pid %d)\n", msg->name, pid);
 
 	cnum = SVAL(inbuf, smb_tid);
-	flags = smb_messages[match].flags;
+	flags = msg->flags;
 
 	/* Ensure value is replaced in the incoming packet. */
 	SSVAL(inbuf, smb_uid, UID_FIELD_INVALID);
@@ -2426,45 +3346,16 @@ static int switch_message(int type, char *inbuf, char *outbuf, size_t inbuf_len,
 
 	last_inbuf = inbuf;
 
-	return smb_messages[match].fn(inbuf, outbuf, inbuf_len, outbuf_len);
-}
-
-// Wrapper around switch_message() above that does profiling, if compiled in.
-static int profiled_switch_message(int type, char *inbuf, char *outbuf,
-                                   size_t inbuf_len, size_t outbuf_len)
-{
-	int outsize;
-#ifdef PROFILING
-	struct timeval msg_start_time;
-	struct timeval msg_end_time;
-	unsigned long this_time;
-
-	gettimeofday(&msg_start_time, NULL);
-#endif
-
-	outsize = switch_message(type, inbuf, outbuf, inbuf_len, outbuf_len);
-
-#ifdef PROFILING
-	gettimeofday(&msg_end_time, NULL);
-
-	this_time = (msg_end_time.tv_sec - msg_start_time.tv_sec) * 1e6 +
-	            (msg_end_time.tv_usec - msg_start_time.tv_usec);
-
-	// This kind of message would normally be a DEBUG message, but if
-	// we're compiled with profiling enabled, we possibly want to be able
-	// to evaluate performance without the overhead caused by other DEBUG
-	// log statements being generated.
-	NOTICE("PROFILING: %s took %ld usecs\n", smb_fn_name(type), this_time);
-#endif
-
-	return outsize;
+	return msg->fn(inbuf, outbuf, inbuf_len, outbuf_len);
 }
 
 /* Construct a chained reply and add it to the already made reply */
+/* The buffers holding the first SMB of the chain being processed */
+static char *orig_inbuf;
+static char *orig_outbuf;
+
 int chain_reply(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 {
-	static char *orig_inbuf;
-	static char *orig_outbuf;
 	int smb_com1, smb_com2 = CVAL(inbuf, smb_vwv0);
 	unsigned smb_off2 = SVAL(inbuf, smb_vwv1);
 	char *inbuf2, *outbuf2;
@@ -2535,7 +3426,7 @@ int chain_reply(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len)
 	show_msg(inbuf2);
 
 	/* process the request */
-	outsize2 = profiled_switch_message(smb_com2, inbuf2, outbuf2,
+	outsize2 = switch_message(smb_com2, inbuf2, outbuf2,
 	                                   inbuf_len - chain_size,
 	                                   outbuf_len - chain_size);
 
@@ -2589,8 +3480,7 @@ static int construct_reply(char *inbuf, char *outbuf, size_t inbuf_len,
 	SSVAL(outbuf, smb_uid, SVAL(inbuf, smb_uid));
 	SSVAL(outbuf, smb_mid, SVAL(inbuf, smb_mid));
 
-	outsize =
-	    profiled_switch_message(type, inbuf, outbuf, inbuf_len, outbuf_len);
+	outsize = switch_message(type, inbuf, outbuf, inbuf_len, outbuf_len);
 
 	outsize += chain_size;
 
@@ -2616,6 +3506,9 @@ static void process_smb(char *inbuf, char *outbuf)
 	else if (msg_type == NETBIOS_SESSION_KEEP_ALIVE)
 		return; /* Keepalive packet. */
 
+	trace_smb(cur_session->trace_id, inbuf, nread);
+	stats_begin(CVAL(inbuf, smb_com));
+
 	nread = construct_reply(inbuf, outbuf, nread, max_send);
 
 	if (nread > 0) {
@@ -2628,40 +3521,514 @@ static void process_smb(char *inbuf, char *outbuf)
 		} else
 			send_smb(client_fd, outbuf);
 	}
+
+	discard_pending_write_data();
+
+	/* chained requests are all counted against the first command */
+	stats_end(CVAL(inbuf, smb_com), len + 4);
+
+	/* this includes the reads to receive the request itself */
+	DEBUG("Transaction %d made %d read calls\n", trans_num, recv_syscalls);
+	recv_syscalls = 0;
+
 	trans_num++;
 }
 
-/* Process commands from the client */
-static void process(void)
+/* Oplocks let a client cache a file that nobody else has open, reading ahead
+   and writing behind as it likes. Before anyone else can open the file, the
+   client is sent an SMBlockingX telling it to break the oplock: it writes
+   back whatever it has cached, and then either releases the oplock or closes
+   the file. Meanwhile, we carry on processing SMBs from it, in a nested loop
+   that may itself have to break other oplocks.
+
+   If the file is only being opened for reading, a client that supports it
+   can keep a level II oplock instead, which lets it go on caching what it
+   reads. As long as it has one, nobody can have the file open for writing:
+   opening it for writing breaks all level II oplocks. Clients do not respond
+   when a level II oplock is broken, so there is nothing to wait for. */
+
+/* How deeply oplock breaks can nest before opens that need more fail */
+#define MAX_OPLOCK_BREAK_DEPTH 4
+
+static int oplock_break_depth = 0;
+
+/* Per-request state that processing SMBs in the middle of another request
+   would trample over */
+struct nested_state {
+	int chain_size, chain_fnum;
+	char *orig_inbuf, *orig_outbuf;
+	char *last_inbuf;
+	int last_message;
+	int smb_read_error;
+	int unix_ERR_class, unix_ERR_code;
+	int pending_write_data;
+	bool session_abort_armed;
+	sigjmp_buf session_abort;
+	struct stats_request_state stats;
+};
+
+static void save_nested_state(struct nested_state *ns)
+{
+	ns->chain_size = chain_size;
+	ns->chain_fnum = chain_fnum;
+	ns->orig_inbuf = orig_inbuf;
+	ns->orig_outbuf = orig_outbuf;
+	ns->last_inbuf = last_inbuf;
+	ns->last_message = last_message;
+	ns->smb_read_error = smb_read_error;
+	ns->unix_ERR_class = unix_ERR_class;
+	ns->unix_ERR_code = unix_ERR_code;
+	ns->pending_write_data = pending_write_data;
+	ns->session_abort_armed = session_abort_armed;
+	memcpy(ns->session_abort, session_abort, sizeof(sigjmp_buf));
+	stats_save(&ns->stats);
+}
+
+static void restore_nested_state(const struct nested_state *ns)
+{
+	chain_size = ns->chain_size;
+	chain_fnum = ns->chain_fnum;
+	orig_inbuf = ns->orig_inbuf;
+	orig_outbuf = ns->orig_outbuf;
+	last_inbuf = ns->last_inbuf;
+	last_message = ns->last_message;
+	smb_read_error = ns->smb_read_error;
+	unix_ERR_class = ns->unix_ERR_class;
+	unix_ERR_code = ns->unix_ERR_code;
+	pending_write_data = ns->pending_write_data;
+	session_abort_armed = ns->session_abort_armed;
+	memcpy(session_abort, ns->session_abort, sizeof(sigjmp_buf));
+	stats_restore(&ns->stats);
+}
+
+static struct session *find_session(uint32_t id)
+{
+	struct session *s;
+
+	for (s = sessions; s != NULL; s = s->next) {
+		if (s->id == id) {
+			return s;
+		}
+	}
+
+	return NULL;
+}
+
+/* Let go of the oplock on a file, either because the client has released
+   it or because it did not respond to a break in time. It keeps a level II
+   oplock if it was told that it could and says that it has. */
+void release_oplock(int fnum, int level)
+{
+	struct open_file *fsp = &Files[fnum];
+	int type = NO_OPLOCK;
+
+	if (level == OPLOCKLEVEL_II &&
+	    fsp->oplock_break_level == OPLOCKLEVEL_II) {
+		type = LEVEL_II_OPLOCK;
+	}
+
+	if (fsp->oplock != type) {
+		DEBUG("%s oplock on %s (fnum=%d)\n",
+		      type == NO_OPLOCK ? "released" : "downgraded", fsp->name,
+		      fnum);
+		fsp->oplock = type;
+		oplock_set_type(fsp->oplock_entry, type);
+	}
+}
+
+/* Returns true if fnum is still open through the given oplock table entry
+   and the client can cache writes to it */
+static bool holds_oplock(int fnum, int entry)
 {
-	in_buffer = checked_malloc(BUFFER_SIZE + SAFETY_MARGIN);
+	return OPEN_FNUM(fnum) && Files[fnum].oplock_entry == entry &&
+	       (Files[fnum].oplock == EXCLUSIVE_OPLOCK ||
+	        Files[fnum].oplock == BATCH_OPLOCK);
+}
+
+static void send_oplock_break(char *outbuf, int fnum, int level)
+{
+	bzero(outbuf, smb_size);
+	set_message(outbuf, 8, 0, true);
+	CVAL(outbuf, smb_com) = SMBlockingX;
+	SSVAL(outbuf, smb_tid, Files[fnum].cnum);
+	SSVAL(outbuf, smb_pid, 0xFFFF);
+	SSVAL(outbuf, smb_uid, 0);
+	SSVAL(outbuf, smb_mid, 0xFFFF);
+	CVAL(outbuf, smb_vwv0) = 0xFF;
+	SSVAL(outbuf, smb_vwv2, fnum);
+	CVAL(outbuf, smb_vwv3) = LOCKING_ANDX_OPLOCK_RELEASE;
+	CVAL(outbuf, smb_vwv3 + 1) = level;
+
+	send_smb(client_fd, outbuf);
+}
+
+/* Tell the client to break its oplock and wait for it to respond, processing
+   whatever it sends us until it lets go of the oplock. Returns false if the
+   session was aborted by FATAL() or exit_server() along the way. */
+static bool run_oplock_break(int fnum, int entry, int level, char *inbuf,
+                             char *outbuf, bool arm_abort)
+{
+	time_t deadline = time(NULL) + OPLOCK_BREAK_TIMEOUT;
+	int timeout, ready;
+
+	if (sigsetjmp(session_abort, 1) != 0) {
+		return false;
+	}
+	session_abort_armed = arm_abort;
+
+	send_oplock_break(outbuf, fnum, level);
+
+	while (holds_oplock(fnum, entry)) {
+		timeout = deadline - time(NULL);
+		if (timeout <= 0) {
+			WARNING("client did not respond to oplock break on %s "
+			        "(fnum=%d)\n",
+			        Files[fnum].name, fnum);
+			break;
+		}
+
+		ready = recv_buffer_has_data(client_fd) ||
+		        reactor_wait_fd(client_fd, timeout * 1000) > 0;
+		if (!ready) {
+			continue;
+		}
+
+		if (!receive_smb(client_fd, inbuf, LARGE_BUFFER_SIZE, 0)) {
+			/* the main loop will see the error again */
+			DEBUG("error receiving oplock break response\n");
+			break;
+		}
+
+		process_smb(inbuf, outbuf);
+	}
+
+	return true;
+}
+
+/* Break the oplock that session s holds on fnum, if it still does. Returns
+   false if it is still held because we could not wait for it. */
+static bool oplock_break(struct session *s, int fnum, int entry, int level)
+{
+	struct session *orig = cur_session;
+	struct nested_state saved;
+	char *inbuf, *outbuf;
+	bool ok;
+
+	session_switch(s);
+
+	if (!holds_oplock(fnum, entry)) {
+		session_switch(orig);
+		return true;
+	}
+
+	/* The client still has to be told before anyone else can use the
+	   file, so the open that wanted the break fails instead */
+	if (oplock_break_depth >= MAX_OPLOCK_BREAK_DEPTH) {
+		WARNING("oplock breaks nested too deeply; cannot break "
+		        "oplock on %s\n",
+		        Files[fnum].name);
+		session_switch(orig);
+		return false;
+	}
+
+	if (Files[fnum].can_write ||
+	    (client_capabilities & CAP_LEVEL_II_OPLOCKS) == 0) {
+		level = OPLOCKLEVEL_NONE;
+	}
+	Files[fnum].oplock_break_level = level;
+
+	DEBUG("breaking oplock on %s (fnum=%d) to level %d\n",
+	      Files[fnum].name, fnum, level);
+
+	save_nested_state(&saved);
+	++oplock_break_depth;
+
+	inbuf = checked_malloc(LARGE_BUFFER_SIZE + SAFETY_MARGIN);
+	outbuf = checked_malloc(BUFFER_SIZE + SAFETY_MARGIN);
+
+	/* In event mode, a FATAL() error only ends the session whose SMB
+	   caused it, even when that is a nested one */
+	ok = run_oplock_break(fnum, entry, level, inbuf, outbuf,
+	                      saved.session_abort_armed || event_mode);
+
+	free(inbuf);
+	free(outbuf);
+
+	/* If the client did not respond, we have to carry on without it */
+	if (holds_oplock(fnum, entry)) {
+		release_oplock(fnum, OPLOCKLEVEL_NONE);
+	}
+	if (OPEN_FNUM(fnum) && Files[fnum].oplock_entry == entry) {
+		Files[fnum].oplock_break_level = OPLOCKLEVEL_NONE;
+	}
+
+	--oplock_break_depth;
+	restore_nested_state(&saved);
+	session_switch(orig);
+
+	if (!ok) {
+		/* Back out of the request we were in the middle of, if that
+		   was for the same session; otherwise, the session is closed
+		   the next time that the main loop looks at it. */
+		if (s == orig && session_abort_armed) {
+			siglongjmp(session_abort, 1);
+		}
+		shutdown(s->fd, SHUT_RDWR);
+	}
+
+	return true;
+}
+
+/* Tell the client of session s that it has lost its level II oplock on
+   fnum, if it still has one. */
+static void break_level_ii_oplock(struct session *s, int fnum, int entry)
+{
+	struct session *orig = cur_session;
+	char buf[smb_size + 32];
+
+	session_switch(s);
+
+	if (OPEN_FNUM(fnum) && Files[fnum].oplock_entry == entry &&
+	    Files[fnum].oplock == LEVEL_II_OPLOCK) {
+		DEBUG("breaking level II oplock on %s (fnum=%d)\n",
+		      Files[fnum].name, fnum);
+		send_oplock_break(buf, fnum, OPLOCKLEVEL_NONE);
+		Files[fnum].oplock = NO_OPLOCK;
+	}
+
+	session_switch(orig);
+}
+
+/* Reply to an oplock break request from another process once it is done */
+static void answer_oplock_break(struct oplock_message *msg, pid_t from)
+{
+	struct session *s = find_session(msg->session);
+
+	msg->broken = true;
+	if (s != NULL) {
+		msg->broken =
+		    oplock_break(s, msg->fnum, msg->entry, msg->level);
+	}
+
+	msg->type = OPLOCK_BREAK_REPLY;
+	oplock_send(from, msg);
+}
+
+/* Called when the oplock socket is readable */
+static void receive_oplock_message(void)
+{
+	struct oplock_message msg;
+	struct session *s;
+	pid_t from;
+
+	if (!oplock_receive(&msg, &from)) {
+		return;
+	}
+
+	if (msg.type == OPLOCK_BREAK_REQUEST) {
+		answer_oplock_break(&msg, from);
+	} else if (msg.type == OPLOCK_LEVEL_II_BREAK) {
+		s = find_session(msg.session);
+		if (s != NULL) {
+			break_level_ii_oplock(s, msg.fnum, msg.entry);
+		}
+	} else {
+		DEBUG("ignoring late oplock break reply\n");
+	}
+}
+
+/* Break the level II oplock that h holds. The caller has already removed it
+   from the table. */
+static void notify_level_ii_break(const struct oplock_holder *h)
+{
+	struct oplock_message msg;
+	struct session *s;
+
+	if (h->pid == getpid()) {
+		s = find_session(h->session);
+		if (s != NULL) {
+			break_level_ii_oplock(s, h->fnum, h->entry);
+		}
+		return;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = OPLOCK_LEVEL_II_BREAK;
+	msg.session = h->session;
+	msg.fnum = h->fnum;
+	msg.entry = h->entry;
+	msg.level = OPLOCKLEVEL_NONE;
+	oplock_send(h->pid, &msg);
+}
+
+/* Get the oplock that h holds broken down to the given level, and wait for
+   it to happen. Returns false if it could not be broken. */
+static bool request_oplock_break(const struct oplock_holder *h, int level)
+{
+	static uint32_t seq = 0;
+	struct oplock_message msg, reply;
+	struct session *s;
+	time_t deadline;
+	pid_t from;
+	int timeout;
+
+	/* Easy if it is one of our own sessions */
+	if (h->pid == getpid()) {
+		s = find_session(h->session);
+		if (s != NULL) {
+			return oplock_break(s, h->fnum, h->entry, level);
+		}
+		oplock_set_type(h->entry, NO_OPLOCK);
+		return true;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = OPLOCK_BREAK_REQUEST;
+	msg.seq = ++seq;
+	msg.session = h->session;
+	msg.fnum = h->fnum;
+	msg.entry = h->entry;
+	msg.level = level;
+
+	DEBUG("asking pid %ld to break oplock (fnum=%d)\n", (long) h->pid,
+	      h->fnum);
+
+	/* The holder's client gets OPLOCK_BREAK_TIMEOUT seconds to respond,
+	   so we wait a little longer than that. While waiting, we might be
+	   asked to break an oplock ourselves. */
+	deadline = time(NULL) + OPLOCK_BREAK_TIMEOUT + 5;
+	if (oplock_send(h->pid, &msg)) {
+		while ((timeout = deadline - time(NULL)) > 0) {
+			if (reactor_wait_fd(oplock_fd, timeout * 1000) < 0) {
+				break;
+			}
+			if (!oplock_receive(&reply, &from)) {
+				continue;
+			}
+			if (reply.type == OPLOCK_BREAK_REQUEST) {
+				answer_oplock_break(&reply, from);
+			} else if (reply.seq == msg.seq && from == h->pid) {
+				return reply.broken;
+			}
+		}
+	}
+
+	/* The holder may have died without cleaning up after itself */
+	if (kill(h->pid, 0) != 0 && errno == ESRCH) {
+		oplock_process_exited(h->pid);
+		return true;
+	}
+
+	WARNING("gave up waiting for pid %ld to break oplock\n",
+	        (long) h->pid);
+	return false;
+}
+
+static bool oplocks_enabled(void)
+{
+	return oplock_fd >= 0 && !replaying;
+}
+
+/* Record a file that has just been opened in the oplock table. Any oplock
+   that somebody else holds on it is broken first, and then the one the client
+   asked for is granted if nobody else has the file open. Returns false if an
+   oplock could not be broken, or the open could not be recorded. */
+static bool register_open(int fnum, int oplock_request)
+{
+	struct oplock_holder h;
+	uint32_t dev = Files[fnum].fd_ptr->dev;
+	uint32_t inode = Files[fnum].fd_ptr->inode;
+	bool writing = Files[fnum].can_write;
+	int entry, last = 0;
+	int type;
+
+	if (!oplocks_enabled()) {
+		return true;
+	}
+
+	/* Nobody else can be granted an oplock once our entry is there, so
+	   this terminates */
+	oplock_lock();
+	entry = oplock_add(dev, inode, cur_session->id, fnum);
+	Files[fnum].oplock_entry = entry;
+	if (entry == OPLOCK_NO_ROOM) {
+		oplock_unlock();
+		return false;
+	}
+
+	/* Level II oplocks only get in the way of opening for writing */
+	while (oplock_find_holder(dev, inode, writing, &h)) {
+		if (h.type == LEVEL_II_OPLOCK) {
+			oplock_set_type(h.entry, NO_OPLOCK);
+			oplock_unlock();
+			notify_level_ii_break(&h);
+			oplock_lock();
+			continue;
+		}
+
+		oplock_unlock();
+		if (h.entry == last ||
+		    !request_oplock_break(&h, writing ? OPLOCKLEVEL_NONE
+		                                      : OPLOCKLEVEL_II)) {
+			return false;
+		}
+		last = h.entry;
+		oplock_lock();
+	}
+
+	if (oplock_request != 0 && entry > 0 &&
+	    !oplock_file_shared(dev, inode, entry)) {
+		type = (oplock_request & BATCH_OPLOCK) != 0 ? BATCH_OPLOCK
+		                                            : EXCLUSIVE_OPLOCK;
+		Files[fnum].oplock = type;
+		oplock_set_type(entry, type);
+		DEBUG("granted %s oplock on %s (fnum=%d)\n",
+		      type == BATCH_OPLOCK ? "batch" : "exclusive",
+		      Files[fnum].name, fnum);
+	}
+
+	oplock_unlock();
+	return true;
+}
+
+/* Allocate the buffers used for incoming and outgoing SMBs */
+static void alloc_buffers(void)
+{
+	if (in_buffer != NULL) {
+		return;
+	}
+
+	/* Large SMBwriteX requests can be bigger than BUFFER_SIZE, but replies
+	   never are: large SMBreadX data is sent straight from the file. */
+	in_buffer = checked_malloc(LARGE_BUFFER_SIZE + SAFETY_MARGIN);
 	out_buffer = checked_malloc(BUFFER_SIZE + SAFETY_MARGIN);
 
 	in_buffer += SMB_ALIGNMENT;
 	out_buffer += SMB_ALIGNMENT;
+}
+
+/* Process commands from the client */
+static void process(void)
+{
+	alloc_buffers();
 
 	/* re-initialise the timezone */
 	time_init();
 
 	while (true) {
-		int counter;
+		time_t t = time(NULL);
+		time_t deadline = session_next_timeout(t);
 		bool got_smb = false;
 
+		stats_dump_if_requested();
 		errno = 0;
 
-		for (counter = SMBD_SELECT_LOOP;
-		     !receive_message_or_smb(client_fd, in_buffer, BUFFER_SIZE,
-		                             SMBD_SELECT_LOOP * 1000, &got_smb);
-		     counter += SMBD_SELECT_LOOP) {
-			int i;
-			time_t t;
-			bool allidle = true;
-
-			if (counter > 365 * 3600) /* big number of seconds. */
-			{
-				counter = 0;
-			}
-
+		/* sleep until the client sends something or the next
+		   timeout is due, whichever is first */
+		if (!receive_message_or_smb(
+		        client_fd, in_buffer, LARGE_BUFFER_SIZE,
+		        deadline == 0 ? 0 : MAX(deadline - t, 1) * 1000,
+		        &got_smb)) {
 			if (smb_read_error == READ_EOF) {
 				DEBUG("end of file from client\n");
 				return;
@@ -2673,72 +4040,385 @@ static void process(void)
 				return;
 			}
 
-			t = time(NULL);
-
-			/* automatic timeout if all connections are closed */
-			if (num_connections_open == 0 &&
-			    counter >= IDLE_CLOSED_TIMEOUT) {
-				DEBUG("Closing idle connection\n");
+			if (session_timed_out(time(NULL))) {
 				return;
 			}
+			continue;
+		}
+
+		cur_session->last_activity = time(NULL);
+
+		if (got_smb)
+			process_smb(in_buffer, out_buffer);
+	}
+}
+
+/* Called by FATAL() in event workers so that a bad client only takes down
+   its own session rather than every client served by the worker. */
+static void fatal_session_error(void)
+{
+	if (session_abort_armed) {
+		siglongjmp(session_abort, 1);
+	}
+}
+
+/* Read and process a single SMB from the given session, which the reactor has
+   told us is readable. Returns false if the session should be closed. */
+static bool serve_session(struct session *s)
+{
+	if (sigsetjmp(session_abort, 1) != 0) {
+		/* exit_server() or FATAL() was called during the request */
+		session_abort_armed = false;
+		return false;
+	}
+	session_abort_armed = true;
+
+	errno = 0;
+
+	if (!receive_smb(client_fd, in_buffer, LARGE_BUFFER_SIZE, 0)) {
+		session_abort_armed = false;
+		if (smb_read_error == READ_EOF) {
+			DEBUG("end of file from client\n");
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			WARNING("timed out receiving SMB from client, closing "
+			        "session\n");
+		} else {
+			INFO("receive_smb error (%s), closing session\n",
+			     strerror(errno));
+		}
+		return false;
+	}
+
+	process_smb(in_buffer, out_buffer);
+
+	session_abort_armed = false;
+	s->last_activity = time(NULL);
+
+	return true;
+}
+
+static void session_timer_expired(void *data);
+
+/* Set the timer of the current session for its next timeout */
+static void session_set_timer(struct session *s)
+{
+	time_t when = session_next_timeout(time(NULL));
+
+	if (when == 0) {
+		reactor_timer_cancel(&s->timer);
+	} else {
+		reactor_timer_set(&s->timer, when, session_timer_expired, s);
+	}
+}
+
+/* Run the idle checks that process() does, when a session's timer fires */
+static void session_timer_expired(void *data)
+{
+	struct session *s = data;
+
+	session_switch(s);
+	if (session_timed_out(time(NULL))) {
+		end_session(s);
+	} else {
+		session_set_timer(s);
+	}
+}
+
+/* Called when the listening socket is readable in an event worker */
+static void accept_event_client(void)
+{
+	const char *peer_addr;
+	struct session *s;
+	int fd;
+
+	fd = accept_client(&peer_addr);
+	if (fd == -1) {
+		return;
+	}
+
+	/* On some systems the socket inherits O_NONBLOCK from the listening
+	   socket, but the request handlers all expect blocking I/O. */
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+	/* Once a client has started sending an SMB, we block until we have
+	   all of it, and we block sending replies until it has room for them.
+	   Put a limit on both, so that a client which stops half way or never
+	   reads its replies does not hold up everyone else sharing the worker
+	   forever; the failed read or write ends only its own session. */
+	set_socket_timeouts(fd, SMB_SECONDARY_WAIT);
+
+	s = session_new(fd, peer_addr);
+	reactor_add(fd, s);
+
+	session_switch(s);
+	session_set_timer(s);
+
+	DEBUG("new session for %s\n", peer_addr);
+}
+
+/* Main loop of an event worker process, which serves many clients at once,
+   handling SMBs from whichever ones are ready. It does not return. */
+static void event_worker(void)
+{
+	void *ready[64];
+	int i, n;
+
+	am_parent = false;
+
+	/* Write errors show up as errors from send_smb() instead */
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGCHLD, SIGNAL_CAST SIG_DFL);
 
-			/* check for connection timeouts */
-			for (i = 0; i < MAX_CONNECTIONS; i++)
-				if (OPEN_CNUM(i)) {
-					/* close dirptrs on connections that are
-					 * idle */
-					if (t - Connections[i].lastused >
-					    DPTR_IDLE_TIMEOUT)
-						dptr_idlecnum(i);
-
-					if (Connections[i].num_files_open > 0 ||
-					    t - Connections[i].lastused <
-					        DEFAULT_SMBD_TIMEOUT)
-						allidle = false;
+	close_low_fds();
+
+	fatal_exit_hook = fatal_session_error;
+
+	alloc_buffers();
+	time_init();
+
+	reactor_init();
+	reactor_add(server_socket, &server_socket);
+
+	oplock_fd = oplock_open_socket();
+	if (oplock_fd >= 0) {
+		reactor_add(oplock_fd, &oplock_fd);
+	}
+
+	while (true) {
+		stats_dump_if_requested();
+		n = reactor_wait(ready, arrlen(ready), reactor_next_timeout());
+		if (n < 0) {
+			FATAL("reactor_wait failed: %s\n", strerror(errno));
+		}
+
+		for (i = 0; i < n; i++) {
+			if (ready[i] == &server_socket) {
+				accept_event_client();
+			} else if (ready[i] == &oplock_fd) {
+				receive_oplock_message();
+			} else {
+				struct session *s = ready[i];
+
+				bool ok;
+
+				session_switch(s);
+
+				/* A nested oplock break while serving an
+				   earlier session in this batch may have
+				   already consumed what was waiting */
+				if (!recv_buffer_has_data(client_fd) &&
+				    reactor_wait_fd(client_fd, 0) <= 0) {
+					continue;
 				}
 
-			if (allidle && num_connections_open > 0) {
-				DEBUG("Closing idle connection 2\n");
-				return;
+				/* Pipelined requests may already be in the
+				   receive buffer, and the reactor will not tell
+				   us about those */
+				do {
+					ok = serve_session(s);
+				} while (ok && recv_buffer_has_data(client_fd));
+
+				if (ok) {
+					session_set_timer(s);
+				} else {
+					end_session(s);
+				}
 			}
 		}
 
-		if (got_smb)
-			process_smb(in_buffer, out_buffer);
+		reactor_run_timers();
 	}
 }
 
-/* Initialise connect, service and file structs */
-static void init_structs(void)
+/* Main loop of a preforked worker process, which accepts and serves clients
+   one at a time in the same way as the child processes forked by
+   accept_connection(). It does not return. */
+static void prefork_worker(void)
 {
+	const char *peer_addr;
+	int num_sessions = 0;
+	int fd;
+
+	am_parent = false;
+
+	signal(SIGPIPE, SIGNAL_CAST sig_pipe);
+	signal(SIGCHLD, SIGNAL_CAST SIG_DFL);
+
+	close_low_fds();
+	set_descriptive_argv();
+
+	oplock_fd = oplock_open_socket();
+
+	while (prefork_max_sessions == 0 ||
+	       num_sessions < prefork_max_sessions) {
+		fd = accept_client(&peer_addr);
+		if (fd == -1) {
+			continue;
+		}
+
+		session_switch(session_new(fd, peer_addr));
+		set_descriptive_argv();
+
+		process();
+
+		end_session(cur_session);
+		set_descriptive_argv();
+		++num_sessions;
+	}
+
+	DEBUG("served %d sessions; exiting to be replaced\n", num_sessions);
+	stats_dump();
+	exit(0);
+}
+
+/* Fork a new worker process that will accept connections on the given
+   socket. Returns the new pid, or zero if the fork failed. */
+static pid_t start_worker(int sock)
+{
+	pid_t pid = fork();
 	int i;
 
-	for (i = 0; i < MAX_CONNECTIONS; i++) {
-		Connections[i].open = false;
-		Connections[i].num_files_open = 0;
-		Connections[i].lastused = 0;
-		Connections[i].used = false;
-		Connections[i].dirpath = checked_strdup("");
-		Connections[i].connectpath = checked_strdup("");
+	if (pid < 0) {
+		ERROR("failed to fork worker: %s\n", strerror(errno));
+		return 0;
+	} else if (pid == 0) {
+		/* The other workers' sockets are not ours to accept on */
+		for (i = 0; i < num_workers; i++) {
+			if (worker_sockets[i] != sock) {
+				close(worker_sockets[i]);
+			}
+		}
+		server_socket = sock;
+
+		if (event_mode) {
+			event_worker();
+		} else {
+			prefork_worker();
+		}
+	}
+
+	DEBUG("started worker (pid %ld)\n", (long) pid);
+	return pid;
+}
+
+/* The alternative to await_connection() when running with a pool of workers:
+   start the worker processes and then wait around, replacing any of them
+   that exit. It does not return. */
+static void run_workers(void)
+{
+	pid_t *worker_pids;
+	int status;
+	pid_t pid;
+	int i;
+
+	for (i = 0; i < num_workers; i++) {
+		/* The default backlog is too small for lots of clients
+		   connecting at once when there are no forks to slow things
+		   down */
+		if (listen(worker_sockets[i], SOMAXCONN) == -1) {
+			STARTUP_ERROR("listen failed: %s\n", strerror(errno));
+		}
+
+		/* Event workers may share a socket with other workers, and
+		   the ones that lose the race to accept() must not block. */
+		if (event_mode) {
+			fcntl(worker_sockets[i], F_SETFL,
+			      fcntl(worker_sockets[i], F_GETFL) | O_NONBLOCK);
+		}
 	}
 
-	for (i = 0; i < MAX_OPEN_FILES; i++) {
-		Files[i].open = false;
-		Files[i].name = checked_strdup("");
+	/* We reap the workers ourselves below */
+	signal(SIGCHLD, SIGNAL_CAST SIG_DFL);
+
+	worker_pids = checked_calloc(num_workers, sizeof(pid_t));
+
+	while (true) {
+		for (i = 0; i < num_workers; i++) {
+			if (worker_pids[i] == 0) {
+				worker_pids[i] = start_worker(worker_sockets[i]);
+			}
+		}
+
+		pid = wait(&status);
+		if (pid < 0) {
+			if (errno == ECHILD) {
+				/* Forks are failing; wait and try again */
+				sleep(1);
+			}
+			continue;
+		}
+
+		for (i = 0; i < num_workers; i++) {
+			if (worker_pids[i] == pid) {
+				worker_pids[i] = 0;
+			}
+		}
+		stats_process_exited(pid);
+		oplock_process_exited(pid);
+
+		if (status != 0) {
+			WARNING("worker (pid %ld) exited with status=%d; "
+			        "restarting\n",
+			        (long) pid, status);
+		} else {
+			DEBUG("worker (pid %ld) exited; restarting\n",
+			      (long) pid);
+		}
 	}
+}
+
+/* Set up for tumba_replay, which feeds the SMBs from a trace through the
+   server in place of real clients. As in an event worker, a FATAL() error
+   only ends the one session. The shares must be added first. */
+void replay_init(void)
+{
+	am_parent = false;
+	fatal_exit_hook = fatal_session_error;
+	replaying = true;
+
+	time_init();
+	alloc_buffers();
+	add_ipc_service();
+	locking_init(false);
+}
 
-	for (i = 0; i < MAX_OPEN_FILES; i++) {
-		struct open_fd *fd_ptr = &FileFd[i];
-		fd_ptr->ref_count = 0;
-		fd_ptr->dev = (int32_t) -1;
-		fd_ptr->inode = (int32_t) -1;
-		fd_ptr->fd = -1;
-		fd_ptr->fd_readonly = -1;
-		fd_ptr->fd_writeonly = -1;
-		fd_ptr->real_open_flags = -1;
+/* Start a replayed session whose replies are sent to fd. */
+struct session *replay_session_new(int fd)
+{
+	return session_new(fd, "replay");
+}
+
+void replay_session_end(struct session *s)
+{
+	end_session(s);
+}
+
+/* Process one SMB from a trace as if the given session had sent it. Returns
+   false if the session had to be ended. */
+bool replay_smb(struct session *s, const char *buf, size_t len)
+{
+	session_switch(s);
+
+	if (len < 4 || len > LARGE_BUFFER_SIZE + 4) {
+		ERROR("Invalid packet length! (%d bytes).\n", (int) len);
+		return false;
+	}
+
+	memcpy(in_buffer, buf, len);
+	if (len < smb_size + 100) {
+		bzero(in_buffer + len, smb_size + 100 - len);
+	}
+
+	if (sigsetjmp(session_abort, 1) != 0) {
+		session_abort_armed = false;
+		return false;
 	}
+	session_abort_armed = true;
 
-	init_dptrs();
+	process_smb(in_buffer, out_buffer);
+
+	session_abort_armed = false;
+	return true;
 }
 
 static void usage(void)
@@ -2752,21 +4432,36 @@ static void usage(void)
 	       " [-a]"
 	       " [-b address]"
 	       " [-d level]"
+	       " [-e workers]"
+	       " [-f workers]"
 	       " [-l filename]"
+	       " [-m files]"
 	       " [-p port]"
+	       " [-r sessions]"
+	       " [-t filename]"
 	       "\n"
 	       "                  <path> [paths...]\n\n"
 	       "  -a            allow connections from any address\n"
 	       "  -b address    address to bind socket (default 0.0.0.0)\n"
 	       "  -d level      set the logging level (0-4; default 2)\n"
+	       "  -e workers    serve clients from a pool of event-driven\n"
+	       "                worker processes instead of forking\n"
+	       "  -f workers    prefork a pool of worker processes to\n"
+	       "                accept connections\n"
 	       "  -l filename   path to debug log file, or '-' for stdout\n"
+	       "  -m files      maximum number of files each client may\n"
+	       "                have open (default %d)\n"
 	       "  -p port       listen on the specified port (default %d)\n"
+	       "  -r sessions   replace each preforked worker after it has\n"
+	       "                served this many clients (default %d)\n"
+	       "  -t filename   capture the SMBs that clients send to a trace\n"
+	       "                file, to be replayed with tumba_replay\n"
 	       "\n"
 	       "You must specify at least one path to a directory to share.\n",
-	       SMB_PORT);
+	       DEFAULT_MAX_OPEN_FILES, SMB_PORT, DEFAULT_PREFORK_MAX_SESSIONS);
 }
 
-int main(int argc, char *argv[])
+int server_main(int argc, char *argv[])
 {
 	int port = SMB_PORT;
 	int opt;
@@ -2783,12 +4478,13 @@ int main(int argc, char *argv[])
 	init_dos_char_table();
 
 	signal(SIGTERM, SIGNAL_CAST dflt_sig);
+	signal(SIGUSR1, SIGNAL_CAST sig_usr1);
 
 	original_argv0 = checked_strdup(argv[0]);
 	original_argc = argc;
 	original_argv = argv;
 
-	while ((opt = getopt(argc, argv, "b:l:d:p:haW:")) != EOF) {
+	while ((opt = getopt(argc, argv, "b:l:d:p:e:f:m:r:t:haW:")) != EOF) {
 		switch (opt) {
 		case 'a':
 			allow_public_connections = true;
@@ -2805,6 +4501,37 @@ int main(int argc, char *argv[])
 		case 'p':
 			port = atoi(optarg);
 			break;
+		case 'e':
+		case 'f':
+			num_workers = atoi(optarg);
+			event_mode = opt == 'e';
+			if (num_workers <= 0) {
+				usage();
+				exit(1);
+			}
+			break;
+		case 'm':
+			/* file numbers are 16 bits and 0 is never used */
+			max_open_files = atoi(optarg) + 1;
+			if (max_open_files < 2 || max_open_files > 0x10000) {
+				usage();
+				exit(1);
+			}
+			break;
+		case 'r':
+			prefork_max_sessions = atoi(optarg);
+			if (prefork_max_sessions < 0) {
+				usage();
+				exit(1);
+			}
+			break;
+		case 't':
+			if (!trace_open(optarg)) {
+				STARTUP_ERROR("failed to open trace file %s: "
+				              "%s\n",
+				              optarg, strerror(errno));
+			}
+			break;
 		case 'h':
 			usage();
 			exit(0);
@@ -2834,7 +4561,11 @@ int main(int argc, char *argv[])
 
 	NOTICE("%s smbd version %s started\n", PACKAGE_NAME, PACKAGE_VERSION);
 
-	init_structs();
+	if (!locking_init(event_mode)) {
+		WARNING("OFD locks are not available; byte range locks will "
+		        "not be enforced between clients served by the same "
+		        "worker process\n");
+	}
 
 	signal(SIGHUP, SIGNAL_CAST sig_hup);
 
@@ -2844,7 +4575,14 @@ int main(int argc, char *argv[])
 
 	open_sockets(port);
 	drop_privileges();
-	await_connection();
+	stats_segment_create(port);
+	oplock_table_create();
+
+	if (num_workers > 0) {
+		run_workers();
+	} else {
+		await_connection();
+	}
 
 	return 0;
 }
@@ -19,6 +19,7 @@
 #include "strfunc.h"
 
 struct service_connection;
+struct session;
 struct stat;
 struct open_file;
 
@@ -29,9 +30,9 @@ struct open_file;
 /* set these to define the limits of the server. NOTE These are on a
    per-client basis. Thus any one machine can't connect to more than
    MAX_CONNECTIONS services, but any number of machines may connect at
-   one time. */
-#define MAX_CONNECTIONS 127
-#define MAX_OPEN_FILES  100
+   one time. The file limit can be changed on the command line. */
+#define MAX_CONNECTIONS        127
+#define DEFAULT_MAX_OPEN_FILES 100
 
 /* Macro to cache an error in a struct bmpx_data */
 #define CACHE_ERROR_CODE(w, c, e)                                              \
@@ -51,7 +52,7 @@ struct open_file;
 	unix_error_packet(inbuf, outbuf, defclass, deferror, __LINE__)
 
 /* these are useful macros for checking validity of handles */
-#define VALID_FNUM(fnum) (((fnum) >= 0) && ((fnum) < MAX_OPEN_FILES))
+#define VALID_FNUM(fnum) (((fnum) >= 0) && ((fnum) < num_file_slots))
 #define OPEN_FNUM(fnum)  (VALID_FNUM(fnum) && Files[fnum].open)
 #define VALID_CNUM(cnum) (((cnum) >= 0) && ((cnum) < MAX_CONNECTIONS))
 #define OPEN_CNUM(cnum)  (VALID_CNUM(cnum) && Connections[cnum].open)
@@ -73,12 +74,16 @@ struct open_file;
 /* translates a connection number into a service number */
 #define CONN_SHARE(cnum) (Connections[cnum].share)
 
+/* the directory that a connection's paths are relative to */
+#define CONN_ROOT(cnum) (Connections[cnum].root_fd)
+
 /* access various service details */
 #define CAN_WRITE(cnum) (OPEN_CNUM(cnum) && !Connections[cnum].read_only)
 
 /* Structure used to indirect fd's from the struct open_file. Needed as POSIX
  * locking is based on file and process, not file descriptor and process. */
 struct open_fd {
+	struct open_fd *next; /* hash chain */
 	uint16_t ref_count;
 	uint32_t dev;
 	uint32_t inode;
@@ -100,8 +105,8 @@ struct bmpx_data {
 struct open_file {
 	int cnum;
 	struct open_fd *fd_ptr;
-	int pos;
-	uint32_t size;
+	off_t pos;
+	off_t size;
 	int mode;
 	struct bmpx_data *wbmpx_ptr;
 	bool open;
@@ -111,7 +116,17 @@ struct open_file {
 	bool share_mode;
 	bool modified;
 	bool reserved;
+	bool on_free_list;
+	int next_free;
 	char *name;
+	int oplock;             /* NO_OPLOCK, EXCLUSIVE_OPLOCK etc. */
+	int oplock_entry;       /* in the oplock table; see oplock_add() */
+	int oplock_break_level; /* while the client is breaking its oplock */
+
+	/* For spotting when the client is reading through the file */
+	off_t next_read;      /* where the next read starts if sequential */
+	int sequential_reads; /* how many in a row have been */
+	off_t readahead_end;  /* how far the kernel has been asked to read */
 };
 
 struct service_connection {
@@ -121,6 +136,7 @@ struct service_connection {
 	bool read_only;
 	char *dirpath;
 	char *connectpath;
+	int root_fd; /* the share's top directory */
 
 	time_t lastused;
 	bool used;
@@ -129,9 +145,13 @@ struct service_connection {
 
 extern const char *workgroup;
 extern int chain_fnum;
+extern int pending_write_data;
 extern int max_send;
-extern struct open_file Files[];
-extern struct service_connection Connections[];
+extern bool done_sesssetup;
+extern uint32_t client_capabilities;
+extern struct open_file *Files;
+extern int num_file_slots;
+extern struct service_connection *Connections;
 
 /* Integers used to override error codes.  */
 extern int unix_ERR_class;
@@ -139,6 +159,7 @@ extern int unix_ERR_code;
 
 mode_t unix_mode(int cnum, int dosmode);
 int dos_mode(int cnum, const char *path, struct stat *sbuf);
+int dos_mode_at(int cnum, int dirfd, const char *path, struct stat *sbuf);
 int dos_chmod(int cnum, const char *fname, int dosmode, struct stat *st);
 bool set_filetime(int cnum, const char *fname, time_t mtime);
 bool unix_convert(char *name, int cnum, pstring saved_last_component,
@@ -147,10 +168,13 @@ int sys_disk_free(const char *path, int *bsize, int *dfree, int *dsize);
 bool check_name(const char *name, int cnum);
 void close_file(int fnum, bool normal_close);
 void open_file_shared(int fnum, int cnum, const char *fname, int share_mode,
-                      int ofun, int mode, int *access, int *action);
-int seek_file(int fnum, uint32_t pos);
-int read_file(int fnum, char *data, uint32_t pos, int n);
-int write_file(int fnum, char *data, int n);
+                      int ofun, int mode, int oplock_request, int *access,
+                      int *action);
+void release_oplock(int fnum, int level);
+int read_file(int fnum, char *data, off_t pos, int n);
+void send_file_data(int fnum, char *header, int headlen, off_t pos, int n);
+int write_file(int fnum, char *data, off_t pos, int n);
+int receive_file_data(int fnum, off_t pos, int n);
 int cached_error_packet(char *inbuf, char *outbuf, int fnum, int line);
 int unix_error_packet(char *inbuf, char *outbuf, int def_class,
                       uint32_t def_code, int line);
@@ -159,7 +183,13 @@ int error_packet(char *inbuf, char *outbuf, int error_class,
 bool receive_next_smb(int smbfd, char *inbuf, int bufsize, int timeout);
 int make_connection(char *service, char *dev);
 int find_free_file(void);
+void release_file(int fnum);
 void close_cnum(int cnum);
 void exit_server(const char *reason);
 char *smb_fn_name(int type);
 int chain_reply(char *inbuf, char *outbuf, size_t inbuf_len, size_t outbuf_len);
+void replay_init(void);
+struct session *replay_session_new(int fd);
+void replay_session_end(struct session *s);
+bool replay_smb(struct session *s, const char *buf, size_t len);
+int server_main(int argc, char *argv[]);
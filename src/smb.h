@@ -19,6 +19,12 @@
 
 #define BUFFER_SIZE (0xFFFF)
 
+/* The largest SMB that a NetBIOS session message can carry, since its length
+   field has 17 bits. Only SMBreadX and SMBwriteX requests from clients that
+   negotiated CAP_LARGE_READX or CAP_LARGE_WRITEX get bigger than BUFFER_SIZE.
+ */
+#define LARGE_BUFFER_SIZE (0x1FFFF)
+
 #define PTR_DIFF(p1, p2) ((ptrdiff_t) (((char *) (p1)) - (char *) (p2)))
 
 /* how long to wait for secondary SMB packets (milli-seconds) */
@@ -410,6 +416,7 @@ implemented */
 #define CAP_NT_FIND          0x0200
 #define CAP_DFS              0x1000
 #define CAP_LARGE_READX      0x4000
+#define CAP_LARGE_WRITEX     0x8000
 
 /* protocol types. It assumes that higher protocols include lower protocols
    as subsets */
@@ -429,6 +436,38 @@ enum protocol_types {
 #define SMB_LKOFF_OFFSET(indx) (2 + (10 * (indx)))
 #define SMB_LKLEN_OFFSET(indx) (6 + (10 * (indx)))
 
+/* The same with LOCKING_ANDX_LARGE_FILES, where each range has 64-bit
+   offset and length fields, each stored as the high word and then the low
+   word. */
+#define SMB_LARGE_LKOFF_OFFSET_HIGH(indx) (4 + (20 * (indx)))
+#define SMB_LARGE_LKOFF_OFFSET_LOW(indx)  (8 + (20 * (indx)))
+#define SMB_LARGE_LKLEN_OFFSET_HIGH(indx) (12 + (20 * (indx)))
+#define SMB_LARGE_LKLEN_OFFSET_LOW(indx)  (16 + (20 * (indx)))
+
+/* Bits of the LockType byte of an SMBlockingX */
+#define LOCKING_ANDX_OPLOCK_RELEASE 0x2
+#define LOCKING_ANDX_LARGE_FILES    0x10
+
+/* Types of oplock that a client can hold on a file */
+#define NO_OPLOCK        0
+#define EXCLUSIVE_OPLOCK 1
+#define BATCH_OPLOCK     2
+#define LEVEL_II_OPLOCK  4
+
+/* An oplock is requested with bits in smb_flg for the core open and create
+   commands, or in the flags word of SMBopenX and TRANSACT2_OPEN. Either way,
+   the first bit asks for an oplock and the second makes it a batch one. */
+#define CORE_OPLOCK_REQUEST(inbuf) ((CVAL(inbuf, smb_flg) >> 5) & 3)
+#define EXTENDED_OPLOCK_REQUEST(flags) (((flags) >> 1) & 3)
+
+/* ...and granted with these bits in smb_flg and the action word */
+#define CORE_OPLOCK_GRANTED     (1 << 5)
+#define EXTENDED_OPLOCK_GRANTED (1 << 15)
+
+/* The level that a client is told to break an oplock down to */
+#define OPLOCKLEVEL_NONE 0
+#define OPLOCKLEVEL_II   1
+
 #define ROUNDUP(x, g) (((x) + ((g) - 1)) & ~((g) - 1))
 
 /* Global value meaing that the smb_uid field should be ignored
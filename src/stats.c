@@ -0,0 +1,342 @@
+/*
+ * Copyright (c) 2025-2026 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* Counters and latency histograms for each SMB command, so that we can see
+   which ones dominate a real workload. Timing a request costs two calls to
+   clock_gettime(), which is cheap enough to leave on all the time. The
+   tables are dumped to the log on SIGUSR1 and when the process exits.
+
+   The server's processes also share a memory segment, created before any of
+   them are forked, where they add to a set of server-wide totals and publish
+   what each client session is doing. tumba_stat reads it to show the live
+   state of the server. */
+
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "guards.h" /* IWYU pragma: keep */
+#include "server.h"
+#include "stattable.h"
+#include "strfunc.h"
+#include "util.h"
+
+/* syslog truncates long messages, so histograms are split across lines. */
+#define MAX_LINE_LEN 200
+
+/* Several processes add to the totals in the shared segment at once */
+#define SHARED_ADD(x, n) __atomic_fetch_add(&(x), (n), __ATOMIC_RELAXED)
+
+/* Just for this process */
+static struct server_stats local_stats;
+
+static struct stats_segment *segment;
+static char segment_name[32];
+static struct session_stats *cur_session_stats;
+
+static struct timespec request_start;
+static uint64_t bytes_sent;
+static uint64_t request_start_sent;
+static volatile sig_atomic_t dump_requested;
+
+/* Create the shared segment; called before the server forks any processes.
+   The server carries on without it if it cannot be created. */
+void stats_segment_create(int port)
+{
+	int fd, i;
+
+	snprintf(segment_name, sizeof(segment_name), STATS_SEGMENT_NAME, port);
+
+	/* A segment left behind by a server that crashed is replaced. One
+	   created by anyone else cannot be unlinked, and since they could
+	   still resize or write to it, we do without rather than use it. */
+	shm_unlink(segment_name);
+	fd = shm_open(segment_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		WARNING("failed to create stats segment %s: %s\n",
+		        segment_name, strerror(errno));
+		return;
+	}
+
+	if (ftruncate(fd, sizeof(struct stats_segment)) != 0) {
+		WARNING("failed to size stats segment %s: %s\n",
+		        segment_name, strerror(errno));
+		close(fd);
+		shm_unlink(segment_name);
+		return;
+	}
+
+	segment = mmap(NULL, sizeof(struct stats_segment),
+	               PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (segment == MAP_FAILED) {
+		WARNING("failed to map stats segment %s: %s\n", segment_name,
+		        strerror(errno));
+		segment = NULL;
+		shm_unlink(segment_name);
+		return;
+	}
+
+	memset(segment, 0, sizeof(struct stats_segment));
+	segment->version = STATS_SEGMENT_VERSION;
+	segment->server_pid = getpid();
+	segment->start_time = time(NULL);
+	for (i = 0; i < 256; i++) {
+		strlcpy(segment->command_names[i], smb_fn_name(i),
+		        sizeof(segment->command_names[i]));
+	}
+
+	/* set last, since tumba_stat checks it to see that we are ready */
+	segment->magic = STATS_SEGMENT_MAGIC;
+
+	DEBUG("created stats segment %s\n", segment_name);
+}
+
+/* Called when the server's main process exits. */
+void stats_segment_remove(void)
+{
+	if (segment != NULL) {
+		shm_unlink(segment_name);
+	}
+}
+
+/* Claim a slot in the shared segment for a new session. Returns NULL if
+   there is no segment or all the slots are taken. */
+struct session_stats *stats_session_new(const char *addr)
+{
+	struct session_stats *ss;
+	pid_t pid = getpid();
+	pid_t zero;
+	int i;
+
+	if (segment == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < STATS_MAX_SESSIONS; i++) {
+		ss = &segment->sessions[i];
+		zero = 0;
+		if (__atomic_compare_exchange_n(&ss->pid, &zero, pid, false,
+		                                __ATOMIC_ACQUIRE,
+		                                __ATOMIC_RELAXED)) {
+			strlcpy(ss->addr, addr, sizeof(ss->addr));
+			ss->start_time = ss->last_activity = time(NULL);
+			ss->current_command = -1;
+			ss->open_files = 0;
+			ss->requests = ss->bytes_in = ss->bytes_out = 0;
+			return ss;
+		}
+	}
+
+	DEBUG("no free stats slot for session from %s\n", addr);
+	return NULL;
+}
+
+/* Make the given session's slot the one that requests are counted against. */
+void stats_session_select(struct session_stats *ss)
+{
+	cur_session_stats = ss;
+}
+
+void stats_session_free(struct session_stats *ss)
+{
+	if (ss == NULL) {
+		return;
+	}
+	if (cur_session_stats == ss) {
+		cur_session_stats = NULL;
+	}
+	__atomic_store_n(&ss->pid, 0, __ATOMIC_RELEASE);
+}
+
+/* Called by the main process when one of its children exits, to free any
+   slots it did not get the chance to free itself. */
+void stats_process_exited(pid_t pid)
+{
+	int i;
+
+	if (segment == NULL) {
+		return;
+	}
+
+	for (i = 0; i < STATS_MAX_SESSIONS; i++) {
+		if (segment->sessions[i].pid == pid) {
+			segment->sessions[i].pid = 0;
+		}
+	}
+}
+
+/* Called as files are opened (positive delta) and closed. */
+void stats_open_files(int delta)
+{
+	if (cur_session_stats != NULL) {
+		cur_session_stats->open_files += delta;
+	}
+}
+
+/* Called before a request with the given command is processed. */
+void stats_begin(int type)
+{
+	clock_gettime(CLOCK_MONOTONIC, &request_start);
+	request_start_sent = bytes_sent;
+
+	if (cur_session_stats != NULL) {
+		cur_session_stats->current_command = type & 0xff;
+	}
+}
+
+/* Called once the reply to a request has been sent; type is the command of
+   the request and bytes_in its total length. */
+void stats_end(int type, size_t bytes_in)
+{
+	struct command_stats *cs = &local_stats.commands[type & 0xff];
+	struct session_stats *ss = cur_session_stats;
+	struct timespec now;
+	uint64_t usec, bytes_out = bytes_sent - request_start_sent;
+	int bucket;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usec = (uint64_t) (now.tv_sec - request_start.tv_sec) * 1000000 +
+	       (now.tv_nsec - request_start.tv_nsec) / 1000;
+
+	bucket = stats_usec_bucket(usec);
+
+	++cs->count;
+	cs->bytes_in += bytes_in;
+	cs->bytes_out += bytes_out;
+	cs->usec_total += usec;
+	++cs->usec_hist[bucket];
+
+	if (segment != NULL) {
+		cs = &segment->totals.commands[type & 0xff];
+		SHARED_ADD(cs->count, 1);
+		SHARED_ADD(cs->bytes_in, bytes_in);
+		SHARED_ADD(cs->bytes_out, bytes_out);
+		SHARED_ADD(cs->usec_total, usec);
+		SHARED_ADD(cs->usec_hist[bucket], 1);
+	}
+
+	if (ss != NULL) {
+		ss->current_command = -1;
+		ss->last_activity = time(NULL);
+		++ss->requests;
+		ss->bytes_in += bytes_in;
+		ss->bytes_out += bytes_out;
+	}
+}
+
+/* Save the state of the current session's request, before processing others
+   in the middle of it. */
+void stats_save(struct stats_request_state *st)
+{
+	st->start = request_start;
+	st->start_sent = request_start_sent;
+	st->sent = bytes_sent;
+	st->current_command = -1;
+	if (cur_session_stats != NULL) {
+		st->current_command = cur_session_stats->current_command;
+	}
+}
+
+/* Go back to the request saved by stats_save(). Whatever was sent in the
+   meantime is not counted as part of it. */
+void stats_restore(const struct stats_request_state *st)
+{
+	request_start = st->start;
+	request_start_sent = st->start_sent + (bytes_sent - st->sent);
+	if (cur_session_stats != NULL) {
+		cur_session_stats->current_command = st->current_command;
+	}
+}
+
+/* Called for everything written to the client socket. */
+void stats_count_sent(size_t len)
+{
+	bytes_sent += len;
+}
+
+/* Called from the SIGUSR1 handler; the dump itself happens later, from the
+   main loop, since it is not safe to log from inside a signal handler. */
+void stats_request_dump(void)
+{
+	dump_requested = 1;
+}
+
+void stats_dump_if_requested(void)
+{
+	if (dump_requested) {
+		dump_requested = 0;
+		stats_dump();
+	}
+}
+
+static void dump_histogram(int type, const struct command_stats *cs)
+{
+	char line[MAX_LINE_LEN + 32];
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < STATS_HIST_BUCKETS; i++) {
+		if (cs->usec_hist[i] == 0) {
+			continue;
+		}
+		len += snprintf(line + len, sizeof(line) - len,
+		                " %" PRIu64 ":%u", STATS_BUCKET_START(i),
+		                cs->usec_hist[i]);
+		if (len > MAX_LINE_LEN) {
+			NOTICE("stats: 0x%02x %s usec_hist%s\n", type,
+			       smb_fn_name(type), line);
+			len = 0;
+		}
+	}
+
+	if (len > 0) {
+		NOTICE("stats: 0x%02x %s usec_hist%s\n", type,
+		       smb_fn_name(type), line);
+	}
+}
+
+/* Write the stats for every command that has been seen to the log: a line
+   of counters for each command, followed by its latency histogram as pairs
+   of the start of each bucket in microseconds and its count. Every line
+   starts with "stats:" and the command code and name. */
+void stats_dump(void)
+{
+	const struct command_stats *cs;
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		cs = &local_stats.commands[i];
+		if (cs->count == 0) {
+			continue;
+		}
+		NOTICE("stats: 0x%02x %s count=%" PRIu64 " bytes_in=%" PRIu64
+		       " bytes_out=%" PRIu64 " usec_total=%" PRIu64 "\n",
+		       i, smb_fn_name(i), cs->count, cs->bytes_in,
+		       cs->bytes_out, cs->usec_total);
+		dump_histogram(i, cs);
+	}
+}
+
+/* The stats for just this process. */
+const struct server_stats *stats_local(void)
+{
+	return &local_stats;
+}
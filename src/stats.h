@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2025-2026 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* Latencies are counted in a log-linear histogram: each power of two
+   microseconds is split into four buckets, with the last one also counting
+   anything slower than it. */
+#define STATS_HIST_BUCKETS 96
+
+/* The smallest latency (in microseconds) counted in the given bucket. */
+#define STATS_BUCKET_START(b)                                                  \
+	((b) < 4 ? (uint64_t) (b)                                              \
+	         : (uint64_t) (4 + ((b) & 3)) << (((b) >> 2) - 1))
+
+/* The segment shared between all the server's processes is named after the
+   port that it listens on, so that tumba_stat can find it. */
+#define STATS_SEGMENT_NAME    "/tumba_smbd.%d"
+#define STATS_SEGMENT_MAGIC   0x54554d42 /* "TUMB" */
+#define STATS_SEGMENT_VERSION 1
+#define STATS_MAX_SESSIONS    256
+
+struct command_stats {
+	uint64_t count;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t usec_total;
+	uint32_t usec_hist[STATS_HIST_BUCKETS];
+};
+
+struct server_stats {
+	struct command_stats commands[256];
+};
+
+/* One of these is claimed by each client session while it is connected. */
+struct session_stats {
+	pid_t pid; /* serving process, or zero if the slot is free */
+	char addr[32];
+	time_t start_time;
+	time_t last_activity;
+	int32_t current_command; /* -1 between requests */
+	int32_t open_files;
+	uint64_t requests;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+};
+
+/* What stats_begin() records about the request being processed, saved
+   while other requests are processed in the middle of it */
+struct stats_request_state {
+	struct timespec start;
+	uint64_t start_sent, sent;
+	int32_t current_command;
+};
+
+struct stats_segment {
+	uint32_t magic;
+	uint32_t version;
+	pid_t server_pid;
+	time_t start_time;
+	char command_names[256][24];
+	struct server_stats totals; /* summed over all processes */
+	struct session_stats sessions[STATS_MAX_SESSIONS];
+};
+
+void stats_segment_create(int port);
+void stats_segment_remove(void);
+struct session_stats *stats_session_new(const char *addr);
+void stats_session_select(struct session_stats *ss);
+void stats_session_free(struct session_stats *ss);
+void stats_process_exited(pid_t pid);
+void stats_open_files(int delta);
+void stats_begin(int type);
+void stats_end(int type, size_t bytes_in);
+void stats_save(struct stats_request_state *st);
+void stats_restore(const struct stats_request_state *st);
+void stats_count_sent(size_t len);
+void stats_request_dump(void);
+void stats_dump_if_requested(void);
+void stats_dump(void);
+const struct server_stats *stats_local(void);
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2025-2026 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* The parts of the stats code that do not depend on the rest of the server,
+   so that the tools that collect and show stats can use them too. */
+
+#include "stattable.h"
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "guards.h" /* IWYU pragma: keep */
+#include "stats.h"
+
+/* The histogram bucket that the given latency is counted in. */
+int stats_usec_bucket(uint64_t usec)
+{
+	int msb = 2;
+
+	if (usec < 4) {
+		return (int) usec;
+	}
+	while (msb < 63 && (usec >> (msb + 1)) != 0) {
+		++msb;
+	}
+	if (msb > STATS_HIST_BUCKETS / 4) {
+		return STATS_HIST_BUCKETS - 1;
+	}
+
+	return ((msb - 1) << 2) + (int) ((usec >> (msb - 2)) & 3);
+}
+
+/* The latency below which the given fraction of commands completed, to the
+   resolution of the histogram. */
+uint64_t stats_percentile(const struct command_stats *cs, double fraction)
+{
+	uint64_t target = (uint64_t) (cs->count * fraction), seen = 0;
+	int i;
+
+	for (i = 0; i < STATS_HIST_BUCKETS; i++) {
+		seen += cs->usec_hist[i];
+		if (seen > target) {
+			return STATS_BUCKET_START(i);
+		}
+	}
+
+	return STATS_BUCKET_START(STATS_HIST_BUCKETS - 1);
+}
+
+/* Print a table of the commands that have been used at least once. */
+void stats_print_table(const struct server_stats *st,
+                       const char *(*command_name)(int type))
+{
+	const struct command_stats *cs;
+	int i;
+
+	printf("%-16s %10s %12s %12s %9s %9s %9s\n", "COMMAND", "COUNT",
+	       "BYTES IN", "BYTES OUT", "AVG(us)", "P50(us)", "P99(us)");
+
+	for (i = 0; i < 256; i++) {
+		cs = &st->commands[i];
+		if (cs->count == 0) {
+			continue;
+		}
+		printf("%-16s %10" PRIu64 " %12" PRIu64 " %12" PRIu64
+		       " %9" PRIu64 " %9" PRIu64 " %9" PRIu64 "\n",
+		       command_name(i), cs->count, cs->bytes_in, cs->bytes_out,
+		       cs->usec_total / cs->count, stats_percentile(cs, 0.5),
+		       stats_percentile(cs, 0.99));
+	}
+}
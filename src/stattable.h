@@ -0,0 +1,19 @@
+/*
+ * Copyright (c) 2025-2026 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdint.h>
+
+struct command_stats;
+struct server_stats;
+
+int stats_usec_bucket(uint64_t usec);
+uint64_t stats_percentile(const struct command_stats *cs, double fraction);
+void stats_print_table(const struct server_stats *st,
+                       const char *(*command_name)(int type));
@@ -11,15 +11,30 @@
 
 #include "system.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
 #include <utime.h>
 
+#ifdef linux
+#include <linux/openat2.h>
+#include <sys/syscall.h>
+#endif
+
 #include "guards.h" /* IWYU pragma: keep */
 
-/* Now for utime() */
-int sys_utime(const char *fname, struct utimbuf *times)
+/* Now for utime(); fname is relative to the directory dirfd */
+int sys_utime(int dirfd, const char *fname, struct utimbuf *times)
 {
+	struct timespec ts[2];
+
 	/* if the modtime is 0 or -1 then ignore the call and
 	   return success */
 	if (times->modtime == (time_t) 0 || times->modtime == (time_t) -1)
@@ -29,7 +44,12 @@ int sys_utime(const char *fname, struct utimbuf *times)
 	if (times->actime == (time_t) 0 || times->actime == (time_t) -1)
 		times->actime = times->modtime;
 
-	return utime(fname, times);
+	ts[0].tv_sec = times->actime;
+	ts[0].tv_nsec = 0;
+	ts[1].tv_sec = times->modtime;
+	ts[1].tv_nsec = 0;
+
+	return utimensat(dirfd, fname, ts, 0);
 }
 
 /* xattrs are system-specific: */
@@ -91,7 +111,6 @@ ssize_t sys_setxattr(const char *path, const char *name, void *value,
 
 #else
 
-#include <errno.h>
 #warning No xattr support - DOS a/h/s file attributes will not be preserved!
 
 /* Different OSes have different versions of getxattr */
@@ -111,3 +130,147 @@ ssize_t sys_setxattr(const char *path, const char *name, void *value,
 }
 
 #endif
+
+/* The working directory is only opened to get back to it, which needs no
+   permission to read it */
+#if defined(O_PATH)
+#define CWD_FLAGS (O_PATH | O_DIRECTORY)
+#elif defined(O_SEARCH)
+#define CWD_FLAGS (O_SEARCH | O_DIRECTORY)
+#else
+#define CWD_FLAGS (O_RDONLY | O_DIRECTORY)
+#endif
+
+/* Change into the directory dirfd, for calls that have no version taking a
+   path relative to it. Opening the file instead would need permission to
+   read it. Returns a descriptor to pass to leave_dir() to change back, or
+   -1 on failure. */
+static int enter_dir(int dirfd)
+{
+	int cwd = open(".", CWD_FLAGS);
+	int saved_errno;
+
+	if (cwd < 0) {
+		return -1;
+	}
+	if (fchdir(dirfd) != 0) {
+		saved_errno = errno;
+		close(cwd);
+		errno = saved_errno;
+		return -1;
+	}
+
+	return cwd;
+}
+
+static void leave_dir(int cwd)
+{
+	int saved_errno = errno;
+
+	if (fchdir(cwd) != 0) {
+		/* nothing uses the working directory but the calls above */
+	}
+	close(cwd);
+	errno = saved_errno;
+}
+
+/* Like sys_getxattr(), but path is relative to the directory dirfd (which
+   can be AT_FDCWD), so that the directory's own path is not looked up
+   again for every file in it. */
+ssize_t sys_getxattrat(int dirfd, const char *path, const char *name,
+                       void *value, size_t size)
+{
+	ssize_t result;
+	int cwd;
+
+	if (dirfd == AT_FDCWD || path[0] == '/') {
+		return sys_getxattr(path, name, value, size);
+	}
+
+#ifdef linux
+	{
+		/* There is no getxattrat(), but the kernel can go straight
+		   to the directory through its entry in /proc */
+		char procpath[PATH_MAX];
+
+		snprintf(procpath, sizeof(procpath), "/proc/self/fd/%d/%s",
+		         dirfd, path);
+		result = getxattr(procpath, name, value, size);
+		if (result >= 0 || errno != ENOENT) {
+			return result;
+		}
+		/* /proc might not be mounted; fall through */
+	}
+#endif
+
+	cwd = enter_dir(dirfd);
+	if (cwd < 0) {
+		return -1;
+	}
+	result = sys_getxattr(path, name, value, size);
+	leave_dir(cwd);
+
+	return result;
+}
+
+/* Like sys_setxattr(), but path is relative to the directory dirfd */
+ssize_t sys_setxattrat(int dirfd, const char *path, const char *name,
+                       void *value, size_t size)
+{
+	ssize_t result;
+	int cwd;
+
+	if (dirfd == AT_FDCWD || path[0] == '/') {
+		return sys_setxattr(path, name, value, size);
+	}
+
+#ifdef linux
+	{
+		char procpath[PATH_MAX];
+
+		snprintf(procpath, sizeof(procpath), "/proc/self/fd/%d/%s",
+		         dirfd, path);
+		result = setxattr(procpath, name, value, size, 0);
+		if (result >= 0 || errno != ENOENT) {
+			return result;
+		}
+		/* /proc might not be mounted; fall through */
+	}
+#endif
+
+	cwd = enter_dir(dirfd);
+	if (cwd < 0) {
+		return -1;
+	}
+	result = sys_setxattr(path, name, value, size);
+	leave_dir(cwd);
+
+	return result;
+}
+
+/* Open path relative to the directory dirfd, failing with EXDEV if looking
+   it up would take us outside of that directory, whether through "..", an
+   absolute path or a symlink. Fails with ENOSYS if the OS can't do this. */
+int sys_open_beneath(int dirfd, const char *path, int flags)
+{
+#if defined(linux) && defined(SYS_openat2)
+	struct open_how how;
+
+	memset(&how, 0, sizeof(how));
+	how.flags = flags;
+	how.resolve = RESOLVE_BENEATH;
+
+	return syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+#elif defined(O_RESOLVE_BENEATH)
+	int fd = openat(dirfd, path, flags | O_RESOLVE_BENEATH);
+
+	if (fd < 0 && errno == ENOTCAPABLE) {
+		errno = EXDEV;
+	}
+
+	return fd;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
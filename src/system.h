@@ -14,8 +14,13 @@
 
 struct utimbuf;
 
-int sys_utime(const char *fname, struct utimbuf *times);
+int sys_utime(int dirfd, const char *fname, struct utimbuf *times);
 ssize_t sys_getxattr(const char *path, const char *name, void *value,
                      size_t size);
+ssize_t sys_getxattrat(int dirfd, const char *path, const char *name,
+                       void *value, size_t size);
 ssize_t sys_setxattr(const char *path, const char *name, void *value,
                      size_t size);
+ssize_t sys_setxattrat(int dirfd, const char *path, const char *name,
+                       void *value, size_t size);
+int sys_open_beneath(int dirfd, const char *path, int flags);
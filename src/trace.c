@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2025-2026 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* Capture of the SMBs that clients send us, so that a workload can be
+   replayed later by tumba_replay. All of the server's processes append to
+   the same file; each record is written with a single writev() to a file
+   opened with O_APPEND so that records from different processes do not get
+   mixed up with each other. */
+
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "guards.h" /* IWYU pragma: keep */
+#include "util.h"
+
+static int trace_fd = -1;
+static uint32_t trace_pid;
+static uint32_t num_sessions;
+
+/* Start capturing to the given file, appending if it already exists. */
+bool trace_open(const char *filename)
+{
+	struct trace_header hdr;
+	struct stat st;
+
+	/* the SMBs include the contents of files written by clients */
+	trace_fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0600);
+	if (trace_fd < 0) {
+		return false;
+	}
+
+	if (fstat(trace_fd, &st) == 0 && st.st_size == 0) {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+		hdr.version = TRACE_VERSION;
+		if (write(trace_fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+			close(trace_fd);
+			trace_fd = -1;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool trace_enabled(void)
+{
+	return trace_fd >= 0;
+}
+
+/* Returns an identifier for a new session, which is unique within the
+   process that calls it. */
+uint32_t trace_new_session(void)
+{
+	trace_pid = getpid();
+	return num_sessions++;
+}
+
+static void write_record(uint32_t session, const char *buf, size_t len)
+{
+	struct trace_record rec;
+	struct timeval tv;
+	struct iovec iov[2];
+
+	gettimeofday(&tv, NULL);
+	memset(&rec, 0, sizeof(rec));
+	rec.usec = (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+	rec.pid = trace_pid;
+	rec.session = session;
+	rec.len = len;
+
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof(rec);
+	iov[1].iov_base = (char *) buf;
+	iov[1].iov_len = len;
+
+	if (writev(trace_fd, iov, 2) != (ssize_t) (sizeof(rec) + len)) {
+		ERROR("failed to write to trace file, stopping capture: %s\n",
+		      strerror(errno));
+		close(trace_fd);
+		trace_fd = -1;
+	}
+}
+
+/* Record an SMB received by the given session. */
+void trace_smb(uint32_t session, const char *buf, size_t len)
+{
+	if (trace_fd >= 0 && len > 0) {
+		write_record(session, buf, len);
+	}
+}
+
+void trace_end_session(uint32_t session)
+{
+	if (trace_fd >= 0) {
+		write_record(session, NULL, 0);
+	}
+}
+
+/* Read a whole trace file into memory. */
+bool trace_load(const char *filename, struct trace *t)
+{
+	struct trace_header hdr;
+	struct stat st;
+	size_t nread = 0;
+	ssize_t ret;
+	int fd, err;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(hdr)) {
+		close(fd);
+		errno = EINVAL;
+		return false;
+	}
+
+	t->len = st.st_size;
+	t->data = checked_malloc(t->len);
+	while (nread < t->len) {
+		ret = read(fd, t->data + nread, t->len - nread);
+		if (ret <= 0) {
+			err = ret == 0 ? EINVAL : errno;
+			close(fd);
+			free(t->data);
+			errno = err;
+			return false;
+		}
+		nread += ret;
+	}
+	close(fd);
+
+	memcpy(&hdr, t->data, sizeof(hdr));
+	if (memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != TRACE_VERSION) {
+		free(t->data);
+		errno = EINVAL;
+		return false;
+	}
+
+	t->pos = sizeof(hdr);
+	return true;
+}
+
+/* Get the next record from a loaded trace, and a pointer to its SMB.
+   Returns false at the end of the trace, or if the rest of it is
+   truncated. */
+bool trace_next(struct trace *t, struct trace_record *rec, const char **buf)
+{
+	if (t->len - t->pos < sizeof(*rec)) {
+		return false;
+	}
+	memcpy(rec, t->data + t->pos, sizeof(*rec));
+	if (t->len - t->pos - sizeof(*rec) < rec->len) {
+		return false;
+	}
+
+	*buf = t->data + t->pos + sizeof(*rec);
+	t->pos += sizeof(*rec) + rec->len;
+	return true;
+}
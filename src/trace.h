@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2025-2026 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A trace file starts with a header, followed by a record for every SMB
+   received, each followed by the SMB itself including its four byte NetBIOS
+   header. A record with a length of zero marks the end of a session.
+   Integers are in the byte order of the machine that made the capture. */
+#define TRACE_MAGIC   "TUMBATRC"
+#define TRACE_VERSION 1
+
+struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+};
+
+struct trace_record {
+	uint64_t usec; /* since the Unix epoch */
+	uint32_t pid;  /* pid and session together identify the session */
+	uint32_t session;
+	uint32_t len;
+	uint32_t reserved;
+};
+
+/* A whole trace file, loaded into memory for replaying. */
+struct trace {
+	char *data;
+	size_t len, pos;
+};
+
+bool trace_open(const char *filename);
+bool trace_enabled(void);
+uint32_t trace_new_session(void);
+void trace_smb(uint32_t session, const char *buf, size_t len);
+void trace_end_session(uint32_t session);
+bool trace_load(const char *filename, struct trace *t);
+bool trace_next(struct trace *t, struct trace_record *rec, const char **buf);
@@ -190,6 +190,7 @@ static int call_trans2open(char *inbuf, char *outbuf, size_t outbuf_len,
                            int cnum, char **pparams, char **ppdata)
 {
 	char *params = *pparams;
+	int oplock_request = EXTENDED_OPLOCK_REQUEST(SVAL(params, 0));
 	int16_t open_mode = SVAL(params, 2);
 	int16_t open_attr = SVAL(params, 6);
 	int16_t open_ofun = SVAL(params, 12);
@@ -198,7 +199,8 @@ static int call_trans2open(char *inbuf, char *outbuf, size_t outbuf_len,
 
 	pstring fname;
 	int fnum = -1;
-	int size = 0, fmode = 0, mtime = 0, rmode;
+	off_t size = 0;
+	int fmode = 0, mtime = 0, rmode;
 	int32_t inode = 0;
 	struct stat sbuf;
 	int smb_action = 0;
@@ -222,19 +224,20 @@ static int call_trans2open(char *inbuf, char *outbuf, size_t outbuf_len,
 			unix_ERR_class = ERRDOS;
 			unix_ERR_code = ERRbadpath;
 		}
-		Files[fnum].reserved = false;
+		release_file(fnum);
 		return UNIX_ERROR_CODE(ERRDOS, ERRnoaccess);
 	}
 
 	open_file_shared(fnum, cnum, fname, open_mode, open_ofun,
-	                 open_attr | aARCH, &rmode, &smb_action);
+	                 open_attr | aARCH, oplock_request, &rmode,
+	                 &smb_action);
 
 	if (!OPEN_FNUM(fnum)) {
 		if (errno == ENOENT && bad_path) {
 			unix_ERR_class = ERRDOS;
 			unix_ERR_code = ERRbadpath;
 		}
-		Files[fnum].reserved = false;
+		release_file(fnum);
 		return UNIX_ERROR_CODE(ERRDOS, ERRnoaccess);
 	}
 
@@ -258,10 +261,11 @@ static int call_trans2open(char *inbuf, char *outbuf, size_t outbuf_len,
 	SSVAL(params, 0, fnum);
 	SSVAL(params, 2, fmode);
 	put_dos_date2(params, 4, mtime);
-	SIVAL(params, 8, size);
+	SIVAL(params, 8, size32(size));
 	SSVAL(params, 12, rmode);
 
-	/* Note we grant no oplocks. See comment in reply_open_and_X() */
+	if (Files[fnum].oplock != NO_OPLOCK)
+		smb_action |= EXTENDED_OPLOCK_GRANTED;
 	SSVAL(params, 18, smb_action);
 	SIVAL(params, 20, inode);
 
@@ -282,13 +286,13 @@ static int get_lanman2_dir_entry(int cnum, char *path_mask, int dirtype,
 	bool found = false;
 	struct stat sbuf;
 	pstring mask;
-	pstring pathreal;
 	pstring fname;
 	char *p, *pdata = *ppdata;
 	uint32_t reskey = 0;
 	int prev_dirpos = 0;
 	int mode = 0;
-	uint32_t size = 0, len;
+	off_t size = 0;
+	uint32_t len;
 	uint32_t mdate = 0, adate = 0, cdate = 0;
 	char *nameptr;
 	bool isrootdir = strequal(Connections[cnum].dirpath, "./") ||
@@ -296,7 +300,6 @@ static int get_lanman2_dir_entry(int cnum, char *path_mask, int dirtype,
 	                 strequal(Connections[cnum].dirpath, "/");
 	bool was_8_3;
 	int nt_extmode; /* Used for NT connections instead of mode */
-	bool needslash = !string_has_suffix(Connections[cnum].dirpath, "/");
 
 	*fname = 0;
 	*out_of_space = false;
@@ -343,18 +346,14 @@ static int get_lanman2_dir_entry(int cnum, char *path_mask, int dirtype,
 			if (isrootdir && isdots)
 				continue;
 
-			pstrcpy(pathreal, Connections[cnum].dirpath);
-			if (needslash)
-				pstrcat(pathreal, "/");
-			pstrcat(pathreal, dname);
-			if (stat(pathreal, &sbuf) != 0) {
-				DEBUG("Couldn't stat [%s] (%s)\n", pathreal,
+			if (!stat_dir_entry(Connections[cnum].dirptr, &sbuf,
+			                    &mode)) {
+				DEBUG("Couldn't stat [%s/%s] (%s)\n",
+				      Connections[cnum].dirpath, dname,
 				      strerror(errno));
 				continue;
 			}
 
-			mode = dos_mode(cnum, pathreal, &sbuf);
-
 			if (!dir_check_ftype(cnum, mode, &sbuf, dirtype)) {
 				DEBUG("[%s] attribs didn't match %x\n", fname,
 				      dirtype);
@@ -368,7 +367,8 @@ static int get_lanman2_dir_entry(int cnum, char *path_mask, int dirtype,
 			if (mode & aDIR)
 				size = 0;
 
-			DEBUG("found %s fname=%s\n", pathreal, fname);
+			DEBUG("found %s/%s fname=%s\n",
+			      Connections[cnum].dirpath, dname, fname);
 
 			found = true;
 		}
@@ -390,8 +390,8 @@ static int get_lanman2_dir_entry(int cnum, char *path_mask, int dirtype,
 		put_dos_date2(p, l1_fdateCreation, cdate);
 		put_dos_date2(p, l1_fdateLastAccess, adate);
 		put_dos_date2(p, l1_fdateLastWrite, mdate);
-		SIVAL(p, l1_cbFile, size);
-		SIVAL(p, l1_cbFileAlloc, ROUNDUP(size, 1024));
+		SIVAL(p, l1_cbFile, size32(size));
+		SIVAL(p, l1_cbFileAlloc, size32(ROUNDUP(size, 1024)));
 		SSVAL(p, l1_attrFile, mode);
 		SCVAL(p, l1_cchName, strlen(fname));
 		pstrcpy(p + l1_achName, fname);
@@ -408,8 +408,8 @@ static int get_lanman2_dir_entry(int cnum, char *path_mask, int dirtype,
 		put_dos_date2(p, l2_fdateCreation, cdate);
 		put_dos_date2(p, l2_fdateLastAccess, adate);
 		put_dos_date2(p, l2_fdateLastWrite, mdate);
-		SIVAL(p, l2_cbFile, size);
-		SIVAL(p, l2_cbFileAlloc, ROUNDUP(size, 1024));
+		SIVAL(p, l2_cbFile, size32(size));
+		SIVAL(p, l2_cbFileAlloc, size32(ROUNDUP(size, 1024)));
 		SSVAL(p, l2_attrFile, mode);
 		SIVAL(p, l2_cbList, 0); /* No extended attributes */
 		SCVAL(p, l2_cchName, strlen(fname));
@@ -423,8 +423,8 @@ static int get_lanman2_dir_entry(int cnum, char *path_mask, int dirtype,
 		put_dos_date2(p, 4, cdate);
 		put_dos_date2(p, 8, adate);
 		put_dos_date2(p, 12, mdate);
-		SIVAL(p, 16, size);
-		SIVAL(p, 20, ROUNDUP(size, 1024));
+		SIVAL(p, 16, size32(size));
+		SIVAL(p, 20, size32(ROUNDUP(size, 1024)));
 		SSVAL(p, 24, mode);
 		SIVAL(p, 26, 4);
 		CVAL(p, 30) = strlen(fname);
@@ -442,8 +442,8 @@ static int get_lanman2_dir_entry(int cnum, char *path_mask, int dirtype,
 		put_dos_date2(p, 4, cdate);
 		put_dos_date2(p, 8, adate);
 		put_dos_date2(p, 12, mdate);
-		SIVAL(p, 16, size);
-		SIVAL(p, 20, ROUNDUP(size, 1024));
+		SIVAL(p, 16, size32(size));
+		SIVAL(p, 20, size32(ROUNDUP(size, 1024)));
 		SSVAL(p, 24, mode);
 		CVAL(p, 32) = strlen(fname);
 		pstrcpy(p + 33, fname);
@@ -467,9 +467,9 @@ static int get_lanman2_dir_entry(int cnum, char *path_mask, int dirtype,
 		p += 8;
 		put_long_date(p, mdate);
 		p += 8;
-		SIVAL(p, 0, size);
+		SBVAL(p, 0, size);
 		p += 8;
-		SIVAL(p, 0, size);
+		SBVAL(p, 0, size);
 		p += 8;
 		SIVAL(p, 0, nt_extmode);
 		p += 4;
@@ -505,9 +505,9 @@ static int get_lanman2_dir_entry(int cnum, char *path_mask, int dirtype,
 		p += 8;
 		put_long_date(p, mdate);
 		p += 8;
-		SIVAL(p, 0, size);
+		SBVAL(p, 0, size);
 		p += 8;
-		SIVAL(p, 0, size);
+		SBVAL(p, 0, size);
 		p += 8;
 		SIVAL(p, 0, nt_extmode);
 		p += 4;
@@ -532,9 +532,9 @@ static int get_lanman2_dir_entry(int cnum, char *path_mask, int dirtype,
 		p += 8;
 		put_long_date(p, mdate);
 		p += 8;
-		SIVAL(p, 0, size);
+		SBVAL(p, 0, size);
 		p += 8;
-		SIVAL(p, 0, size);
+		SBVAL(p, 0, size);
 		p += 8;
 		SIVAL(p, 0, nt_extmode);
 		p += 4;
@@ -871,67 +871,23 @@ static int call_trans2findnext(char *inbuf, char *outbuf, size_t inbuf_len,
 		 * given to us by NT/95/smbfs/smbclient). If no other scans have
 		 * been done between the findfirst/findnext (as is usual) then
 		 * the directory pointer should already be at the correct place.
-		 * Check this by scanning backwards looking for an exact (ie.
-		 * case sensitive) filename match. If we get to the beginning of
-		 * the directory and haven't found it then scan forwards again
-		 * looking for a match. JRA.
+		 * Check this by looking for an exact (ie. case sensitive)
+		 * filename match, preferring the nearest one at or before the
+		 * current position. JRA.
 		 */
 
-		int current_pos, start_pos;
-		char *dname = NULL;
 		Dir *dirptr = Connections[cnum].dirptr;
-		start_pos = tell_dir(dirptr);
-		for (current_pos = start_pos; current_pos >= 0; current_pos--) {
-			DEBUG("seeking to pos %d\n", current_pos);
-
-			seek_dir(dirptr, current_pos);
-			dname = read_dir_name(dirptr);
-
-			/*
-			 * Remember, name_map_mangle is called by
-			 * get_lanman2_dir_entry(), so the resume name
-			 * could be mangled. Ensure we do the same
-			 * here.
-			 */
-
-			if (dname != NULL)
-				name_map_mangle(dname, false, CONN_SHARE(cnum));
-
-			if (dname && strcsequal(resume_name, dname)) {
-				seek_dir(dirptr, current_pos + 1);
-				DEBUG("got match at pos %d\n", current_pos + 1);
-				break;
-			}
-		}
+		int start_pos = tell_dir(dirptr);
 
 		/*
-		 * Scan forward from start if not found going backwards.
+		 * Remember, name_map_mangle is called by
+		 * get_lanman2_dir_entry(), so the resume name could be
+		 * mangled. The directory index is keyed by the same names.
 		 */
-
-		if (current_pos < 0) {
-			DEBUG("notfound: seeking to pos %d\n", start_pos);
-			seek_dir(dirptr, start_pos);
-			for (current_pos = start_pos;
-			     (dname = read_dir_name(dirptr)) != NULL;
-			     seek_dir(dirptr, ++current_pos)) {
-				/*
-				 * Remember, name_map_mangle is called by
-				 * get_lanman2_dir_entry(), so the resume name
-				 * could be mangled. Ensure we do the same
-				 * here.
-				 */
-
-				if (dname != NULL)
-					name_map_mangle(dname, false,
-					                CONN_SHARE(cnum));
-
-				if (dname && strcsequal(resume_name, dname)) {
-					seek_dir(dirptr, current_pos + 1);
-					DEBUG("got match at pos %d\n",
-					      current_pos + 1);
-					break;
-				}
-			}
+		if (find_dir_name(dirptr, resume_name, true, false) != NULL) {
+			DEBUG("got match at pos %d\n", tell_dir(dirptr));
+		} else {
+			DEBUG("notfound: staying at pos %d\n", start_pos);
 		}
 	}
 
@@ -1012,8 +968,8 @@ static int call_trans2qfsinfo(char *inbuf, char *outbuf, size_t inbuf_len,
 
 	DEBUG("cnum = %d, level = %d\n", cnum, info_level);
 
-	if (stat(".", &st) != 0) {
-		INFO("call_trans2qfsinfo: stat of . failed (%s)\n",
+	if (fstat(CONN_ROOT(cnum), &st) != 0) {
+		INFO("call_trans2qfsinfo: stat of share failed (%s)\n",
 		     strerror(errno));
 		return ERROR_CODE(ERRSRV, ERRinvdevice);
 	}
@@ -1132,7 +1088,7 @@ static int call_trans2qfilepathinfo(char *inbuf, char *outbuf, size_t inbuf_len,
 	uint16_t tran_call = SVAL(inbuf, smb_setup0);
 	uint16_t info_level;
 	int mode = 0;
-	int size = 0;
+	off_t size = 0;
 	unsigned int data_size;
 	struct stat sbuf;
 	pstring fname1;
@@ -1140,7 +1096,8 @@ static int call_trans2qfilepathinfo(char *inbuf, char *outbuf, size_t inbuf_len,
 	char *fname;
 	pstring short_name;
 	char *p;
-	int l, pos;
+	off_t pos;
+	int l;
 	bool bad_path = false;
 
 	if (tran_call == TRANSACT2_QFILEINFO) {
@@ -1156,7 +1113,7 @@ static int call_trans2qfilepathinfo(char *inbuf, char *outbuf, size_t inbuf_len,
 			      strerror(errno));
 			return UNIX_ERROR_CODE(ERRDOS, ERRbadfid);
 		}
-		pos = lseek(Files[fnum].fd_ptr->fd, 0, SEEK_CUR);
+		pos = Files[fnum].pos;
 	} else {
 		/* qpathinfo */
 		info_level = SVAL(params, 0);
@@ -1169,7 +1126,8 @@ static int call_trans2qfilepathinfo(char *inbuf, char *outbuf, size_t inbuf_len,
 			pstrcpy(fname, ".");
 		}
 		unix_convert(fname, cnum, 0, &bad_path);
-		if (!check_name(fname, cnum) || stat(fname, &sbuf)) {
+		if (!check_name(fname, cnum) ||
+		    fstatat(CONN_ROOT(cnum), fname, &sbuf, 0)) {
 			DEBUG("fileinfo of %s failed (%s)\n", fname,
 			      strerror(errno));
 			if (errno == ENOENT && bad_path) {
@@ -1216,8 +1174,8 @@ static int call_trans2qfilepathinfo(char *inbuf, char *outbuf, size_t inbuf_len,
 		put_dos_date2(pdata, l1_fdateLastAccess, sbuf.st_atime);
 		put_dos_date2(pdata, l1_fdateLastWrite,
 		              sbuf.st_mtime); /* write time */
-		SIVAL(pdata, l1_cbFile, size);
-		SIVAL(pdata, l1_cbFileAlloc, ROUNDUP(size, 1024));
+		SIVAL(pdata, l1_cbFile, size32(size));
+		SIVAL(pdata, l1_cbFileAlloc, size32(ROUNDUP(size, 1024)));
 		SSVAL(pdata, l1_attrFile, mode);
 		SIVAL(pdata, l1_attrFile + 2, 4); /* this is what OS2 does */
 		break;
@@ -1227,8 +1185,8 @@ static int call_trans2qfilepathinfo(char *inbuf, char *outbuf, size_t inbuf_len,
 		put_dos_date2(pdata, 0, get_create_time(&sbuf));
 		put_dos_date2(pdata, 4, sbuf.st_atime);
 		put_dos_date2(pdata, 8, sbuf.st_mtime);
-		SIVAL(pdata, 12, size);
-		SIVAL(pdata, 16, ROUNDUP(size, 1024));
+		SIVAL(pdata, 12, size32(size));
+		SIVAL(pdata, 16, size32(ROUNDUP(size, 1024)));
 		SIVAL(pdata, 20, mode);
 		break;
 
@@ -1260,8 +1218,8 @@ static int call_trans2qfilepathinfo(char *inbuf, char *outbuf, size_t inbuf_len,
 
 	case SMB_QUERY_FILE_STANDARD_INFO:
 		data_size = 22;
-		SIVAL(pdata, 0, size);
-		SIVAL(pdata, 8, size);
+		SBVAL(pdata, 0, size);
+		SBVAL(pdata, 8, size);
 		SIVAL(pdata, 16, sbuf.st_nlink);
 		CVAL(pdata, 20) = 0;
 		CVAL(pdata, 21) = (mode & aDIR) ? 1 : 0;
@@ -1294,7 +1252,7 @@ static int call_trans2qfilepathinfo(char *inbuf, char *outbuf, size_t inbuf_len,
 	case SMB_QUERY_FILE_ALLOCATION_INFO:
 	case SMB_QUERY_FILE_END_OF_FILEINFO:
 		data_size = 8;
-		SIVAL(pdata, 0, size);
+		SBVAL(pdata, 0, size);
 		break;
 
 	case SMB_QUERY_FILE_ALL_INFO:
@@ -1304,8 +1262,8 @@ static int call_trans2qfilepathinfo(char *inbuf, char *outbuf, size_t inbuf_len,
 		put_long_date(pdata + 24, sbuf.st_mtime); /* change time */
 		SIVAL(pdata, 32, mode);
 		pdata += 40;
-		SIVAL(pdata, 0, size);
-		SIVAL(pdata, 8, size);
+		SBVAL(pdata, 0, size);
+		SBVAL(pdata, 8, size);
 		SIVAL(pdata, 16, sbuf.st_nlink);
 		CVAL(pdata, 20) = 0;
 		CVAL(pdata, 21) = (mode & aDIR) ? 1 : 0;
@@ -1317,7 +1275,7 @@ static int call_trans2qfilepathinfo(char *inbuf, char *outbuf, size_t inbuf_len,
 		else
 			SIVAL(pdata, 0, 0xd01BF);
 		pdata += 4;
-		SIVAL(pdata, 0, pos); /* current offset */
+		SBVAL(pdata, 0, pos); /* current offset */
 		pdata += 8;
 		SIVAL(pdata, 0,
 		      mode); /* is this the right sort of mode info? */
@@ -1332,8 +1290,8 @@ static int call_trans2qfilepathinfo(char *inbuf, char *outbuf, size_t inbuf_len,
 	case SMB_QUERY_FILE_STREAM_INFO:
 		data_size = 24 + l;
 		SIVAL(pdata, 0, pos);
-		SIVAL(pdata, 4, size);
-		SIVAL(pdata, 12, size);
+		SBVAL(pdata, 4, size);
+		SBVAL(pdata, 12, size);
 		SIVAL(pdata, 20, l);
 		pstrcpy(pdata + 24, fname);
 		break;
@@ -1357,7 +1315,8 @@ static int call_trans2setfilepathinfo(char *inbuf, char *outbuf,
 	uint16_t tran_call = SVAL(inbuf, smb_setup0);
 	uint16_t info_level;
 	int mode = 0;
-	int size = 0;
+	off_t size = 0;
+	bool size_is_32bit = false;
 	struct utimbuf tvs;
 	struct stat st;
 	pstring fname1;
@@ -1397,7 +1356,7 @@ static int call_trans2setfilepathinfo(char *inbuf, char *outbuf,
 			return UNIX_ERROR_CODE(ERRDOS, ERRbadpath);
 		}
 
-		if (stat(fname, &st) != 0) {
+		if (fstatat(CONN_ROOT(cnum), fname, &st, 0) != 0) {
 			DEBUG("stat of %s failed (%s)\n", fname,
 			      strerror(errno));
 			if (errno == ENOENT && bad_path) {
@@ -1437,6 +1396,7 @@ static int call_trans2setfilepathinfo(char *inbuf, char *outbuf,
 
 		mode = SVAL(pdata, l1_attrFile);
 		size = IVAL(pdata, l1_cbFile);
+		size_is_32bit = true;
 		break;
 
 	/* XXXX um, i don't think this is right.
@@ -1447,6 +1407,7 @@ static int call_trans2setfilepathinfo(char *inbuf, char *outbuf,
 		tvs.modtime = make_unix_date2(pdata + 12);
 		size = IVAL(pdata, 16);
 		mode = IVAL(pdata, 24);
+		size_is_32bit = true;
 		break;
 
 	/* XXXX nor this.  not in cifs6.txt, either. */
@@ -1455,6 +1416,7 @@ static int call_trans2setfilepathinfo(char *inbuf, char *outbuf,
 		tvs.modtime = make_unix_date2(pdata + 12);
 		size = IVAL(pdata, 16);
 		mode = IVAL(pdata, 24);
+		size_is_32bit = true;
 		break;
 
 	case SMB_SET_FILE_BASIC_INFO:
@@ -1472,9 +1434,9 @@ static int call_trans2setfilepathinfo(char *inbuf, char *outbuf,
 		break;
 
 	case SMB_SET_FILE_END_OF_FILE_INFO:
-		if (IVAL(pdata, 4) != 0) /* more than 32 bits? */
+		size = BVAL(pdata, 0);
+		if (size < 0)
 			return ERROR_CODE(ERRDOS, ERRunknownlevel);
-		size = IVAL(pdata, 0);
 		break;
 
 	case SMB_SET_FILE_DISPOSITION_INFO: /* not supported yet */
@@ -1486,7 +1448,7 @@ static int call_trans2setfilepathinfo(char *inbuf, char *outbuf,
 
 	DEBUG("actime: %s ", ctime(&tvs.actime));
 	DEBUG("modtime: %s ", ctime(&tvs.modtime));
-	DEBUG("size: %x ", size);
+	DEBUG("size: %llx ", (long long) size);
 	DEBUG("mode: %x\n", mode);
 
 	/* get some defaults (no modifications) if any info is zero. */
@@ -1496,12 +1458,16 @@ static int call_trans2setfilepathinfo(char *inbuf, char *outbuf,
 		tvs.modtime = st.st_mtime;
 	if (!size)
 		size = st.st_size;
+	/* the size of a large file as shown by size32(), sent back to us */
+	if (size_is_32bit && size == UINT32_MAX && st.st_size > UINT32_MAX)
+		size = st.st_size;
 
 	/* Try and set the times, size and mode of this file -
 	   if they are different from the current values
 	 */
+	dir_cache_invalidate();
 	if (st.st_mtime != tvs.modtime || st.st_atime != tvs.actime) {
-		if (sys_utime(fname, &tvs) != 0) {
+		if (sys_utime(CONN_ROOT(cnum), fname, &tvs) != 0) {
 			return ERROR_CODE(ERRDOS, ERRnoaccess);
 		}
 	}
@@ -1515,7 +1481,7 @@ static int call_trans2setfilepathinfo(char *inbuf, char *outbuf,
 
 	if (size != st.st_size) {
 		if (fd == -1) {
-			fd = open(fname, O_RDWR, 0);
+			fd = openat(CONN_ROOT(cnum), fname, O_RDWR, 0);
 			if (fd == -1) {
 				return ERROR_CODE(ERRDOS, ERRbadpath);
 			}
@@ -1556,7 +1522,10 @@ static int call_trans2mkdir(char *inbuf, char *outbuf, size_t inbuf_len,
 
 	unix_convert(directory, cnum, 0, &bad_path);
 	if (check_name(directory, cnum))
-		ret = mkdir(directory, unix_mode(cnum, aDIR));
+		ret = mkdirat(CONN_ROOT(cnum), directory,
+		              unix_mode(cnum, aDIR));
+
+	dir_cache_invalidate();
 
 	if (ret < 0) {
 		DEBUG("error (%s)\n", strerror(errno));
@@ -0,0 +1,375 @@
+/*
+ * Copyright (c) 2025-2026 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* tumba_bench runs micro-benchmarks of the helper functions that are called
+   for every file in a directory listing: wildcard matching, 8.3 name
+   checking and mangling, and DOS date conversion. Each one is run over a
+   corpus of file names or timestamps like those found on a real share, for
+   long enough to get a stable figure, and the time per item is reported.
+   Run it with "make bench" before and after changing any of them. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "guards.h" /* IWYU pragma: keep */
+#include "mangle.h"
+#include "strfunc.h"
+#include "timefunc.h"
+#include "util.h"
+#include "version.h"
+
+#define CORPUS_SIZE 1024
+
+/* Names that turn up on shares of old machines and new ones alike. The rest
+   of the corpus is generated from these. */
+static const char *const sample_names[] = {
+    "AUTOEXEC.BAT",
+    "CONFIG.SYS",
+    "README.TXT",
+    "setup.exe",
+    "Command.com",
+    "WIN.INI",
+    "DOOM2.WAD",
+    "a.b",
+    ".",
+    "..",
+    ".bashrc",
+    ".gitignore",
+    "Makefile",
+    "con.txt",
+    "archive.tar.gz",
+    "libfoo.so.1.2.3",
+    "index.html",
+    "Thumbs.db",
+    "desktop.ini",
+    "My Documents",
+    "Program Files (x86)",
+    "Quarterly Report 2024 (final) - Copy.docx",
+    "IMG_20240815_143210.jpg",
+    "Screenshot from 2025-03-02 11-42-07.png",
+    "01 - Smells Like Teen Spirit.mp3",
+    "The Quick Brown Fox Jumps Over The Lazy Dog And Keeps On Running "
+    "Until The Name Is Far Too Long For Anybody.txt",
+    "R\xc3\xa9sum\xc3\xa9 \xe2\x80\x93 Jos\xc3\xa9 M\xc3\xbcller.pdf",
+    "Caf\xc3\xa9 Men\xc3\xbc.txt",
+    "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e\xe3\x81\xae\xe3\x83\x95\xe3\x82"
+    "\xa1\xe3\x82\xa4\xe3\x83\xab.txt",
+    "na\xc3\xafve.c",
+    "what?.txt",
+    "a:b.txt",
+    "very.many.dots.in.this.name",
+    "trailing.",
+    "UPPER AND lower.Txt",
+};
+
+/* Wildcards that clients send when listing a directory */
+static const char *const patterns[] = {
+    "*",         "*.*",      "????????.???", "*.TXT",
+    "FILE*.DAT", "*report*", "README.TXT",   "?*.?*",
+};
+
+struct benchmark {
+	const char *name;
+	const char *pattern;
+	int (*fn)(const struct benchmark *b);
+};
+
+static char corpus[CORPUS_SIZE][128];
+static time_t dates[CORPUS_SIZE];
+static int duration_ms = 200;
+
+/* Something for every benchmark to write its results to, so that the
+   compiler cannot decide the work is not needed. */
+static volatile unsigned int sink;
+
+static uint32_t random_state = 1;
+
+static uint32_t next_random(void)
+{
+	random_state = random_state * 1103515245 + 12345;
+	return random_state >> 8;
+}
+
+/* A directory listing is mostly made of names that follow a few patterns,
+   with the odd one out. */
+static void make_corpus(void)
+{
+	int i, n = arrlen(sample_names);
+
+	for (i = 0; i < CORPUS_SIZE; i++) {
+		switch (i % 4) {
+		case 0:
+			snprintf(corpus[i], sizeof(corpus[i]), "%s",
+			         sample_names[(i / 4) % n]);
+			break;
+		case 1:
+			snprintf(corpus[i], sizeof(corpus[i]),
+			         "FILE%04d.DAT", i);
+			break;
+		case 2:
+			snprintf(corpus[i], sizeof(corpus[i]),
+			         "Holiday photo %d - beach at sunset.jpeg", i);
+			break;
+		default:
+			snprintf(corpus[i], sizeof(corpus[i]), "%x_%s", i,
+			         sample_names[next_random() % n]);
+			break;
+		}
+	}
+
+	/* The range that a DOS date can represent */
+	for (i = 0; i < CORPUS_SIZE; i++) {
+		dates[i] = 315532800 + next_random() % (60U * 365 * 24 * 3600);
+	}
+}
+
+static int bench_mask_match_trans2(const struct benchmark *b)
+{
+	unsigned int matches = 0;
+	int i;
+
+	for (i = 0; i < CORPUS_SIZE; i++) {
+		matches += mask_match(corpus[i], b->pattern, true);
+	}
+	sink += matches;
+
+	return CORPUS_SIZE;
+}
+
+static int bench_mask_match_core(const struct benchmark *b)
+{
+	unsigned int matches = 0;
+	int i;
+
+	for (i = 0; i < CORPUS_SIZE; i++) {
+		matches += mask_match(corpus[i], b->pattern, false);
+	}
+	sink += matches;
+
+	return CORPUS_SIZE;
+}
+
+static int bench_is_8_3(const struct benchmark *b)
+{
+	unsigned int matches = 0;
+	int i;
+
+	for (i = 0; i < CORPUS_SIZE; i++) {
+		matches += is_8_3(corpus[i], true);
+	}
+	sink += matches;
+
+	return CORPUS_SIZE;
+}
+
+static int bench_mangle_name_83(const struct benchmark *b)
+{
+	pstring name;
+	int i;
+
+	for (i = 0; i < CORPUS_SIZE; i++) {
+		pstrcpy(name, corpus[i]);
+		mangle_name_83(name, sizeof(name) - 1);
+		sink += name[0];
+	}
+
+	return CORPUS_SIZE;
+}
+
+static void map_corpus(bool need83)
+{
+	pstring name;
+	int i;
+
+	for (i = 0; i < CORPUS_SIZE; i++) {
+		pstrcpy(name, corpus[i]);
+		name_map_mangle(name, need83, NULL);
+		sink += name[0];
+	}
+}
+
+/* As for a client that understands long file names */
+static int bench_name_map_mangle(const struct benchmark *b)
+{
+	map_corpus(false);
+	return CORPUS_SIZE;
+}
+
+/* As for a client that only understands 8.3 names */
+static int bench_name_map_mangle_83(const struct benchmark *b)
+{
+	map_corpus(true);
+	return CORPUS_SIZE;
+}
+
+static int bench_put_dos_date(const struct benchmark *b)
+{
+	char buf[4];
+	int i;
+
+	for (i = 0; i < CORPUS_SIZE; i++) {
+		put_dos_date(buf, 0, dates[i]);
+		sink += buf[0];
+	}
+
+	return CORPUS_SIZE;
+}
+
+static int bench_put_dos_date2(const struct benchmark *b)
+{
+	char buf[4];
+	int i;
+
+	for (i = 0; i < CORPUS_SIZE; i++) {
+		put_dos_date2(buf, 0, dates[i]);
+		sink += buf[0];
+	}
+
+	return CORPUS_SIZE;
+}
+
+static int bench_put_dos_date3(const struct benchmark *b)
+{
+	char buf[4];
+	int i;
+
+	for (i = 0; i < CORPUS_SIZE; i++) {
+		put_dos_date3(buf, 0, dates[i]);
+		sink += buf[0];
+	}
+
+	return CORPUS_SIZE;
+}
+
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void run_benchmark(const struct benchmark *b)
+{
+	uint64_t start, elapsed, deadline;
+	uint64_t items = 0;
+	char name[64];
+
+	/* once to warm up the caches */
+	b->fn(b);
+
+	start = now_nsec();
+	deadline = start + (uint64_t) duration_ms * 1000000;
+	do {
+		items += b->fn(b);
+		elapsed = now_nsec() - start;
+	} while (start + elapsed < deadline);
+
+	if (b->pattern != NULL) {
+		snprintf(name, sizeof(name), "%s %s", b->name, b->pattern);
+	} else {
+		snprintf(name, sizeof(name), "%s", b->name);
+	}
+	printf("%-36s %12llu %10.1f %12.0f\n", name,
+	       (unsigned long long) items, (double) elapsed / items,
+	       items * 1e9 / elapsed);
+}
+
+/* Run the given benchmark, unless only some were asked for by name */
+static void maybe_run(const struct benchmark *b, int argc, char *argv[])
+{
+	int i;
+
+	if (optind >= argc) {
+		run_benchmark(b);
+		return;
+	}
+
+	for (i = optind; i < argc; i++) {
+		if (strstr(b->name, argv[i]) != NULL) {
+			run_benchmark(b);
+			return;
+		}
+	}
+}
+
+static void usage(void)
+{
+	printf(PACKAGE_STRING
+	       "\n"
+	       "Usage: tumba_bench [-t msecs] [benchmarks...]\n\n"
+	       "  -t msecs      how long to run each benchmark for "
+	       "(default 200)\n"
+	       "\n"
+	       "If any benchmark names are given, only the benchmarks whose\n"
+	       "names contain one of them are run.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct benchmark others[] = {
+	    {"is_8_3", NULL, bench_is_8_3},
+	    {"mangle_name_83", NULL, bench_mangle_name_83},
+	    {"name_map_mangle(long)", NULL, bench_name_map_mangle},
+	    {"name_map_mangle(8.3)", NULL, bench_name_map_mangle_83},
+	    {"put_dos_date", NULL, bench_put_dos_date},
+	    {"put_dos_date2", NULL, bench_put_dos_date2},
+	    {"put_dos_date3", NULL, bench_put_dos_date3},
+	};
+	struct benchmark b;
+	int i, opt;
+
+	setup_logging(argv[0]);
+	LOGLEVEL = 0;
+
+	while ((opt = getopt(argc, argv, "t:h")) != EOF) {
+		switch (opt) {
+		case 't':
+			duration_ms = atoi(optarg);
+			break;
+		case 'h':
+			usage();
+			exit(0);
+		default:
+			usage();
+			exit(1);
+		}
+	}
+
+	init_dos_char_table();
+	time_init();
+	make_corpus();
+
+	printf("%-36s %12s %10s %12s\n", "BENCHMARK", "ITEMS", "NS/ITEM",
+	       "ITEMS/SEC");
+
+	for (i = 0; i < arrlen(patterns); i++) {
+		b.name = "mask_match(trans2)";
+		b.pattern = patterns[i];
+		b.fn = bench_mask_match_trans2;
+		maybe_run(&b, argc, argv);
+	}
+	for (i = 0; i < arrlen(patterns); i++) {
+		b.name = "mask_match(core)";
+		b.pattern = patterns[i];
+		b.fn = bench_mask_match_core;
+		maybe_run(&b, argc, argv);
+	}
+	for (i = 0; i < arrlen(others); i++) {
+		maybe_run(&others[i], argc, argv);
+	}
+
+	return 0;
+}
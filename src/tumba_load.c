@@ -0,0 +1,903 @@
+/*
+ * Copyright (c) 2025-2026 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* tumba_load is a load generator: it simulates a number of clients, each in
+   its own process, that connect to a server and run a mix of workloads
+   against it for a while, then reports how many operations they managed and
+   how long they took. It only speaks the parts of the protocol that it needs,
+   using the same subset of SMB that the server implements.
+
+   Each client works in its own directory on the share, which it creates and
+   fills with files before the clock starts, and deletes afterwards. The
+   workloads are:
+
+     copy      write a file and then read it back, in large chunks
+     browse    list a directory with FIND_FIRST2/FIND_NEXT2, then query
+               some of the files in it with QUERY_PATH_INFORMATION
+     database  lock a random record in a file, read or write it, and
+               unlock it again
+
+   Per-command stats are counted from the server's point of view, so "bytes
+   in" are the bytes of the requests sent and "bytes out" those of the
+   replies. */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "byteorder.h"
+#include "guards.h" /* IWYU pragma: keep */
+#include "server.h"
+#include "smb.h"
+#include "stats.h"
+#include "stattable.h"
+#include "version.h"
+
+#define COPY_FILE_SIZE   (256 * 1024)
+#define COPY_CHUNK_SIZE  (16 * 1024)
+#define DB_FILE_SIZE     (1024 * 1024)
+#define DB_RECORD_SIZE   4096
+#define BROWSE_FILES     100
+#define BROWSE_BATCH     32
+#define BROWSE_QUERIES   4
+
+/* TRANS2 subcommands and information levels */
+#define TRANSACT2_FINDFIRST      1
+#define TRANSACT2_FINDNEXT       2
+#define TRANSACT2_QPATHINFO      5
+#define SMB_INFO_STANDARD        1
+#define SMB_FIND_BOTH_DIRECTORY  0x104
+#define FLAG_TRANS2_FIND_CLOSE   2
+#define FLAG_TRANS2_FIND_CONTINUE 8
+
+enum workload {
+	WORKLOAD_COPY,
+	WORKLOAD_BROWSE,
+	WORKLOAD_DATABASE,
+	NUM_WORKLOADS,
+};
+
+static const char *workload_names[NUM_WORKLOADS] = {
+    "copy",
+    "browse",
+    "database",
+};
+
+/* Written by each client process, and read by the parent at the end. */
+struct client_results {
+	struct server_stats commands;
+	struct command_stats workloads[NUM_WORKLOADS];
+	bool failed;
+};
+
+struct client {
+	int num;
+	int fd;
+	uint16_t tid, uid, mid;
+	char out[BUFFER_SIZE + 4];
+	char in[BUFFER_SIZE + 4];
+	int chunk_size;
+	uint16_t db_fid;
+	uint32_t random_state;
+	bool recording;
+	struct client_results *results;
+	char dirname[16];
+};
+
+static const char *host = "127.0.0.1";
+static int port = SMB_PORT;
+static const char *share = "PUBLIC";
+static int num_clients = 4;
+static int duration = 10;
+static bool use_lanman2 = false;
+static int weights[NUM_WORKLOADS] = {1, 1, 1};
+static struct client_results *results;
+
+static void fail(struct client *c, const char *what)
+{
+	fprintf(stderr, "client %d: %s\n", c->num, what);
+	c->results->failed = true;
+	exit(1);
+}
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void count_latency(struct command_stats *cs, uint64_t usec,
+                          size_t bytes_in, size_t bytes_out)
+{
+	++cs->count;
+	cs->bytes_in += bytes_in;
+	cs->bytes_out += bytes_out;
+	cs->usec_total += usec;
+	++cs->usec_hist[stats_usec_bucket(usec)];
+}
+
+/* A simple xorshift generator, so that every run does the same thing. */
+static uint32_t client_random(struct client *c)
+{
+	uint32_t x = c->random_state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	c->random_state = x;
+	return x;
+}
+
+/* Begin a new request in the client's output buffer; returns a pointer to
+   where its data bytes go. */
+static char *start_request(struct client *c, int cmd, int wct)
+{
+	memset(c->out, 0, smb_size + wct * 2);
+	memcpy(c->out + 4, "\377SMB", 4);
+	CVAL(c->out, smb_com) = cmd;
+	CVAL(c->out, smb_flg) = 0x08; /* paths are caseless */
+	SSVAL(c->out, smb_flg2, 0x0001); /* long file names */
+	SSVAL(c->out, smb_tid, c->tid);
+	SSVAL(c->out, smb_pid, getpid());
+	SSVAL(c->out, smb_uid, c->uid);
+	SSVAL(c->out, smb_mid, c->mid++);
+	CVAL(c->out, smb_wct) = wct;
+
+	return c->out + smb_vwv + wct * 2 + 2;
+}
+
+static void write_all(struct client *c, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(c->fd, buf, len);
+		if (ret <= 0) {
+			fail(c, "error writing to server");
+		}
+		buf += ret;
+		len -= ret;
+	}
+}
+
+static void read_all(struct client *c, char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = read(c->fd, buf, len);
+		if (ret <= 0) {
+			fail(c, "error reading from server");
+		}
+		buf += ret;
+		len -= ret;
+	}
+}
+
+/* Send the request, which has nbytes data bytes ending at end, and wait for
+   the reply. Returns false if the server returned an error. */
+static bool transact(struct client *c, const char *end)
+{
+	int wct = CVAL(c->out, smb_wct);
+	int cmd = CVAL(c->out, smb_com);
+	int nbytes = end - (c->out + smb_vwv + wct * 2 + 2);
+	int len = smb_size + wct * 2 + nbytes - 4;
+	uint64_t start;
+	int reply_len;
+
+	SSVAL(c->out, smb_vwv + wct * 2, nbytes);
+	CVAL(c->out, 0) = 0;
+	CVAL(c->out, 1) = (len >> 16) & 0xff;
+	CVAL(c->out, 2) = (len >> 8) & 0xff;
+	CVAL(c->out, 3) = len & 0xff;
+
+	start = now_usec();
+	write_all(c, c->out, len + 4);
+
+	/* skip any keepalives */
+	do {
+		read_all(c, c->in, 4);
+		reply_len = ((CVAL(c->in, 1) & 1) << 16) |
+		            (CVAL(c->in, 2) << 8) | CVAL(c->in, 3);
+	} while (CVAL(c->in, 0) != 0);
+
+	if (reply_len < smb_size - 4) {
+		fail(c, "reply from server is too short");
+	}
+	read_all(c, c->in + 4, reply_len);
+
+	if (c->recording) {
+		count_latency(&c->results->commands.commands[cmd],
+		              now_usec() - start, len + 4, reply_len + 4);
+	}
+
+	return CVAL(c->in, smb_rcls) == 0;
+}
+
+static void must_transact(struct client *c, const char *end, const char *what)
+{
+	if (!transact(c, end)) {
+		char buf[100];
+		snprintf(buf, sizeof(buf), "%s failed: error class %d, code %d",
+		         what, CVAL(c->in, smb_rcls), SVAL(c->in, smb_err));
+		fail(c, buf);
+	}
+}
+
+static char *put_string(char *p, const char *s)
+{
+	size_t len = strlen(s) + 1;
+
+	memcpy(p, s, len);
+	return p + len;
+}
+
+static void connect_to_server(struct client *c)
+{
+	struct sockaddr_in addr;
+	int one = 1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (inet_aton(host, &addr.sin_addr) == 0) {
+		fail(c, "invalid server address");
+	}
+
+	c->fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (c->fd < 0 ||
+	    connect(c->fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		fail(c, "failed to connect to server");
+	}
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static void negotiate(struct client *c)
+{
+	char *p = start_request(c, SMBnegprot, 0);
+	int max_buffer;
+
+	*p++ = 2;
+	p = put_string(p, use_lanman2 ? "LM1.2X002" : "NT LM 0.12");
+	must_transact(c, p, "negprot");
+
+	if (CVAL(c->in, smb_wct) == 17) {
+		max_buffer = IVAL(c->in, smb_vwv3 + 1);
+	} else if (CVAL(c->in, smb_wct) == 13) {
+		max_buffer = SVAL(c->in, smb_vwv2);
+	} else {
+		fail(c, "server did not accept the dialect");
+		return;
+	}
+
+	/* leave room for the headers */
+	c->chunk_size =
+	    MIN(COPY_CHUNK_SIZE, MIN(max_buffer, BUFFER_SIZE) - 256);
+}
+
+static void session_setup(struct client *c)
+{
+	char *p = start_request(c, SMBsesssetupX, 10);
+
+	CVAL(c->out, smb_vwv0) = 0xff; /* no chained command */
+	SSVAL(c->out, smb_vwv2, BUFFER_SIZE);
+	SSVAL(c->out, smb_vwv3, 1);
+	SSVAL(c->out, smb_vwv7, 1);
+	*p++ = 0; /* empty password */
+	p = put_string(p, "LOAD");
+	p = put_string(p, "");
+	must_transact(c, p, "sesssetupX");
+	c->uid = SVAL(c->in, smb_uid);
+}
+
+static void tree_connect(struct client *c)
+{
+	char *p = start_request(c, SMBtconX, 4);
+	char path[64];
+
+	CVAL(c->out, smb_vwv0) = 0xff;
+	SSVAL(c->out, smb_vwv3, 1);
+	*p++ = 0;
+	snprintf(path, sizeof(path), "\\\\SERVER\\%s", share);
+	p = put_string(p, path);
+	p = put_string(p, "?????");
+	must_transact(c, p, "tconX");
+	c->tid = SVAL(c->in, smb_tid);
+}
+
+static char *client_path(struct client *c, char *buf, size_t buf_len,
+                         const char *name)
+{
+	snprintf(buf, buf_len, "%s\\%s", c->dirname, name);
+	return buf;
+}
+
+/* Open a file in the client's directory with SMBopenX; func says what to do
+   if it does or does not exist, as in the request. */
+static uint16_t send_openx(struct client *c, const char *name, int access,
+                           int func)
+{
+	char *p = start_request(c, SMBopenX, 15);
+	char path[64];
+
+	CVAL(c->out, smb_vwv0) = 0xff;
+	SSVAL(c->out, smb_vwv3, access);
+	SSVAL(c->out, smb_vwv4, aHIDDEN | aSYSTEM | aDIR);
+	SSVAL(c->out, smb_vwv8, func);
+	p = put_string(p, client_path(c, path, sizeof(path), name));
+	must_transact(c, p, "openX");
+
+	return SVAL(c->in, smb_vwv2);
+}
+
+static void send_close(struct client *c, uint16_t fid)
+{
+	char *p = start_request(c, SMBclose, 3);
+
+	SSVAL(c->out, smb_vwv0, fid);
+	must_transact(c, p, "close");
+}
+
+static void send_writex(struct client *c, uint16_t fid, uint32_t offset,
+                        int len)
+{
+	char *p = start_request(c, SMBwriteX, 12);
+
+	CVAL(c->out, smb_vwv0) = 0xff;
+	SSVAL(c->out, smb_vwv2, fid);
+	SIVAL(c->out, smb_vwv3, offset);
+	SSVAL(c->out, smb_vwv10, len);
+	/* one byte of padding, then the data */
+	SSVAL(c->out, smb_vwv11, p + 1 - (c->out + 4));
+	memset(p, 0, 1);
+	memset(p + 1, 'x', len);
+	must_transact(c, p + 1 + len, "writeX");
+
+	if (SVAL(c->in, smb_vwv2) != len) {
+		fail(c, "short write");
+	}
+}
+
+static void send_readx(struct client *c, uint16_t fid, uint32_t offset,
+                       int len)
+{
+	char *p = start_request(c, SMBreadX, 10);
+
+	CVAL(c->out, smb_vwv0) = 0xff;
+	SSVAL(c->out, smb_vwv2, fid);
+	SIVAL(c->out, smb_vwv3, offset);
+	SSVAL(c->out, smb_vwv5, len);
+	SSVAL(c->out, smb_vwv6, len);
+	must_transact(c, p, "readX");
+
+	if (SVAL(c->in, smb_vwv5) != len) {
+		fail(c, "short read");
+	}
+}
+
+static void send_lockingx(struct client *c, uint16_t fid, uint32_t offset,
+                          uint32_t len, bool lock)
+{
+	char *p = start_request(c, SMBlockingX, 8);
+
+	CVAL(c->out, smb_vwv0) = 0xff;
+	SSVAL(c->out, smb_vwv2, fid);
+	SSVAL(c->out, smb_vwv6, lock ? 0 : 1);
+	SSVAL(c->out, smb_vwv7, lock ? 1 : 0);
+	SSVAL(p, 0, getpid());
+	SIVAL(p, 2, offset);
+	SIVAL(p, 6, len);
+	must_transact(c, p + 10, "lockingX");
+}
+
+/* Start a TRANS2 request; returns a pointer to where its parameters go. */
+static char *start_trans2(struct client *c, int subcommand, int max_data)
+{
+	char *p = start_request(c, SMBtrans2, 15);
+
+	SSVAL(c->out, smb_vwv2, 10);       /* max parameter bytes */
+	SSVAL(c->out, smb_vwv3, max_data); /* max data bytes */
+	CVAL(c->out, smb_vwv13) = 1;       /* setup words */
+	SSVAL(c->out, smb_vwv14, subcommand);
+
+	/* parameters start on a word boundary after a padding byte */
+	*p++ = 0;
+	return p;
+}
+
+static void trans2(struct client *c, char *params, char *end,
+                   const char *what)
+{
+	int param_len = end - params;
+
+	SSVAL(c->out, smb_vwv0, param_len);
+	SSVAL(c->out, smb_vwv9, param_len);
+	SSVAL(c->out, smb_vwv10, params - (c->out + 4));
+	SSVAL(c->out, smb_vwv12, end - (c->out + 4));
+	must_transact(c, end, what);
+}
+
+/* The parameters of a TRANS2 reply. */
+static char *trans2_params(struct client *c)
+{
+	return c->in + 4 + SVAL(c->in, smb_vwv4);
+}
+
+static void list_directory(struct client *c)
+{
+	int level = use_lanman2 ? SMB_INFO_STANDARD : SMB_FIND_BOTH_DIRECTORY;
+	char *p = start_trans2(c, TRANSACT2_FINDFIRST, 8192);
+	char *params = p;
+	uint16_t sid;
+	char path[64];
+
+	SSVAL(p, 0, aHIDDEN | aSYSTEM | aDIR);
+	SSVAL(p, 2, BROWSE_BATCH);
+	SSVAL(p, 4, FLAG_TRANS2_FIND_CLOSE);
+	SSVAL(p, 6, level);
+	p = put_string(p + 12, client_path(c, path, sizeof(path), "*"));
+	trans2(c, params, p, "FIND_FIRST2");
+
+	sid = SVAL(trans2_params(c), 0);
+	if (SVAL(trans2_params(c), 4) != 0) {
+		return;
+	}
+
+	while (true) {
+		p = params = start_trans2(c, TRANSACT2_FINDNEXT, 8192);
+		SSVAL(p, 0, sid);
+		SSVAL(p, 2, BROWSE_BATCH);
+		SSVAL(p, 4, level);
+		SSVAL(p, 10,
+		      FLAG_TRANS2_FIND_CLOSE | FLAG_TRANS2_FIND_CONTINUE);
+		p = put_string(p + 12, "");
+		trans2(c, params, p, "FIND_NEXT2");
+
+		if (SVAL(trans2_params(c), 0) == 0 ||
+		    SVAL(trans2_params(c), 2) != 0) {
+			break;
+		}
+	}
+}
+
+static void query_path(struct client *c, const char *name)
+{
+	char *p = start_trans2(c, TRANSACT2_QPATHINFO, 1024);
+	char *params = p;
+	char path[64];
+
+	SSVAL(p, 0, SMB_INFO_STANDARD);
+	p = put_string(p + 6, client_path(c, path, sizeof(path), name));
+	trans2(c, params, p, "QUERY_PATH_INFORMATION");
+}
+
+static void make_directory(struct client *c)
+{
+	char *p = start_request(c, SMBmkdir, 0);
+
+	*p++ = 4;
+	p = put_string(p, c->dirname);
+	transact(c, p); /* it may be there from last time */
+}
+
+static void remove_directory(struct client *c)
+{
+	char *p = start_request(c, SMBunlink, 1);
+	char path[64];
+
+	SSVAL(c->out, smb_vwv0, aHIDDEN | aSYSTEM);
+	*p++ = 4;
+	p = put_string(p, client_path(c, path, sizeof(path), "*"));
+	must_transact(c, p, "unlink");
+
+	p = start_request(c, SMBrmdir, 0);
+	*p++ = 4;
+	p = put_string(p, c->dirname);
+	must_transact(c, p, "rmdir");
+}
+
+static void run_copy(struct client *c)
+{
+	uint16_t fid;
+	int ofs;
+
+	fid = send_openx(c, "COPY.DAT", 2, 0x12);
+	for (ofs = 0; ofs < COPY_FILE_SIZE; ofs += c->chunk_size) {
+		send_writex(c, fid, ofs,
+		            MIN(c->chunk_size, COPY_FILE_SIZE - ofs));
+	}
+	send_close(c, fid);
+
+	fid = send_openx(c, "COPY.DAT", 0, 0x01);
+	for (ofs = 0; ofs < COPY_FILE_SIZE; ofs += c->chunk_size) {
+		send_readx(c, fid, ofs,
+		           MIN(c->chunk_size, COPY_FILE_SIZE - ofs));
+	}
+	send_close(c, fid);
+}
+
+static void run_browse(struct client *c)
+{
+	char name[16];
+	int i;
+
+	list_directory(c);
+
+	for (i = 0; i < BROWSE_QUERIES; i++) {
+		snprintf(name, sizeof(name), "FILE%d.TXT",
+		         (int) (client_random(c) % BROWSE_FILES));
+		query_path(c, name);
+	}
+}
+
+static void run_database(struct client *c)
+{
+	uint32_t ofs;
+
+	ofs = (client_random(c) % (DB_FILE_SIZE / DB_RECORD_SIZE)) *
+	      DB_RECORD_SIZE;
+
+	send_lockingx(c, c->db_fid, ofs, DB_RECORD_SIZE, true);
+	if (client_random(c) % 10 < 7) {
+		send_readx(c, c->db_fid, ofs, DB_RECORD_SIZE);
+	} else {
+		send_writex(c, c->db_fid, ofs, DB_RECORD_SIZE);
+	}
+	send_lockingx(c, c->db_fid, ofs, DB_RECORD_SIZE, false);
+}
+
+static enum workload choose_workload(struct client *c)
+{
+	int total = 0, n, i;
+
+	for (i = 0; i < NUM_WORKLOADS; i++) {
+		total += weights[i];
+	}
+
+	n = client_random(c) % total;
+	for (i = 0; n >= weights[i]; i++) {
+		n -= weights[i];
+	}
+
+	return i;
+}
+
+/* Create the files that the workloads use. */
+static void setup_client(struct client *c)
+{
+	char name[16];
+	uint16_t fid;
+	int ofs, i;
+
+	connect_to_server(c);
+	negotiate(c);
+	session_setup(c);
+	tree_connect(c);
+	make_directory(c);
+
+	if (weights[WORKLOAD_BROWSE] > 0) {
+		for (i = 0; i < BROWSE_FILES; i++) {
+			snprintf(name, sizeof(name), "FILE%d.TXT", i);
+			send_close(c, send_openx(c, name, 2, 0x12));
+		}
+	}
+
+	if (weights[WORKLOAD_DATABASE] > 0) {
+		fid = send_openx(c, "DB.DAT", 2, 0x12);
+		for (ofs = 0; ofs < DB_FILE_SIZE; ofs += c->chunk_size) {
+			send_writex(c, fid, ofs,
+			            MIN(c->chunk_size, DB_FILE_SIZE - ofs));
+		}
+		c->db_fid = fid;
+	}
+}
+
+static void run_client(int num, int ready_fd, int go_fd)
+{
+	static struct client client;
+	struct client *c = &client;
+	enum workload w;
+	uint64_t start, deadline;
+	char buf;
+
+	c->num = num;
+	c->results = &results[num];
+	c->random_state = num + 1;
+	c->mid = 1;
+	snprintf(c->dirname, sizeof(c->dirname), "LOAD%d", num);
+
+	setup_client(c);
+
+	/* wait until all the clients are ready */
+	if (write(ready_fd, "", 1) != 1 || read(go_fd, &buf, 1) != 0) {
+		fail(c, "lost contact with the main process");
+	}
+
+	c->recording = true;
+	deadline = now_usec() + (uint64_t) duration * 1000000;
+	while (now_usec() < deadline) {
+		w = choose_workload(c);
+		start = now_usec();
+		switch (w) {
+		case WORKLOAD_COPY:
+			run_copy(c);
+			break;
+		case WORKLOAD_BROWSE:
+			run_browse(c);
+			break;
+		case WORKLOAD_DATABASE:
+			run_database(c);
+			break;
+		default:
+			break;
+		}
+		count_latency(&c->results->workloads[w], now_usec() - start,
+		              0, 0);
+	}
+	c->recording = false;
+
+	if (weights[WORKLOAD_DATABASE] > 0) {
+		send_close(c, c->db_fid);
+	}
+	remove_directory(c);
+	close(c->fd);
+	exit(0);
+}
+
+static void add_stats(struct command_stats *total,
+                      const struct command_stats *cs)
+{
+	int i;
+
+	total->count += cs->count;
+	total->bytes_in += cs->bytes_in;
+	total->bytes_out += cs->bytes_out;
+	total->usec_total += cs->usec_total;
+	for (i = 0; i < STATS_HIST_BUCKETS; i++) {
+		total->usec_hist[i] += cs->usec_hist[i];
+	}
+}
+
+/* Only the commands that we send */
+static const char *command_names[256] = {
+    [SMBmkdir] = "SMBmkdir",     [SMBrmdir] = "SMBrmdir",
+    [SMBclose] = "SMBclose",     [SMBunlink] = "SMBunlink",
+    [SMBnegprot] = "SMBnegprot", [SMBsesssetupX] = "SMBsesssetupX",
+    [SMBtconX] = "SMBtconX",     [SMBopenX] = "SMBopenX",
+    [SMBreadX] = "SMBreadX",     [SMBwriteX] = "SMBwriteX",
+    [SMBlockingX] = "SMBlockingX", [SMBtrans2] = "SMBtrans2",
+};
+
+static const char *command_name(int type)
+{
+	return command_names[type] != NULL ? command_names[type] : "SMBunknown";
+}
+
+static void print_report(void)
+{
+	static struct server_stats commands;
+	struct command_stats workloads[NUM_WORKLOADS], all;
+	const struct command_stats *cs;
+	uint64_t num_smbs = 0;
+	int failed = 0;
+	int i, j;
+
+	memset(workloads, 0, sizeof(workloads));
+	memset(&all, 0, sizeof(all));
+
+	for (i = 0; i < num_clients; i++) {
+		failed += results[i].failed;
+		for (j = 0; j < 256; j++) {
+			add_stats(&commands.commands[j],
+			          &results[i].commands.commands[j]);
+		}
+		for (j = 0; j < NUM_WORKLOADS; j++) {
+			add_stats(&workloads[j], &results[i].workloads[j]);
+			add_stats(&all, &results[i].workloads[j]);
+		}
+	}
+
+	printf("%d clients for %d seconds using %s", num_clients, duration,
+	       use_lanman2 ? "LM1.2X002" : "NT LM 0.12");
+	if (failed > 0) {
+		printf("; %d clients FAILED", failed);
+	}
+	printf("\n\n");
+
+	printf("%-16s %10s %10s %9s %9s %9s\n", "OPERATION", "COUNT",
+	       "OPS/SEC", "AVG(us)", "P50(us)", "P99(us)");
+	for (i = 0; i <= NUM_WORKLOADS; i++) {
+		cs = i < NUM_WORKLOADS ? &workloads[i] : &all;
+		if (cs->count == 0) {
+			continue;
+		}
+		printf("%-16s %10" PRIu64 " %10.1f %9" PRIu64 " %9" PRIu64
+		       " %9" PRIu64 "\n",
+		       i < NUM_WORKLOADS ? workload_names[i] : "all",
+		       cs->count, (double) cs->count / duration,
+		       cs->usec_total / cs->count, stats_percentile(cs, 0.5),
+		       stats_percentile(cs, 0.99));
+	}
+
+	for (i = 0; i < 256; i++) {
+		num_smbs += commands.commands[i].count;
+	}
+	printf("\n%" PRIu64 " SMBs (%.1f SMBs/sec)\n\n", num_smbs,
+	       (double) num_smbs / duration);
+
+	stats_print_table(&commands, command_name);
+}
+
+/* Parse a mix of workloads such as "copy=2,browse=1". A workload given
+   without a weight has a weight of one, and any not given have zero. */
+static bool parse_mix(char *mix)
+{
+	char *name, *value;
+	int i;
+
+	memset(weights, 0, sizeof(weights));
+
+	for (name = strtok(mix, ","); name != NULL; name = strtok(NULL, ",")) {
+		value = strchr(name, '=');
+		if (value != NULL) {
+			*value++ = '\0';
+		}
+		for (i = 0; i < NUM_WORKLOADS; i++) {
+			if (!strcmp(name, workload_names[i])) {
+				break;
+			}
+		}
+		if (i == NUM_WORKLOADS) {
+			return false;
+		}
+		weights[i] = value != NULL ? atoi(value) : 1;
+		if (weights[i] < 0) {
+			return false;
+		}
+	}
+
+	for (i = 0; i < NUM_WORKLOADS; i++) {
+		if (weights[i] > 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void usage(void)
+{
+	printf(PACKAGE_STRING
+	       "\n"
+	       "Usage: tumba_load"
+	       " [-c clients]"
+	       " [-H host]"
+	       " [-L]"
+	       " [-p port]"
+	       " [-s share]"
+	       " [-t seconds]"
+	       " [-w mix]\n\n"
+	       "  -c clients    number of clients to simulate (default 4)\n"
+	       "  -H host       address of the server (default 127.0.0.1)\n"
+	       "  -L            negotiate LM1.2X002 (LANMAN2) rather than\n"
+	       "                NT LM 0.12\n"
+	       "  -p port       port of the server (default %d)\n"
+	       "  -s share      share to use, which must be writeable\n"
+	       "                (default PUBLIC)\n"
+	       "  -t seconds    how long to run for (default 10)\n"
+	       "  -w mix        workloads to run and their weights, eg.\n"
+	       "                copy=1,browse=2,database=1 (the default is\n"
+	       "                an equal mix of all three)\n",
+	       SMB_PORT);
+}
+
+int main(int argc, char *argv[])
+{
+	int ready_pipe[2], go_pipe[2];
+	int status, failed = 0;
+	char buf;
+	pid_t pid;
+	int i, opt;
+
+	while ((opt = getopt(argc, argv, "c:H:Lp:s:t:w:h")) != EOF) {
+		switch (opt) {
+		case 'c':
+			num_clients = atoi(optarg);
+			break;
+		case 'H':
+			host = optarg;
+			break;
+		case 'L':
+			use_lanman2 = true;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 's':
+			share = optarg;
+			break;
+		case 't':
+			duration = atoi(optarg);
+			break;
+		case 'w':
+			if (!parse_mix(optarg)) {
+				usage();
+				exit(1);
+			}
+			break;
+		case 'h':
+			usage();
+			exit(0);
+		default:
+			usage();
+			exit(1);
+		}
+	}
+
+	if (num_clients < 1 || duration < 1 || optind != argc) {
+		usage();
+		exit(1);
+	}
+
+	results = mmap(NULL, num_clients * sizeof(struct client_results),
+	               PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1,
+	               0);
+	if (results == MAP_FAILED || pipe(ready_pipe) != 0 ||
+	    pipe(go_pipe) != 0) {
+		perror("tumba_load");
+		exit(1);
+	}
+
+	for (i = 0; i < num_clients; i++) {
+		pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			exit(1);
+		} else if (pid == 0) {
+			close(ready_pipe[0]);
+			close(go_pipe[1]);
+			run_client(i, ready_pipe[1], go_pipe[0]);
+		}
+	}
+	close(ready_pipe[1]);
+	close(go_pipe[0]);
+
+	/* start the clock once they have all connected and set up */
+	for (i = 0; i < num_clients; i++) {
+		if (read(ready_pipe[0], &buf, 1) != 1) {
+			break;
+		}
+	}
+	close(go_pipe[1]);
+
+	while ((pid = wait(&status)) > 0 || errno == EINTR) {
+		if (pid > 0 && status != 0) {
+			++failed;
+		}
+	}
+
+	print_report();
+
+	return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,269 @@
+/*
+ * Copyright (c) 2025-2026 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* tumba_replay feeds the SMBs captured in a trace file (see tumba_smbd -t)
+   back through the server's request handling code, as fast as it can and
+   without any network in between, and reports how long each command took.
+   This makes it possible to benchmark a real workload repeatably.
+
+   The replies go to a socket that nobody reads, except to empty it after
+   each SMB. The trace is replayed against the given share directories, so
+   they should be scratch copies of the ones it was captured from. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "byteorder.h"
+#include "guards.h" /* IWYU pragma: keep */
+#include "server.h"
+#include "shares.h"
+#include "smb.h"
+#include "stats.h"
+#include "stattable.h"
+#include "strfunc.h"
+#include "trace.h"
+#include "util.h"
+#include "version.h"
+
+/* Big enough for any reply, so that the server never blocks sending one */
+#define REPLY_BUFFER_SIZE (1024 * 1024)
+
+struct replay_session {
+	struct replay_session *next;
+	uint32_t pid, id;
+	struct session *s;
+	int peer_fd;
+};
+
+static struct replay_session *sessions;
+static int num_sessions, num_replayed, num_skipped;
+
+static struct replay_session *find_session(const struct trace_record *rec)
+{
+	struct replay_session *rs;
+
+	for (rs = sessions; rs != NULL; rs = rs->next) {
+		if (rs->pid == rec->pid && rs->id == rec->session) {
+			return rs;
+		}
+	}
+
+	return NULL;
+}
+
+static struct replay_session *new_session(const struct trace_record *rec)
+{
+	struct replay_session *rs;
+	int size = REPLY_BUFFER_SIZE;
+	int fds[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+		FATAL("socketpair failed: %s\n", strerror(errno));
+	}
+	setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+
+	rs = checked_calloc(1, sizeof(struct replay_session));
+	rs->pid = rec->pid;
+	rs->id = rec->session;
+	rs->s = replay_session_new(fds[0]);
+	rs->peer_fd = fds[1];
+	rs->next = sessions;
+	sessions = rs;
+	++num_sessions;
+
+	return rs;
+}
+
+static void end_session(struct replay_session *rs)
+{
+	struct replay_session **p;
+
+	replay_session_end(rs->s);
+	close(rs->peer_fd);
+
+	for (p = &sessions; *p != rs; p = &(*p)->next)
+		;
+	*p = rs->next;
+
+	free(rs);
+}
+
+/* Throw away the replies that the server has sent. */
+static void discard_replies(int fd)
+{
+	static char buf[64 * 1024];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+}
+
+static void replay(struct trace *t)
+{
+	struct trace_record rec;
+	struct replay_session *rs;
+	const char *buf;
+
+	while (trace_next(t, &rec, &buf)) {
+		rs = find_session(&rec);
+
+		if (rec.len == 0) {
+			if (rs != NULL) {
+				end_session(rs);
+			}
+			continue;
+		}
+
+		/* The data follows in a separate message that is not in the
+		   trace, and the server would wait forever for it. */
+		if (rec.len > smb_com && CVAL(buf, 0) == 0 &&
+		    CVAL(buf, smb_com) == SMBwritebraw) {
+			++num_skipped;
+			continue;
+		}
+
+		if (rs == NULL) {
+			rs = new_session(&rec);
+		}
+
+		++num_replayed;
+		if (!replay_smb(rs->s, buf, rec.len)) {
+			end_session(rs);
+			continue;
+		}
+		discard_replies(rs->peer_fd);
+	}
+
+	while (sessions != NULL) {
+		end_session(sessions);
+	}
+}
+
+static const char *command_name(int type)
+{
+	return smb_fn_name(type);
+}
+
+static void print_report(double secs)
+{
+	const struct server_stats *st = stats_local();
+	uint64_t bytes_in = 0, bytes_out = 0;
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		bytes_in += st->commands[i].bytes_in;
+		bytes_out += st->commands[i].bytes_out;
+	}
+
+	printf("Replayed %d SMBs from %d sessions in %.3f seconds "
+	       "(%.0f SMBs/sec)\n",
+	       num_replayed, num_sessions, secs, num_replayed / secs);
+	printf("Received %" PRIu64 " bytes, sent %" PRIu64 " bytes "
+	       "(%.1f MB/sec in total)\n",
+	       bytes_in, bytes_out, (bytes_in + bytes_out) / secs / 1e6);
+	if (num_skipped > 0) {
+		printf("Skipped %d SMBwritebraw requests, which cannot be "
+		       "replayed\n",
+		       num_skipped);
+	}
+	printf("\n");
+
+	stats_print_table(st, command_name);
+}
+
+static void usage(void)
+{
+	printf(PACKAGE_STRING
+	       "\n"
+	       "Usage: tumba_replay"
+	       " [-d level]"
+	       " [-l filename]"
+	       " [-n times]"
+	       " <trace> <path> [paths...]\n\n"
+	       "  -d level      set the logging level (0-4; default 1)\n"
+	       "  -l filename   path to debug log file, or '-' for stdout\n"
+	       "  -n times      replay the trace the given number of times\n"
+	       "\n"
+	       "The trace is replayed against the given directories, which\n"
+	       "will be modified; use copies of the shares it was captured\n"
+	       "from.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct timespec start, end;
+	struct trace t, pass;
+	int times = 1;
+	int i, opt;
+
+	setup_logging(argv[0]);
+	init_dos_char_table();
+
+	/* Only warnings and errors, which might explain odd results */
+	LOGLEVEL = 1;
+
+	while ((opt = getopt(argc, argv, "d:l:n:h")) != EOF) {
+		switch (opt) {
+		case 'd':
+			LOGLEVEL = atoi(optarg);
+			break;
+		case 'l':
+			open_log_file(optarg);
+			break;
+		case 'n':
+			times = atoi(optarg);
+			break;
+		case 'h':
+			usage();
+			exit(0);
+		default:
+			usage();
+			exit(1);
+		}
+	}
+
+	if (argc - optind < 2 || times < 1) {
+		usage();
+		exit(1);
+	}
+
+	if (!trace_load(argv[optind], &t)) {
+		fprintf(stderr, "Failed to load trace %s: %s\n", argv[optind],
+		        strerror(errno));
+		exit(1);
+	}
+
+	for (i = optind + 1; i < argc; i++) {
+		add_share(argv[i]);
+	}
+	replay_init();
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < times; i++) {
+		pass = t;
+		replay(&pass);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	print_report((end.tv_sec - start.tv_sec) +
+	             (end.tv_nsec - start.tv_nsec) / 1e9);
+
+	return 0;
+}
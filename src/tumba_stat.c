@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2025-2026 Simon Howard
+ *
+ * You can redistribute and/or modify this program under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation, or any later version. This program is distributed WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* tumba_stat shows what a running tumba_smbd is doing, by reading the stats
+   segment that it shares between its processes: the clients that are
+   connected, and the counts and latencies of the SMB commands it has
+   handled since it started. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "guards.h" /* IWYU pragma: keep */
+#include "server.h"
+#include "stats.h"
+#include "stattable.h"
+#include "version.h"
+
+static const struct stats_segment *segment;
+
+static void open_segment(int port)
+{
+	char name[32];
+	int fd;
+
+	snprintf(name, sizeof(name), STATS_SEGMENT_NAME, port);
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		fprintf(stderr,
+		        "Failed to open %s: %s\n"
+		        "Is tumba_smbd running on port %d?\n",
+		        name, strerror(errno), port);
+		exit(1);
+	}
+
+	segment = mmap(NULL, sizeof(struct stats_segment), PROT_READ,
+	               MAP_SHARED, fd, 0);
+	close(fd);
+	if (segment == MAP_FAILED) {
+		fprintf(stderr, "Failed to map %s: %s\n", name,
+		        strerror(errno));
+		exit(1);
+	}
+
+	if (segment->magic != STATS_SEGMENT_MAGIC ||
+	    segment->version != STATS_SEGMENT_VERSION) {
+		fprintf(stderr, "%s is not a stats segment that this version "
+		                "of tumba_stat understands\n",
+		        name);
+		exit(1);
+	}
+}
+
+static void format_duration(char *buf, size_t buf_len, time_t t)
+{
+	long secs = t < 0 ? 0 : (long) t;
+	long mins = secs / 60, hours = mins / 60, days = hours / 24;
+
+	if (days > 0) {
+		snprintf(buf, buf_len, "%ldd%02ldh", days, hours % 24);
+	} else if (hours > 0) {
+		snprintf(buf, buf_len, "%ldh%02ldm", hours, mins % 60);
+	} else {
+		snprintf(buf, buf_len, "%ldm%02lds", mins, secs % 60);
+	}
+}
+
+static void show_sessions(time_t now)
+{
+	const struct session_stats *ss;
+	char connected[32], idle[32];
+	const char *command;
+	int i;
+
+	printf("%-8s %-16s %-9s %-9s %-16s %10s %12s %12s %6s\n", "PID",
+	       "CLIENT", "CONNECTED", "IDLE", "COMMAND", "REQUESTS",
+	       "BYTES IN", "BYTES OUT", "FILES");
+
+	for (i = 0; i < STATS_MAX_SESSIONS; i++) {
+		ss = &segment->sessions[i];
+
+		/* skip slots left behind by processes that have gone */
+		if (ss->pid == 0 || (kill(ss->pid, 0) != 0 && errno == ESRCH)) {
+			continue;
+		}
+
+		format_duration(connected, sizeof(connected),
+		                now - ss->start_time);
+		if (ss->current_command >= 0) {
+			command = segment->command_names[ss->current_command];
+			snprintf(idle, sizeof(idle), "-");
+		} else {
+			command = "-";
+			format_duration(idle, sizeof(idle),
+			                now - ss->last_activity);
+		}
+
+		printf("%-8ld %-16s %-9s %-9s %-16s %10" PRIu64 " %12" PRIu64
+		       " %12" PRIu64 " %6d\n",
+		       (long) ss->pid, ss->addr, connected, idle, command,
+		       ss->requests, ss->bytes_in, ss->bytes_out,
+		       ss->open_files);
+	}
+}
+
+static const char *command_name(int type)
+{
+	return segment->command_names[type];
+}
+
+static void show_status(int port)
+{
+	time_t now = time(NULL);
+	char uptime[32];
+
+	format_duration(uptime, sizeof(uptime), now - segment->start_time);
+	printf("tumba_smbd (pid %ld) on port %d, up %s\n\n",
+	       (long) segment->server_pid, port, uptime);
+
+	show_sessions(now);
+	printf("\n");
+	stats_print_table(&segment->totals, command_name);
+}
+
+static void usage(void)
+{
+	printf(PACKAGE_STRING
+	       "\n"
+	       "Usage: tumba_stat [-i seconds] [-p port]\n\n"
+	       "  -i seconds    repeat every given number of seconds\n"
+	       "  -p port       show the server on this port (default %d)\n",
+	       SMB_PORT);
+}
+
+int main(int argc, char *argv[])
+{
+	int port = SMB_PORT;
+	int interval = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:p:h")) != EOF) {
+		switch (opt) {
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'h':
+			usage();
+			exit(0);
+		default:
+			usage();
+			exit(1);
+		}
+	}
+
+	open_segment(port);
+
+	while (true) {
+		show_status(port);
+		if (interval <= 0) {
+			break;
+		}
+		sleep(interval);
+		printf("\n");
+	}
+
+	return 0;
+}
@@ -24,7 +24,6 @@
 #include <string.h>
 #include <strings.h>
 #include <sys/param.h>
-#include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <syslog.h>
@@ -32,12 +31,31 @@
 
 #include "byteorder.h"
 #include "guards.h" /* IWYU pragma: keep */
+#include "reactor.h"
 #include "smb.h"
+#include "stats.h"
 #include "timefunc.h"
 
 /* To which file do our syslog messages go? */
 #define SYSLOG_FACILITY LOG_DAEMON
 
+/* Size of the per-session buffer for data read from the client. Several small
+   pipelined requests fit in here; reads bigger than this go straight to the
+   caller's buffer instead. */
+#define RECV_BUFFER_SIZE (16 * 1024)
+
+/* Data already read from the client but not yet consumed. */
+struct recv_buffer {
+	int fd;
+	int start, end;
+	char data[RECV_BUFFER_SIZE];
+};
+
+static struct recv_buffer *recv_buf = NULL;
+
+/* Number of read calls made on the client socket; see process_smb() */
+int recv_syscalls = 0;
+
 char client_addr[32] = "";
 
 /* By default we log NOTICE messages and above ("normal, but significant,
@@ -62,6 +80,11 @@ int smb_read_error = 0;
 
 static bool log_start_of_line = true;
 
+/* If set, this is called by FATAL() before the program exits. It does not
+   have to return; the server uses it to end just the one failing session
+   when a process is serving several clients. */
+void (*fatal_exit_hook)(void) = NULL;
+
 void setup_logging(const char *pname)
 {
 	char *p = strrchr(pname, '/');
@@ -135,6 +158,15 @@ void startup_error(const char *funcname, const char *format_str, ...)
 	exit(1);
 }
 
+/* Called by the FATAL macro after the error has been logged. */
+void fatal_exit(void)
+{
+	if (fatal_exit_hook != NULL) {
+		fatal_exit_hook();
+	}
+	exit(1);
+}
+
 /* Write a message to the log file. This is called by the LOG macro. */
 int log_output(const char *funcname, int linenum, int level,
                const char *format_str, ...)
@@ -181,21 +213,21 @@ int log_output(const char *funcname, int linenum, int level,
 	return 0;
 }
 
-/* Check if a file exists */
-bool file_exist(const char *fname, struct stat *sbuf)
+/* Check if a file exists; fname is relative to the directory dirfd */
+bool file_exist(int dirfd, const char *fname, struct stat *sbuf)
 {
 	struct stat st;
 	if (!sbuf)
 		sbuf = &st;
 
-	if (stat(fname, sbuf) != 0)
+	if (fstatat(dirfd, fname, sbuf, 0) != 0)
 		return false;
 
 	return S_ISREG(sbuf->st_mode);
 }
 
-/* Check if a directory exists */
-bool directory_exist(const char *dname, struct stat *st)
+/* Check if a directory exists; dname is relative to the directory dirfd */
+bool directory_exist(int dirfd, const char *dname, struct stat *st)
 {
 	struct stat st2;
 	bool ret;
@@ -203,7 +235,7 @@ bool directory_exist(const char *dname, struct stat *st)
 	if (!st)
 		st = &st2;
 
-	if (stat(dname, st) != 0)
+	if (fstatat(dirfd, dname, st, 0) != 0)
 		return false;
 
 	ret = S_ISDIR(st->st_mode);
@@ -362,6 +394,13 @@ int smb_offset(const char *p, char *buf)
 	return PTR_DIFF(p, buf + 4) + chain_size;
 }
 
+/* Most SMB replies only have room for 32-bit file sizes, so larger files are
+   shown as being as large as possible rather than wrapping around. */
+uint32_t size32(off_t size)
+{
+	return MIN(size, (off_t) UINT32_MAX);
+}
+
 static void close_low_fd(int fd, int flags)
 {
 	int new_fd;
@@ -405,6 +444,75 @@ static int write_socket(int fd, char *buf, int len)
 	return ret;
 }
 
+struct recv_buffer *recv_buffer_new(int fd)
+{
+	struct recv_buffer *rb = checked_malloc(sizeof(struct recv_buffer));
+
+	rb->fd = fd;
+	rb->start = 0;
+	rb->end = 0;
+
+	return rb;
+}
+
+void recv_buffer_free(struct recv_buffer *rb)
+{
+	if (recv_buf == rb) {
+		recv_buf = NULL;
+	}
+	free(rb);
+}
+
+/* Make rb the buffer used for reads from its fd, ie. the current client. */
+void recv_buffer_select(struct recv_buffer *rb)
+{
+	recv_buf = rb;
+}
+
+/* Returns true if there is data from fd already buffered, so there is no
+   need to wait for it to become readable. */
+bool recv_buffer_has_data(int fd)
+{
+	return recv_buf != NULL && recv_buf->fd == fd &&
+	       recv_buf->start < recv_buf->end;
+}
+
+/* Read up to n bytes from fd. For the client socket, this takes data from the
+   receive buffer first, and refills it with as much as is available in a
+   single read, so that back-to-back requests do not each need their own
+   system calls. Returns the same as read(). */
+int read_buffered(int fd, char *buf, int n)
+{
+	struct recv_buffer *rb = recv_buf;
+	int ret;
+
+	if (rb == NULL || rb->fd != fd) {
+		return read(fd, buf, n);
+	}
+
+	if (rb->start == rb->end) {
+		++recv_syscalls;
+
+		/* no point staging large reads through the buffer */
+		if (n >= RECV_BUFFER_SIZE) {
+			return read(fd, buf, n);
+		}
+
+		ret = read(fd, rb->data, RECV_BUFFER_SIZE);
+		if (ret <= 0) {
+			return ret;
+		}
+		rb->start = 0;
+		rb->end = ret;
+	}
+
+	n = MIN(n, rb->end - rb->start);
+	memcpy(buf, rb->data + rb->start, n);
+	rb->start += n;
+
+	return n;
+}
+
 /*
 Read data from a device with a timout in msec.
 mincount = if timeout, minimum to read before returning
@@ -413,11 +521,9 @@ maxcount = number to be read.
 static int read_with_timeout(int fd, char *buf, int mincnt, int maxcnt,
                              long time_out)
 {
-	fd_set fds;
 	int selrtn;
 	int readret;
 	int nread = 0;
-	struct timeval timeout;
 
 	/* just checking .... */
 	if (maxcnt <= 0)
@@ -431,7 +537,7 @@ static int read_with_timeout(int fd, char *buf, int mincnt, int maxcnt,
 			mincnt = maxcnt;
 
 		while (nread < mincnt) {
-			readret = read(fd, buf + nread, maxcnt - nread);
+			readret = read_buffered(fd, buf + nread, maxcnt - nread);
 			if (readret == 0) {
 				smb_read_error = READ_EOF;
 				return -1;
@@ -450,18 +556,14 @@ static int read_with_timeout(int fd, char *buf, int mincnt, int maxcnt,
 	/* If this is ever called on a disk file and
 	       mincnt is greater then the filesize then
 	       system performance will suffer severely as
-	       select always return true on disk files */
+	       poll always returns true on disk files */
 
 	for (nread = 0; nread < mincnt;) {
-		do {
-			FD_ZERO(&fds);
-			FD_SET(fd, &fds);
-
-			timeout.tv_sec = time_out / 1000;
-			timeout.tv_usec = 1000 * (time_out % 1000);
-
-			selrtn = select(fd + 1, &fds, NULL, NULL, &timeout);
-		} while (selrtn < 0 && errno == EINTR);
+		if (recv_buffer_has_data(fd)) {
+			selrtn = 1;
+		} else {
+			selrtn = reactor_wait_fd(fd, time_out);
+		}
 
 		/* Check if error */
 		if (selrtn == -1) {
@@ -476,7 +578,7 @@ static int read_with_timeout(int fd, char *buf, int mincnt, int maxcnt,
 			return -1;
 		}
 
-		readret = read(fd, buf + nread, maxcnt - nread);
+		readret = read_buffered(fd, buf + nread, maxcnt - nread);
 		if (readret == 0) {
 			/* we got EOF on the file descriptor */
 			smb_read_error = READ_EOF;
@@ -505,7 +607,7 @@ int read_data(int fd, char *buffer, int N)
 	smb_read_error = 0;
 
 	while (total < N) {
-		ret = read(fd, buffer + total, N - total);
+		ret = read_buffered(fd, buffer + total, N - total);
 		if (ret == 0) {
 			smb_read_error = READ_EOF;
 			return 0;
@@ -519,6 +621,25 @@ int read_data(int fd, char *buffer, int N)
 	return total;
 }
 
+/* Write all N bytes to a file at the given offset. */
+int pwrite_data(int fd, char *buffer, int N, off_t offset)
+{
+	int total = 0;
+	int ret;
+
+	while (total < N) {
+		ret = pwrite(fd, buffer + total, N - total, offset + total);
+
+		if (ret == -1)
+			return -1;
+		if (ret == 0)
+			return total;
+
+		total += ret;
+	}
+	return total;
+}
+
 int write_data(int fd, char *buffer, int N)
 {
 	int total = 0;
@@ -606,6 +727,7 @@ bool send_smb(int fd, char *buffer)
 		}
 		nwritten += ret;
 	}
+	stats_count_sent(len);
 
 	return true;
 }
@@ -13,6 +13,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/types.h>
 
 #include "strfunc.h"
 
@@ -45,7 +46,7 @@
 #define FATAL(...)                                                             \
 	do {                                                                   \
 		ERROR(__VA_ARGS__);                                            \
-		exit(1);                                                       \
+		fatal_exit();                                                  \
 	} while (0)
 #define CHECK_OR_FATAL(cond, ...)                                              \
 	do {                                                                   \
@@ -60,6 +61,7 @@
 #define checked_malloc(bytes) checked_realloc(NULL, bytes)
 #define arrlen(x)             (sizeof(x) / sizeof(*(x)))
 
+struct recv_buffer;
 struct stat;
 
 extern int client_fd;
@@ -69,15 +71,18 @@ extern int LOGLEVEL;
 extern int Protocol;
 extern int chain_size;
 extern char client_addr[32];
+extern void (*fatal_exit_hook)(void);
+extern int recv_syscalls;
 
 void setup_logging(const char *pname);
 void open_log_file(const char *filename);
 void startup_error(const char *funcname, const char *format_str, ...)
     PRINTF_ATTRIBUTE(2, 3) NORETURN_ATTRIBUTE;
+void fatal_exit(void) NORETURN_ATTRIBUTE;
 int log_output(const char *funcname, int linenum, int level,
                const char *format_str, ...) PRINTF_ATTRIBUTE(4, 5);
-bool file_exist(const char *fname, struct stat *sbuf);
-bool directory_exist(const char *dname, struct stat *st);
+bool file_exist(int dirfd, const char *fname, struct stat *sbuf);
+bool directory_exist(int dirfd, const char *dname, struct stat *st);
 void show_msg(char *buf);
 int smb_len(const char *buf);
 void _smb_setlen(char *buf, int len);
@@ -86,8 +91,15 @@ int set_message(char *buf, int num_words, int num_bytes, bool zero);
 int smb_buflen(const char *buf);
 char *smb_buf(char *buf);
 int smb_offset(const char *p, char *buf);
+uint32_t size32(off_t size);
 void close_low_fds(void);
+struct recv_buffer *recv_buffer_new(int fd);
+void recv_buffer_free(struct recv_buffer *rb);
+void recv_buffer_select(struct recv_buffer *rb);
+bool recv_buffer_has_data(int fd);
+int read_buffered(int fd, char *buf, int n);
 int read_data(int fd, char *buffer, int N);
+int pwrite_data(int fd, char *buffer, int N, off_t offset);
 int write_data(int fd, char *buffer, int N);
 int read_smb_length_return_keepalive(int fd, char *inbuf, int timeout);
 int read_smb_length(int fd, char *inbuf, int timeout);